@@ -0,0 +1,4 @@
+-- Many distinct nested queryids, meant to be run with track = all and a low
+-- pg_stat_statements.max so that entries are constantly evicted.
+\set n random(0, 3999)
+SELECT pgsk_bench_churn(:n);
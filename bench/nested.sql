@@ -0,0 +1,3 @@
+-- Nested statements from PL/pgSQL, meant to be run with track = all.
+\set aid random(1, 100000 * :scale)
+SELECT pgsk_bench_nested(:aid, 10, :scale);
@@ -0,0 +1,4 @@
+-- Short single-row lookups, the most sensitive case for a fixed per-statement
+-- overhead.
+\set aid random(1, 100000 * :scale)
+SELECT abalance FROM pgbench_accounts WHERE aid = :aid;
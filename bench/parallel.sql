@@ -0,0 +1,4 @@
+-- Parallel sequential scans, meant to be run with a cheap parallel setup so
+-- that each execution starts workers.
+\set bid random(1, :scale)
+SELECT count(*) FROM pgbench_accounts WHERE bid = :bid;
@@ -0,0 +1,146 @@
+#!/bin/bash
+#
+# Compare the throughput and latency of pgbench workloads with and without
+# pg_stat_kcache loaded.  A temporary instance is created with the binaries of
+# $PG_CONFIG and restarted for each configuration.  The baseline loads
+# pg_stat_statements only, since pg_stat_kcache depends on it, so that the
+# difference only includes pg_stat_kcache's own overhead.
+#
+# Settings can be overridden through the environment:
+#   PG_CONFIG   pg_config of the installation to use (default: pg_config)
+#   SCALE       pgbench scale factor (default: 10)
+#   CLIENTS     number of pgbench clients (default: number of CPUs)
+#   DURATION    duration of each run, in seconds (default: 30)
+#   WORKLOADS   workloads to run (default: oltp nested churn parallel)
+#   PORT        port of the temporary instance (default: 5499)
+#   OUTDIR      where the instance and the results are kept (default: a
+#               temporary directory, removed at the end)
+#   EXTRA_OPTS  additional server options for both configurations
+
+set -e
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+PG_CONFIG=${PG_CONFIG:-pg_config}
+SCALE=${SCALE:-10}
+CLIENTS=${CLIENTS:-$(nproc 2>/dev/null || echo 4)}
+DURATION=${DURATION:-30}
+WORKLOADS=${WORKLOADS:-"oltp nested churn parallel"}
+PORT=${PORT:-5499}
+EXTRA_OPTS=${EXTRA_OPTS:-}
+
+BINDIR=$("$PG_CONFIG" --bindir)
+
+if [ -z "$OUTDIR" ]; then
+	OUTDIR=$(mktemp -d -t pgsk_bench.XXXXXX)
+	trap 'stop_server; rm -rf "$OUTDIR"' EXIT
+else
+	mkdir -p "$OUTDIR"
+	trap 'stop_server' EXIT
+fi
+
+PGDATA="$OUTDIR/data"
+export PGHOST="$OUTDIR" PGPORT="$PORT" PGDATABASE=postgres
+
+stop_server()
+{
+	if [ -f "$PGDATA/postmaster.pid" ]; then
+		"$BINDIR/pg_ctl" -D "$PGDATA" -m fast -w stop > /dev/null
+	fi
+}
+
+# $1: shared_preload_libraries
+start_server()
+{
+	"$BINDIR/pg_ctl" -D "$PGDATA" -l "$OUTDIR/postgres.log" -w \
+		-o "-p $PORT -k $OUTDIR -c listen_addresses='' \
+			-c shared_preload_libraries='$1' \
+			-c max_connections=$((CLIENTS + 20)) \
+			-c pg_stat_statements.max=1000 \
+			$EXTRA_OPTS" \
+		start > /dev/null
+}
+
+# Session settings of each workload
+workload_options()
+{
+	case "$1" in
+		nested|churn)
+			# the statements are run by plpgsql, so they're all nested
+			echo "-c pg_stat_statements.track=all -c pg_stat_kcache.track=all"
+			;;
+		parallel)
+			echo "-c max_parallel_workers_per_gather=4 -c parallel_setup_cost=0" \
+				"-c parallel_tuple_cost=0 -c min_parallel_table_scan_size=0"
+			;;
+	esac
+}
+
+# Print the p50, p95 and p99 latencies, in ms, of the given pgbench logs
+percentiles()
+{
+	cat "$@" | awk '{ print $3 / 1000 }' | sort -n | awk '
+		function rank(p) { return NR * p >= 1 ? int(NR * p) : 1 }
+		{ lat[NR] = $1 }
+		END {
+			if (NR == 0) { print "- - -"; exit }
+			printf "%.3f %.3f %.3f\n", lat[rank(0.50)], lat[rank(0.95)],
+				lat[rank(0.99)]
+		}'
+}
+
+# $1: workload, $2: configuration name
+run_workload()
+{
+	local prefix="$OUTDIR/${1}_${2}"
+	local tps
+
+	rm -f "$prefix".*
+	tps=$(PGOPTIONS="$(workload_options "$1")" "$BINDIR/pgbench" -n \
+		-s "$SCALE" -c "$CLIENTS" -j "$CLIENTS" -T "$DURATION" \
+		-f "$BENCHDIR/$1.sql" -l --log-prefix="$prefix" 2> "$prefix.err" \
+		| awk '/^tps = / { tps = $3 } END { print tps }')
+
+	echo "$1 $2 $tps $(percentiles "$prefix".[0-9]*)"
+}
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust -N > "$OUTDIR/initdb.log"
+
+start_server "pg_stat_statements"
+"$BINDIR/pgbench" -i -q -s "$SCALE" > "$OUTDIR/pgbench_init.log" 2>&1
+"$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -f "$BENCHDIR/setup.sql"
+"$BINDIR/psql" -X -q -c "CREATE EXTENSION pg_stat_statements"
+stop_server
+
+RESULTS="$OUTDIR/results"
+: > "$RESULTS"
+
+for config in baseline pg_stat_kcache; do
+	if [ "$config" = "baseline" ]; then
+		start_server "pg_stat_statements"
+	else
+		start_server "pg_stat_statements,pg_stat_kcache"
+		"$BINDIR/psql" -X -q -c "CREATE EXTENSION IF NOT EXISTS pg_stat_kcache"
+	fi
+
+	for workload in $WORKLOADS; do
+		run_workload "$workload" "$config" | tee -a "$RESULTS"
+	done
+
+	stop_server
+done
+
+echo
+awk '
+	BEGIN {
+		printf "%-10s %-16s %12s %8s %10s %10s %10s\n", "workload",
+			"configuration", "tps", "delta", "p50 (ms)", "p95 (ms)", "p99 (ms)"
+	}
+	{
+		if ($2 == "baseline")
+			base[$1] = $3
+		delta = "-"
+		if ($2 != "baseline" && base[$1] > 0)
+			delta = sprintf("%.2f%%", ($3 - base[$1]) * 100 / base[$1])
+		printf "%-10s %-16s %12.1f %8s %10s %10s %10s\n", $1, $2, $3, delta,
+			$4, $5, $6
+	}' "$RESULTS"
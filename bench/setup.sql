@@ -0,0 +1,40 @@
+-- Objects used by the pg_stat_kcache benchmark scripts, on top of a database
+-- initialized by pgbench -i.
+
+-- Run the given number of nested single-row lookups, tracked as nested
+-- statements with pg_stat_kcache.track = all.
+CREATE OR REPLACE FUNCTION pgsk_bench_nested(aid integer, loops integer,
+                                             scale integer)
+RETURNS integer
+LANGUAGE plpgsql AS
+$$
+DECLARE
+    naccounts integer := scale * 100000;
+    balance integer;
+    total integer := 0;
+BEGIN
+    FOR i IN 1..loops LOOP
+        SELECT abalance INTO balance
+          FROM pgbench_accounts
+         WHERE pgbench_accounts.aid = (pgsk_bench_nested.aid + i) % naccounts + 1;
+        total := total + balance;
+    END LOOP;
+
+    RETURN total;
+END;
+$$;
+
+-- Run one of 4000 statements having a different queryid, depending on n.
+-- Constants are normalized, so the statements differ by their number of
+-- target entries and their shape.
+CREATE OR REPLACE FUNCTION pgsk_bench_churn(n integer)
+RETURNS void
+LANGUAGE plpgsql AS
+$$
+DECLARE
+    variants text[] := ARRAY['', ' WHERE bid = 1', ' LIMIT 1', ' OFFSET 0'];
+BEGIN
+    EXECUTE 'SELECT ' || repeat('bid, ', n % 1000) || 'bid FROM pgbench_branches'
+        || variants[(n / 1000) % 4 + 1];
+END;
+$$;
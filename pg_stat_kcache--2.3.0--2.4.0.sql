@@ -0,0 +1,873 @@
+-- This program is open source, licensed under the PostgreSQL License.
+-- For license terms, see the LICENSE file.
+--
+-- Copyright (c) 2014-2017, Dalibo
+-- Copyright (c) 2018-2026, The PoWA-team
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION pg_stat_kcache" to load this file. \quit
+
+DROP VIEW pg_stat_kcache_detail;
+DROP VIEW pg_stat_kcache;
+DROP FUNCTION pg_stat_kcache();
+
+CREATE FUNCTION pg_stat_kcache(
+    OUT queryid bigint,
+    OUT top bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    /* planning time */
+    OUT plan_reads       bigint,             /* total reads, in bytes */
+    OUT plan_writes      bigint,             /* total writes, in bytes */
+    OUT plan_user_time   double precision,   /* total user CPU time used */
+    OUT plan_system_time double precision,   /* total system CPU time used */
+    OUT plan_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT plan_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT plan_nswaps      bigint,             /* total swaps */
+    OUT plan_msgsnds     bigint,             /* total IPC messages sent */
+    OUT plan_msgrcvs     bigint,             /* total IPC messages received */
+    OUT plan_nsignals    bigint,             /* total signals received */
+    OUT plan_nvcsws      bigint,             /* total voluntary context switches */
+    OUT plan_nivcsws     bigint,             /* total involuntary context switches */
+    OUT plan_calls       bigint,             /* number of measured planning */
+    OUT plan_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT plan_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT plan_syscr       bigint,             /* total read syscalls */
+    OUT plan_syscw       bigint,             /* total write syscalls */
+    OUT plan_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT plan_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT plan_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT plan_cycles      bigint,             /* total CPU cycles */
+    OUT plan_instructions bigint,            /* total retired instructions */
+    OUT plan_llc_misses  bigint,             /* total last level cache misses */
+    OUT plan_branch_misses bigint,           /* total mispredicted branches */
+    OUT plan_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT plan_elapsed_time double precision,  /* total wall clock time */
+    OUT plan_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT plan_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* execution time */
+    OUT exec_reads       bigint,             /* total reads, in bytes */
+    OUT exec_writes      bigint,             /* total writes, in bytes */
+    OUT exec_user_time   double precision,   /* total user CPU time used */
+    OUT exec_system_time double precision,   /* total system CPU time used */
+    OUT exec_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT exec_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT exec_nswaps      bigint,             /* total swaps */
+    OUT exec_msgsnds     bigint,             /* total IPC messages sent */
+    OUT exec_msgrcvs     bigint,             /* total IPC messages received */
+    OUT exec_nsignals    bigint,             /* total signals received */
+    OUT exec_nvcsws      bigint,             /* total voluntary context switches */
+    OUT exec_nivcsws     bigint,             /* total involuntary context switches */
+    OUT exec_calls       bigint,             /* number of measured executions */
+    OUT exec_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT exec_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT exec_syscr       bigint,             /* total read syscalls */
+    OUT exec_syscw       bigint,             /* total write syscalls */
+    OUT exec_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT exec_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT exec_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT exec_cycles      bigint,             /* total CPU cycles */
+    OUT exec_instructions bigint,            /* total retired instructions */
+    OUT exec_llc_misses  bigint,             /* total last level cache misses */
+    OUT exec_branch_misses bigint,           /* total mispredicted branches */
+    OUT exec_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT exec_elapsed_time double precision,  /* total wall clock time */
+    OUT exec_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT exec_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    OUT workers          bigint,             /* total parallel workers that reported */
+    OUT worker_user_time double precision,   /* total user CPU time used by the parallel workers */
+    OUT worker_system_time double precision, /* total system CPU time used by the parallel workers */
+    OUT worker_reads     bigint,             /* total reads by the parallel workers, in bytes */
+    OUT worker_writes    bigint,             /* total writes by the parallel workers, in bytes */
+    OUT nested_calls     bigint,             /* total nested statements executed */
+    OUT exec_self_user_time double precision, /* user CPU time, without the nested statements */
+    OUT exec_self_system_time double precision, /* system CPU time, without the nested statements */
+    OUT exec_self_reads  bigint,             /* reads in bytes, without the nested statements */
+    OUT exec_self_writes bigint,             /* writes in bytes, without the nested statements */
+    OUT exec_self_elapsed_time double precision, /* wall clock time, without the nested statements */
+    /* metadata */
+    OUT stats_since     timestamptz         /* entry creation time */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_2_4';
+GRANT ALL ON FUNCTION pg_stat_kcache() TO public;
+
+-- same as pg_stat_kcache(), restricted to the given dbid, userid and queryid,
+-- NULL meaning no restriction
+CREATE FUNCTION pg_stat_kcache(
+    IN in_dbid   oid,
+    IN in_userid oid,
+    IN in_queryid bigint,
+    OUT queryid bigint,
+    OUT top bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    /* planning time */
+    OUT plan_reads       bigint,             /* total reads, in bytes */
+    OUT plan_writes      bigint,             /* total writes, in bytes */
+    OUT plan_user_time   double precision,   /* total user CPU time used */
+    OUT plan_system_time double precision,   /* total system CPU time used */
+    OUT plan_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT plan_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT plan_nswaps      bigint,             /* total swaps */
+    OUT plan_msgsnds     bigint,             /* total IPC messages sent */
+    OUT plan_msgrcvs     bigint,             /* total IPC messages received */
+    OUT plan_nsignals    bigint,             /* total signals received */
+    OUT plan_nvcsws      bigint,             /* total voluntary context switches */
+    OUT plan_nivcsws     bigint,             /* total involuntary context switches */
+    OUT plan_calls       bigint,             /* number of measured planning */
+    OUT plan_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT plan_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT plan_syscr       bigint,             /* total read syscalls */
+    OUT plan_syscw       bigint,             /* total write syscalls */
+    OUT plan_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT plan_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT plan_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT plan_cycles      bigint,             /* total CPU cycles */
+    OUT plan_instructions bigint,            /* total retired instructions */
+    OUT plan_llc_misses  bigint,             /* total last level cache misses */
+    OUT plan_branch_misses bigint,           /* total mispredicted branches */
+    OUT plan_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT plan_elapsed_time double precision,  /* total wall clock time */
+    OUT plan_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT plan_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* execution time */
+    OUT exec_reads       bigint,             /* total reads, in bytes */
+    OUT exec_writes      bigint,             /* total writes, in bytes */
+    OUT exec_user_time   double precision,   /* total user CPU time used */
+    OUT exec_system_time double precision,   /* total system CPU time used */
+    OUT exec_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT exec_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT exec_nswaps      bigint,             /* total swaps */
+    OUT exec_msgsnds     bigint,             /* total IPC messages sent */
+    OUT exec_msgrcvs     bigint,             /* total IPC messages received */
+    OUT exec_nsignals    bigint,             /* total signals received */
+    OUT exec_nvcsws      bigint,             /* total voluntary context switches */
+    OUT exec_nivcsws     bigint,             /* total involuntary context switches */
+    OUT exec_calls       bigint,             /* number of measured executions */
+    OUT exec_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT exec_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT exec_syscr       bigint,             /* total read syscalls */
+    OUT exec_syscw       bigint,             /* total write syscalls */
+    OUT exec_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT exec_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT exec_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT exec_cycles      bigint,             /* total CPU cycles */
+    OUT exec_instructions bigint,            /* total retired instructions */
+    OUT exec_llc_misses  bigint,             /* total last level cache misses */
+    OUT exec_branch_misses bigint,           /* total mispredicted branches */
+    OUT exec_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT exec_elapsed_time double precision,  /* total wall clock time */
+    OUT exec_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT exec_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    OUT workers          bigint,             /* total parallel workers that reported */
+    OUT worker_user_time double precision,   /* total user CPU time used by the parallel workers */
+    OUT worker_system_time double precision, /* total system CPU time used by the parallel workers */
+    OUT worker_reads     bigint,             /* total reads by the parallel workers, in bytes */
+    OUT worker_writes    bigint,             /* total writes by the parallel workers, in bytes */
+    OUT nested_calls     bigint,             /* total nested statements executed */
+    OUT exec_self_user_time double precision, /* user CPU time, without the nested statements */
+    OUT exec_self_system_time double precision, /* system CPU time, without the nested statements */
+    OUT exec_self_reads  bigint,             /* reads in bytes, without the nested statements */
+    OUT exec_self_writes bigint,             /* writes in bytes, without the nested statements */
+    OUT exec_self_elapsed_time double precision, /* wall clock time, without the nested statements */
+    /* metadata */
+    OUT stats_since     timestamptz         /* entry creation time */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_2_4_filter';
+GRANT ALL ON FUNCTION pg_stat_kcache(oid, oid, bigint) TO public;
+
+CREATE FUNCTION pg_stat_kcache_changes(
+    IN since bigint,
+    OUT queryid bigint,
+    OUT top bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    /* planning time */
+    OUT plan_reads       bigint,             /* total reads, in bytes */
+    OUT plan_writes      bigint,             /* total writes, in bytes */
+    OUT plan_user_time   double precision,   /* total user CPU time used */
+    OUT plan_system_time double precision,   /* total system CPU time used */
+    OUT plan_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT plan_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT plan_nswaps      bigint,             /* total swaps */
+    OUT plan_msgsnds     bigint,             /* total IPC messages sent */
+    OUT plan_msgrcvs     bigint,             /* total IPC messages received */
+    OUT plan_nsignals    bigint,             /* total signals received */
+    OUT plan_nvcsws      bigint,             /* total voluntary context switches */
+    OUT plan_nivcsws     bigint,             /* total involuntary context switches */
+    OUT plan_calls       bigint,             /* number of measured planning */
+    OUT plan_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT plan_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT plan_syscr       bigint,             /* total read syscalls */
+    OUT plan_syscw       bigint,             /* total write syscalls */
+    OUT plan_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT plan_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT plan_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT plan_cycles      bigint,             /* total CPU cycles */
+    OUT plan_instructions bigint,            /* total retired instructions */
+    OUT plan_llc_misses  bigint,             /* total last level cache misses */
+    OUT plan_branch_misses bigint,           /* total mispredicted branches */
+    OUT plan_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT plan_elapsed_time double precision,  /* total wall clock time */
+    OUT plan_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT plan_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* execution time */
+    OUT exec_reads       bigint,             /* total reads, in bytes */
+    OUT exec_writes      bigint,             /* total writes, in bytes */
+    OUT exec_user_time   double precision,   /* total user CPU time used */
+    OUT exec_system_time double precision,   /* total system CPU time used */
+    OUT exec_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT exec_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT exec_nswaps      bigint,             /* total swaps */
+    OUT exec_msgsnds     bigint,             /* total IPC messages sent */
+    OUT exec_msgrcvs     bigint,             /* total IPC messages received */
+    OUT exec_nsignals    bigint,             /* total signals received */
+    OUT exec_nvcsws      bigint,             /* total voluntary context switches */
+    OUT exec_nivcsws     bigint,             /* total involuntary context switches */
+    OUT exec_calls       bigint,             /* number of measured executions */
+    OUT exec_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT exec_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT exec_syscr       bigint,             /* total read syscalls */
+    OUT exec_syscw       bigint,             /* total write syscalls */
+    OUT exec_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT exec_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT exec_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT exec_cycles      bigint,             /* total CPU cycles */
+    OUT exec_instructions bigint,            /* total retired instructions */
+    OUT exec_llc_misses  bigint,             /* total last level cache misses */
+    OUT exec_branch_misses bigint,           /* total mispredicted branches */
+    OUT exec_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT exec_elapsed_time double precision,  /* total wall clock time */
+    OUT exec_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT exec_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    OUT workers          bigint,             /* total parallel workers that reported */
+    OUT worker_user_time double precision,   /* total user CPU time used by the parallel workers */
+    OUT worker_system_time double precision, /* total system CPU time used by the parallel workers */
+    OUT worker_reads     bigint,             /* total reads by the parallel workers, in bytes */
+    OUT worker_writes    bigint,             /* total writes by the parallel workers, in bytes */
+    OUT nested_calls     bigint,             /* total nested statements executed */
+    OUT exec_self_user_time double precision, /* user CPU time, without the nested statements */
+    OUT exec_self_system_time double precision, /* system CPU time, without the nested statements */
+    OUT exec_self_reads  bigint,             /* reads in bytes, without the nested statements */
+    OUT exec_self_writes bigint,             /* writes in bytes, without the nested statements */
+    OUT exec_self_elapsed_time double precision, /* wall clock time, without the nested statements */
+    /* metadata */
+    OUT stats_since     timestamptz,        /* entry creation time */
+    OUT generation      bigint              /* since value for the next call */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_changes';
+GRANT ALL ON FUNCTION pg_stat_kcache_changes(bigint) TO public;
+
+CREATE FUNCTION pg_stat_kcache_histogram(
+    OUT queryid bigint,
+    OUT top bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    OUT metric      text,               /* exec_time or exec_reads */
+    OUT bucket      integer,            /* bucket number */
+    OUT lower_bound double precision,   /* inclusive, in seconds or bytes */
+    OUT upper_bound double precision,   /* exclusive, NULL for the last bucket */
+    OUT count       bigint              /* number of executions */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_histogram';
+GRANT ALL ON FUNCTION pg_stat_kcache_histogram() TO public;
+
+CREATE FUNCTION pg_stat_kcache_percentiles(
+    OUT queryid bigint,
+    OUT top bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    OUT metric      text,               /* exec_time or exec_reads */
+    OUT count       bigint,             /* number of executions */
+    OUT p50         double precision,   /* estimated median */
+    OUT p95         double precision,   /* estimated 95th percentile */
+    OUT p99         double precision    /* estimated 99th percentile */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_percentiles';
+GRANT ALL ON FUNCTION pg_stat_kcache_percentiles() TO public;
+
+CREATE FUNCTION pg_stat_kcache_export()
+RETURNS bytea
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_export';
+GRANT ALL ON FUNCTION pg_stat_kcache_export() TO public;
+
+CREATE FUNCTION pg_stat_kcache_history(
+    IN from_ts timestamptz DEFAULT NULL,
+    IN to_ts   timestamptz DEFAULT NULL,
+    OUT ts          timestamptz,         /* end of the sampled interval */
+    OUT queryid     bigint,
+    OUT top         bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    OUT plan_calls  bigint,              /* number of measured planning */
+    OUT exec_calls  bigint,              /* number of measured executions */
+    OUT user_time   double precision,    /* user CPU time used */
+    OUT system_time double precision,    /* system CPU time used */
+    OUT reads       bigint,              /* reads, in bytes */
+    OUT writes      bigint,              /* writes, in bytes */
+    OUT minflts     bigint,              /* page reclaims (soft page faults) */
+    OUT majflts     bigint,              /* page faults (hard page faults) */
+    OUT nvcsws      bigint,              /* voluntary context switches */
+    OUT nivcsws     bigint,              /* involuntary context switches */
+    OUT rchar       bigint,              /* bytes read, including from the page cache */
+    OUT wchar       bigint,              /* bytes written, including to the page cache */
+    OUT read_bytes  bigint,              /* bytes read from the storage layer */
+    OUT write_bytes bigint               /* bytes sent to the storage layer */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_history';
+GRANT ALL ON FUNCTION pg_stat_kcache_history(timestamptz, timestamptz) TO public;
+
+-- executions of the events ring, removed once returned
+CREATE FUNCTION pg_stat_kcache_events(
+    IN max_events integer DEFAULT NULL,
+    OUT ts          timestamptz,         /* end of the execution */
+    OUT pid         integer,             /* backend that ran the statement */
+    OUT queryid     bigint,
+    OUT top         bool,
+    OUT userid      oid,
+    OUT dbid        oid,
+    OUT user_time   double precision,    /* user CPU time used */
+    OUT system_time double precision,    /* system CPU time used */
+    OUT reads       bigint,              /* reads, in bytes */
+    OUT writes      bigint,              /* writes, in bytes */
+    OUT minflts     bigint,              /* page reclaims (soft page faults) */
+    OUT majflts     bigint,              /* page faults (hard page faults) */
+    OUT nvcsws      bigint,              /* voluntary context switches */
+    OUT nivcsws     bigint,              /* involuntary context switches */
+    OUT rchar       bigint,              /* bytes read, including from the page cache */
+    OUT wchar       bigint,              /* bytes written, including to the page cache */
+    OUT read_bytes  bigint,              /* bytes read from the storage layer */
+    OUT write_bytes bigint,              /* bytes sent to the storage layer */
+    OUT elapsed_time double precision    /* wall clock time */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_events';
+REVOKE ALL ON FUNCTION pg_stat_kcache_events(integer) FROM public;
+
+-- running top-level statements, with the resources they used so far
+CREATE FUNCTION pg_stat_kcache_activity(
+    OUT pid         integer,
+    OUT userid      oid,
+    OUT dbid        oid,
+    OUT queryid     bigint,
+    OUT query_start timestamptz,
+    OUT user_time   double precision,    /* user CPU time used */
+    OUT system_time double precision,    /* system CPU time used */
+    OUT minflts     bigint,              /* page reclaims (soft page faults) */
+    OUT majflts     bigint,              /* page faults (hard page faults) */
+    OUT reads       bigint,              /* reads, in bytes */
+    OUT writes      bigint,              /* writes, in bytes */
+    OUT nvcsws      bigint,              /* voluntary context switches */
+    OUT nivcsws     bigint               /* involuntary context switches */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_activity';
+GRANT ALL ON FUNCTION pg_stat_kcache_activity() TO public;
+
+-- running totals of the top-level statements of each database
+CREATE FUNCTION pg_stat_kcache_database(
+    OUT dbid        oid,
+    /* planning time */
+    OUT plan_reads       bigint,             /* total reads, in bytes */
+    OUT plan_writes      bigint,             /* total writes, in bytes */
+    OUT plan_user_time   double precision,   /* total user CPU time used */
+    OUT plan_system_time double precision,   /* total system CPU time used */
+    OUT plan_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT plan_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT plan_nswaps      bigint,             /* total swaps */
+    OUT plan_msgsnds     bigint,             /* total IPC messages sent */
+    OUT plan_msgrcvs     bigint,             /* total IPC messages received */
+    OUT plan_nsignals    bigint,             /* total signals received */
+    OUT plan_nvcsws      bigint,             /* total voluntary context switches */
+    OUT plan_nivcsws     bigint,             /* total involuntary context switches */
+    OUT plan_calls       bigint,             /* number of measured planning */
+    OUT plan_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT plan_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT plan_syscr       bigint,             /* total read syscalls */
+    OUT plan_syscw       bigint,             /* total write syscalls */
+    OUT plan_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT plan_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT plan_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT plan_cycles      bigint,             /* total CPU cycles */
+    OUT plan_instructions bigint,            /* total retired instructions */
+    OUT plan_llc_misses  bigint,             /* total last level cache misses */
+    OUT plan_branch_misses bigint,           /* total mispredicted branches */
+    OUT plan_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT plan_elapsed_time double precision,  /* total wall clock time */
+    OUT plan_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT plan_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* execution time */
+    OUT exec_reads       bigint,             /* total reads, in bytes */
+    OUT exec_writes      bigint,             /* total writes, in bytes */
+    OUT exec_user_time   double precision,   /* total user CPU time used */
+    OUT exec_system_time double precision,   /* total system CPU time used */
+    OUT exec_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT exec_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT exec_nswaps      bigint,             /* total swaps */
+    OUT exec_msgsnds     bigint,             /* total IPC messages sent */
+    OUT exec_msgrcvs     bigint,             /* total IPC messages received */
+    OUT exec_nsignals    bigint,             /* total signals received */
+    OUT exec_nvcsws      bigint,             /* total voluntary context switches */
+    OUT exec_nivcsws     bigint,             /* total involuntary context switches */
+    OUT exec_calls       bigint,             /* number of measured executions */
+    OUT exec_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT exec_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT exec_syscr       bigint,             /* total read syscalls */
+    OUT exec_syscw       bigint,             /* total write syscalls */
+    OUT exec_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT exec_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT exec_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT exec_cycles      bigint,             /* total CPU cycles */
+    OUT exec_instructions bigint,            /* total retired instructions */
+    OUT exec_llc_misses  bigint,             /* total last level cache misses */
+    OUT exec_branch_misses bigint,           /* total mispredicted branches */
+    OUT exec_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT exec_elapsed_time double precision,  /* total wall clock time */
+    OUT exec_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT exec_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* metadata */
+    OUT stats_since     timestamptz         /* last reset of the aggregates */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_database';
+GRANT ALL ON FUNCTION pg_stat_kcache_database() TO public;
+
+-- running totals of the top-level statements of each role
+CREATE FUNCTION pg_stat_kcache_user(
+    OUT userid      oid,
+    /* planning time */
+    OUT plan_reads       bigint,             /* total reads, in bytes */
+    OUT plan_writes      bigint,             /* total writes, in bytes */
+    OUT plan_user_time   double precision,   /* total user CPU time used */
+    OUT plan_system_time double precision,   /* total system CPU time used */
+    OUT plan_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT plan_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT plan_nswaps      bigint,             /* total swaps */
+    OUT plan_msgsnds     bigint,             /* total IPC messages sent */
+    OUT plan_msgrcvs     bigint,             /* total IPC messages received */
+    OUT plan_nsignals    bigint,             /* total signals received */
+    OUT plan_nvcsws      bigint,             /* total voluntary context switches */
+    OUT plan_nivcsws     bigint,             /* total involuntary context switches */
+    OUT plan_calls       bigint,             /* number of measured planning */
+    OUT plan_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT plan_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT plan_syscr       bigint,             /* total read syscalls */
+    OUT plan_syscw       bigint,             /* total write syscalls */
+    OUT plan_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT plan_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT plan_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT plan_cycles      bigint,             /* total CPU cycles */
+    OUT plan_instructions bigint,            /* total retired instructions */
+    OUT plan_llc_misses  bigint,             /* total last level cache misses */
+    OUT plan_branch_misses bigint,           /* total mispredicted branches */
+    OUT plan_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT plan_elapsed_time double precision,  /* total wall clock time */
+    OUT plan_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT plan_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* execution time */
+    OUT exec_reads       bigint,             /* total reads, in bytes */
+    OUT exec_writes      bigint,             /* total writes, in bytes */
+    OUT exec_user_time   double precision,   /* total user CPU time used */
+    OUT exec_system_time double precision,   /* total system CPU time used */
+    OUT exec_minflts     bigint,             /* total page reclaims (soft page faults) */
+    OUT exec_majflts     bigint,             /* total page faults (hard page faults) */
+    OUT exec_nswaps      bigint,             /* total swaps */
+    OUT exec_msgsnds     bigint,             /* total IPC messages sent */
+    OUT exec_msgrcvs     bigint,             /* total IPC messages received */
+    OUT exec_nsignals    bigint,             /* total signals received */
+    OUT exec_nvcsws      bigint,             /* total voluntary context switches */
+    OUT exec_nivcsws     bigint,             /* total involuntary context switches */
+    OUT exec_calls       bigint,             /* number of measured executions */
+    OUT exec_rchar       bigint,             /* total bytes read, including from the page cache */
+    OUT exec_wchar       bigint,             /* total bytes written, including to the page cache */
+    OUT exec_syscr       bigint,             /* total read syscalls */
+    OUT exec_syscw       bigint,             /* total write syscalls */
+    OUT exec_read_bytes  bigint,             /* total bytes read from the storage layer */
+    OUT exec_write_bytes bigint,             /* total bytes sent to the storage layer */
+    OUT exec_cancelled_write_bytes bigint, /* total written bytes later truncated */
+    OUT exec_cycles      bigint,             /* total CPU cycles */
+    OUT exec_instructions bigint,            /* total retired instructions */
+    OUT exec_llc_misses  bigint,             /* total last level cache misses */
+    OUT exec_branch_misses bigint,           /* total mispredicted branches */
+    OUT exec_dtlb_misses bigint,             /* total data TLB read misses */
+    OUT exec_elapsed_time double precision,  /* total wall clock time */
+    OUT exec_off_cpu_time double precision,  /* total time not spent on a CPU */
+    OUT exec_io_worker_reads bigint,         /* total shared buffers read, in bytes, see track_worker_io */
+    /* metadata */
+    OUT stats_since     timestamptz         /* last reset of the aggregates */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_user';
+GRANT ALL ON FUNCTION pg_stat_kcache_user() TO public;
+
+CREATE FUNCTION pg_stat_kcache_bench(
+    IN iterations   integer DEFAULT 100000,
+    OUT step        text,             /* capture, compute or store */
+    OUT calls       bigint,
+    OUT total_time  double precision, /* in milliseconds */
+    OUT mean_time   double precision  /* in nanoseconds */
+)
+RETURNS SETOF record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_bench';
+REVOKE ALL ON FUNCTION pg_stat_kcache_bench(integer) FROM public;
+
+CREATE FUNCTION pg_stat_kcache_info(
+    OUT inserts         bigint,
+    OUT deallocs        bigint,
+    OUT evicted         bigint,
+    OUT dealloc_time    double precision, /* in milliseconds */
+    OUT lock_promotions bigint,
+    OUT entries         bigint,
+    OUT max_entries     bigint,
+    OUT saves           bigint,
+    OUT save_time       double precision, /* in milliseconds */
+    OUT load_time       double precision, /* in milliseconds */
+    OUT stats_reset     timestamptz,
+    OUT events_written  bigint,
+    OUT events_dropped  bigint,
+    OUT aggregates_dropped bigint
+)
+RETURNS record
+LANGUAGE c COST 1000
+AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_info';
+GRANT ALL ON FUNCTION pg_stat_kcache_info() TO public;
+
+-- reset the entries matching the given userid, dbid and queryid, NULL meaning
+-- no restriction, or only their histograms
+CREATE FUNCTION pg_stat_kcache_reset(
+    IN in_userid        oid,
+    IN in_dbid          oid,
+    IN in_queryid       bigint,
+    IN histograms_only  boolean DEFAULT false
+)
+    RETURNS void
+    LANGUAGE c COST 1000
+    AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_reset_2_4';
+REVOKE ALL ON FUNCTION pg_stat_kcache_reset(oid, oid, bigint, boolean) FROM public;
+
+-- reset all the entries, each one being zeroed the next time it's accessed
+CREATE FUNCTION pg_stat_kcache_reset_lazy()
+    RETURNS void
+    LANGUAGE c COST 1000
+    AS '$libdir/pg_stat_kcache', 'pg_stat_kcache_reset_lazy';
+REVOKE ALL ON FUNCTION pg_stat_kcache_reset_lazy() FROM public;
+
+CREATE VIEW pg_stat_kcache_detail AS
+SELECT s.query, k.top, d.datname, r.rolname,
+       k.plan_user_time,
+       k.plan_system_time,
+       k.plan_minflts,
+       k.plan_majflts,
+       k.plan_nswaps,
+       k.plan_reads AS plan_reads,
+       k.plan_reads/(current_setting('block_size')::integer) AS plan_reads_blks,
+       k.plan_writes AS plan_writes,
+       k.plan_writes/(current_setting('block_size')::integer) AS plan_writes_blks,
+       k.plan_msgsnds,
+       k.plan_msgrcvs,
+       k.plan_nsignals,
+       k.plan_nvcsws,
+       k.plan_nivcsws,
+       k.plan_calls,
+       k.plan_rchar,
+       k.plan_wchar,
+       k.plan_syscr,
+       k.plan_syscw,
+       k.plan_read_bytes,
+       k.plan_write_bytes,
+       k.plan_cancelled_write_bytes,
+       k.plan_cycles,
+       k.plan_instructions,
+       k.plan_llc_misses,
+       k.plan_branch_misses,
+       k.plan_dtlb_misses,
+       k.plan_elapsed_time,
+       k.plan_off_cpu_time,
+       k.plan_io_worker_reads,
+       k.exec_user_time,
+       k.exec_system_time,
+       k.exec_minflts,
+       k.exec_majflts,
+       k.exec_nswaps,
+       k.exec_reads AS exec_reads,
+       k.exec_reads/(current_setting('block_size')::integer) AS exec_reads_blks,
+       k.exec_writes AS exec_writes,
+       k.exec_writes/(current_setting('block_size')::integer) AS exec_writes_blks,
+       k.exec_msgsnds,
+       k.exec_msgrcvs,
+       k.exec_nsignals,
+       k.exec_nvcsws,
+       k.exec_nivcsws,
+       k.exec_calls,
+       k.exec_rchar,
+       k.exec_wchar,
+       k.exec_syscr,
+       k.exec_syscw,
+       k.exec_read_bytes,
+       k.exec_write_bytes,
+       k.exec_cancelled_write_bytes,
+       k.exec_cycles,
+       k.exec_instructions,
+       k.exec_llc_misses,
+       k.exec_branch_misses,
+       k.exec_dtlb_misses,
+       k.exec_elapsed_time,
+       k.exec_off_cpu_time,
+       k.exec_io_worker_reads,
+       k.workers,
+       k.worker_user_time,
+       k.worker_system_time,
+       k.worker_reads,
+       k.worker_writes,
+       k.nested_calls,
+       k.exec_self_user_time,
+       k.exec_self_system_time,
+       k.exec_self_reads,
+       k.exec_self_writes,
+       k.exec_self_elapsed_time,
+       k.stats_since
+  FROM pg_stat_kcache() k
+  JOIN pg_stat_statements s
+    ON k.queryid = s.queryid AND k.dbid = s.dbid AND k.userid = s.userid
+  JOIN pg_database d
+    ON  d.oid = s.dbid
+  JOIN pg_roles r
+    ON r.oid = s.userid;
+GRANT SELECT ON pg_stat_kcache_detail TO public;
+
+CREATE VIEW pg_stat_kcache AS
+SELECT datname,
+       SUM(plan_user_time) AS plan_user_time,
+       SUM(plan_system_time) AS plan_system_time,
+       SUM(plan_minflts) AS plan_minflts,
+       SUM(plan_majflts) AS plan_majflts,
+       SUM(plan_nswaps) AS plan_nswaps,
+       SUM(plan_reads) AS plan_reads,
+       SUM(plan_reads_blks) AS plan_reads_blks,
+       SUM(plan_writes) AS plan_writes,
+       SUM(plan_writes_blks) AS plan_writes_blks,
+       SUM(plan_msgsnds) AS plan_msgsnds,
+       SUM(plan_msgrcvs) AS plan_msgrcvs,
+       SUM(plan_nsignals) AS plan_nsignals,
+       SUM(plan_nvcsws) AS plan_nvcsws,
+       SUM(plan_nivcsws) AS plan_nivcsws,
+       SUM(plan_calls) AS plan_calls,
+       SUM(plan_rchar) AS plan_rchar,
+       SUM(plan_wchar) AS plan_wchar,
+       SUM(plan_syscr) AS plan_syscr,
+       SUM(plan_syscw) AS plan_syscw,
+       SUM(plan_read_bytes) AS plan_read_bytes,
+       SUM(plan_write_bytes) AS plan_write_bytes,
+       SUM(plan_cancelled_write_bytes) AS plan_cancelled_write_bytes,
+       SUM(plan_cycles) AS plan_cycles,
+       SUM(plan_instructions) AS plan_instructions,
+       SUM(plan_llc_misses) AS plan_llc_misses,
+       SUM(plan_branch_misses) AS plan_branch_misses,
+       SUM(plan_dtlb_misses) AS plan_dtlb_misses,
+       SUM(plan_elapsed_time) AS plan_elapsed_time,
+       SUM(plan_off_cpu_time) AS plan_off_cpu_time,
+       SUM(plan_io_worker_reads) AS plan_io_worker_reads,
+       SUM(exec_user_time) AS exec_user_time,
+       SUM(exec_system_time) AS exec_system_time,
+       SUM(exec_minflts) AS exec_minflts,
+       SUM(exec_majflts) AS exec_majflts,
+       SUM(exec_nswaps) AS exec_nswaps,
+       SUM(exec_reads) AS exec_reads,
+       SUM(exec_reads_blks) AS exec_reads_blks,
+       SUM(exec_writes) AS exec_writes,
+       SUM(exec_writes_blks) AS exec_writes_blks,
+       SUM(exec_msgsnds) AS exec_msgsnds,
+       SUM(exec_msgrcvs) AS exec_msgrcvs,
+       SUM(exec_nsignals) AS exec_nsignals,
+       SUM(exec_nvcsws) AS exec_nvcsws,
+       SUM(exec_nivcsws) AS exec_nivcsws,
+       SUM(exec_calls) AS exec_calls,
+       SUM(exec_rchar) AS exec_rchar,
+       SUM(exec_wchar) AS exec_wchar,
+       SUM(exec_syscr) AS exec_syscr,
+       SUM(exec_syscw) AS exec_syscw,
+       SUM(exec_read_bytes) AS exec_read_bytes,
+       SUM(exec_write_bytes) AS exec_write_bytes,
+       SUM(exec_cancelled_write_bytes) AS exec_cancelled_write_bytes,
+       SUM(exec_cycles) AS exec_cycles,
+       SUM(exec_instructions) AS exec_instructions,
+       SUM(exec_llc_misses) AS exec_llc_misses,
+       SUM(exec_branch_misses) AS exec_branch_misses,
+       SUM(exec_dtlb_misses) AS exec_dtlb_misses,
+       SUM(exec_elapsed_time) AS exec_elapsed_time,
+       SUM(exec_off_cpu_time) AS exec_off_cpu_time,
+       SUM(exec_io_worker_reads) AS exec_io_worker_reads,
+       SUM(workers) AS workers,
+       SUM(worker_user_time) AS worker_user_time,
+       SUM(worker_system_time) AS worker_system_time,
+       SUM(worker_reads) AS worker_reads,
+       SUM(worker_writes) AS worker_writes,
+       SUM(nested_calls) AS nested_calls,
+       SUM(exec_self_user_time) AS exec_self_user_time,
+       SUM(exec_self_system_time) AS exec_self_system_time,
+       SUM(exec_self_reads) AS exec_self_reads,
+       SUM(exec_self_writes) AS exec_self_writes,
+       SUM(exec_self_elapsed_time) AS exec_self_elapsed_time,
+       MIN(stats_since) AS stats_since
+  FROM pg_stat_kcache_detail
+  WHERE top IS TRUE
+  GROUP BY datname;
+GRANT SELECT ON pg_stat_kcache TO public;
+
+CREATE VIEW pg_stat_kcache_database AS
+SELECT a.dbid, c.datname,
+       a.plan_reads AS plan_reads,
+       a.plan_reads/(current_setting('block_size')::integer) AS plan_reads_blks,
+       a.plan_writes AS plan_writes,
+       a.plan_writes/(current_setting('block_size')::integer) AS plan_writes_blks,
+       a.plan_user_time,
+       a.plan_system_time,
+       a.plan_minflts,
+       a.plan_majflts,
+       a.plan_nswaps,
+       a.plan_msgsnds,
+       a.plan_msgrcvs,
+       a.plan_nsignals,
+       a.plan_nvcsws,
+       a.plan_nivcsws,
+       a.plan_calls,
+       a.plan_rchar,
+       a.plan_wchar,
+       a.plan_syscr,
+       a.plan_syscw,
+       a.plan_read_bytes,
+       a.plan_write_bytes,
+       a.plan_cancelled_write_bytes,
+       a.plan_cycles,
+       a.plan_instructions,
+       a.plan_llc_misses,
+       a.plan_branch_misses,
+       a.plan_dtlb_misses,
+       a.plan_elapsed_time,
+       a.plan_off_cpu_time,
+       a.plan_io_worker_reads,
+       a.exec_reads AS exec_reads,
+       a.exec_reads/(current_setting('block_size')::integer) AS exec_reads_blks,
+       a.exec_writes AS exec_writes,
+       a.exec_writes/(current_setting('block_size')::integer) AS exec_writes_blks,
+       a.exec_user_time,
+       a.exec_system_time,
+       a.exec_minflts,
+       a.exec_majflts,
+       a.exec_nswaps,
+       a.exec_msgsnds,
+       a.exec_msgrcvs,
+       a.exec_nsignals,
+       a.exec_nvcsws,
+       a.exec_nivcsws,
+       a.exec_calls,
+       a.exec_rchar,
+       a.exec_wchar,
+       a.exec_syscr,
+       a.exec_syscw,
+       a.exec_read_bytes,
+       a.exec_write_bytes,
+       a.exec_cancelled_write_bytes,
+       a.exec_cycles,
+       a.exec_instructions,
+       a.exec_llc_misses,
+       a.exec_branch_misses,
+       a.exec_dtlb_misses,
+       a.exec_elapsed_time,
+       a.exec_off_cpu_time,
+       a.exec_io_worker_reads,
+       a.stats_since
+  FROM pg_stat_kcache_database() a
+  JOIN pg_database c
+    ON c.oid = a.dbid;
+GRANT SELECT ON pg_stat_kcache_database TO public;
+
+CREATE VIEW pg_stat_kcache_user AS
+SELECT a.userid, c.rolname,
+       a.plan_reads AS plan_reads,
+       a.plan_reads/(current_setting('block_size')::integer) AS plan_reads_blks,
+       a.plan_writes AS plan_writes,
+       a.plan_writes/(current_setting('block_size')::integer) AS plan_writes_blks,
+       a.plan_user_time,
+       a.plan_system_time,
+       a.plan_minflts,
+       a.plan_majflts,
+       a.plan_nswaps,
+       a.plan_msgsnds,
+       a.plan_msgrcvs,
+       a.plan_nsignals,
+       a.plan_nvcsws,
+       a.plan_nivcsws,
+       a.plan_calls,
+       a.plan_rchar,
+       a.plan_wchar,
+       a.plan_syscr,
+       a.plan_syscw,
+       a.plan_read_bytes,
+       a.plan_write_bytes,
+       a.plan_cancelled_write_bytes,
+       a.plan_cycles,
+       a.plan_instructions,
+       a.plan_llc_misses,
+       a.plan_branch_misses,
+       a.plan_dtlb_misses,
+       a.plan_elapsed_time,
+       a.plan_off_cpu_time,
+       a.plan_io_worker_reads,
+       a.exec_reads AS exec_reads,
+       a.exec_reads/(current_setting('block_size')::integer) AS exec_reads_blks,
+       a.exec_writes AS exec_writes,
+       a.exec_writes/(current_setting('block_size')::integer) AS exec_writes_blks,
+       a.exec_user_time,
+       a.exec_system_time,
+       a.exec_minflts,
+       a.exec_majflts,
+       a.exec_nswaps,
+       a.exec_msgsnds,
+       a.exec_msgrcvs,
+       a.exec_nsignals,
+       a.exec_nvcsws,
+       a.exec_nivcsws,
+       a.exec_calls,
+       a.exec_rchar,
+       a.exec_wchar,
+       a.exec_syscr,
+       a.exec_syscw,
+       a.exec_read_bytes,
+       a.exec_write_bytes,
+       a.exec_cancelled_write_bytes,
+       a.exec_cycles,
+       a.exec_instructions,
+       a.exec_llc_misses,
+       a.exec_branch_misses,
+       a.exec_dtlb_misses,
+       a.exec_elapsed_time,
+       a.exec_off_cpu_time,
+       a.exec_io_worker_reads,
+       a.stats_since
+  FROM pg_stat_kcache_user() a
+  JOIN pg_roles c
+    ON c.oid = a.userid;
+GRANT SELECT ON pg_stat_kcache_user TO public;
+
+CREATE VIEW pg_stat_kcache_info AS
+SELECT * FROM pg_stat_kcache_info();
+GRANT SELECT ON pg_stat_kcache_info TO public;
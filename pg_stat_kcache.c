@@ -15,7 +15,14 @@
 
 #include "postgres.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 /*
  * pg16 removed the configure probe for getrusage. Simply define it for all
@@ -39,27 +46,50 @@
 #endif		/* pg16- */
 
 #include "access/hash.h"
+#include "access/htup_details.h"
 #if PG_VERSION_NUM >= 90600
 #include "access/parallel.h"
 #endif
+#include "access/xact.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_database.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 #include "executor/executor.h"
 #include "funcapi.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
 #if PG_VERSION_NUM >= 130000
 #include "optimizer/planner.h"
 #endif
 #include "pgstat.h"
+#if PG_VERSION_NUM >= 90500
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#endif
 #if PG_VERSION_NUM >= 90600
 #include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
 #endif
 #if PG_VERSION_NUM >= 120000
 #include "replication/walsender.h"
 #endif
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#if PG_VERSION_NUM >= 90600
+#include "storage/latch.h"
+#endif
 #include "storage/spin.h"
+#if PG_VERSION_NUM >= 140000
+#include "tcop/utility.h"
+#endif
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#if PG_VERSION_NUM < 90500
+#include "utils/pg_crc.h"
+#endif
 #if PG_VERSION_NUM >= 160000
 #include "utils/pg_rusage.h"
 #endif
@@ -75,6 +105,15 @@ PG_MODULE_MAGIC;
 #define PGSK_DUMP_FILE		"global/pg_stat_kcache.stat"
 #endif
 
+/* pg 9.5 introduced port/pg_crc32c.h, 9.4 provides the same CRC in pg_crc.h */
+#if PG_VERSION_NUM < 90500
+typedef pg_crc32 pg_crc32c;
+#define INIT_CRC32C(crc)			INIT_CRC32(crc)
+#define COMP_CRC32C(crc, data, len)	COMP_CRC32(crc, data, len)
+#define FIN_CRC32C(crc)				FIN_CRC32(crc)
+#define EQ_CRC32C(c1, c2)			EQ_CRC32(c1, c2)
+#endif
+
 /* In PostgreSQL 11, queryid becomes a uint64 internally.
  */
 #if PG_VERSION_NUM >= 110000
@@ -88,6 +127,9 @@ typedef uint32 pgsk_queryid;
 #define USAGE_DEALLOC_PERCENT	5		/* free this % of entries at once */
 #define USAGE_INIT				(1.0)	/* including initial planning */
 
+#define EVICTION_SAMPLES		8		/* # of entries considered by the
+										   sample eviction strategy */
+
 #define TIMEVAL_DIFF(start, end) ((double) end.tv_sec + (double) end.tv_usec / 1000000.0) \
 	- ((double) start.tv_sec + (double) start.tv_usec / 1000000.0)
 
@@ -102,6 +144,81 @@ typedef uint32 pgsk_queryid;
 
 #define PGSK_MAX_NESTED_LEVEL		64
 
+/*
+ * With atomics support (pg9.5+), the shared counters are updated without any
+ * lock, see pgsk_entry_accum().  Older versions rely on a spinlock per entry.
+ */
+#if PG_VERSION_NUM >= 90500
+#define PGSK_USE_ATOMICS
+#endif
+
+/*
+ * Clock used to measure CPU time with clock_gettime(), if supported.  The
+ * backends are single-threaded, so the thread clock gives the same result as
+ * the process one.
+ */
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+#define PGSK_CPUTIME_CLOCK			CLOCK_THREAD_CPUTIME_ID
+#elif defined(CLOCK_PROCESS_CPUTIME_ID)
+#define PGSK_CPUTIME_CLOCK			CLOCK_PROCESS_CPUTIME_ID
+#endif
+
+/* Per-process I/O accounting, see proc(5) */
+#ifdef __linux__
+#define PGSK_HAVE_PROC_IO
+#define PGSK_PROC_IO_PATH			"/proc/self/io"
+#endif
+
+/* Hardware performance counters, see perf_event_open(2) */
+#if defined(__linux__) && defined(SYS_perf_event_open)
+#define PGSK_HAVE_PERF_EVENT
+#define PGSK_PERF_NUM_EVENTS		5
+#endif
+
+#define TIMESPEC_DIFF(start, end) ((double) end.tv_sec + (double) end.tv_nsec / 1000000000.0) \
+	- ((double) start.tv_sec + (double) start.tv_nsec / 1000000000.0)
+
+/* Fixed-point encoding of the CPU times in the shared counters */
+#define PGSK_NS_PER_S				1000000000.0
+
+/*
+ * Maximum number of times a reader retries to get a consistent snapshot of
+ * an entry being concurrently updated, see pgsk_entry_snapshot().
+ */
+#define PGSK_SNAPSHOT_MAX_RETRIES	1000
+
+/*
+ * Flag set in the epoch of an entry being reset, see pgsk_entry_check_epoch().
+ */
+#define PGSK_EPOCH_RESETTING		(UINT64CONST(1) << 63)
+
+/*
+ * Number of partitions of the shared hashtable, each having its own lock.
+ * Must be a power of 2.  The partition is chosen using the high-order bits of
+ * the hash code, as dynahash uses the low-order ones to choose the bucket.
+ */
+#define PGSK_NUM_PARTITIONS_LOG2	4
+#define PGSK_NUM_PARTITIONS			(1 << PGSK_NUM_PARTITIONS_LOG2)
+#define PGSK_PARTITION(hashcode) \
+	((hashcode) >> (32 - PGSK_NUM_PARTITIONS_LOG2))
+
+/*
+ * One lock per partition, plus one for the claims of the aggregate slots, and
+ * with PostgreSQL 9.6 and later one for the history ring and one for the
+ * consumers of the events ring
+ */
+#if PG_VERSION_NUM >= 90600
+#define PGSK_NUM_LOCKS				(PGSK_NUM_PARTITIONS + 3)
+#else
+#define PGSK_NUM_LOCKS				(PGSK_NUM_PARTITIONS + 1)
+#endif
+
+/* Maximum number of entries buffered locally when flush_interval is set */
+#define PGSK_LOCAL_MAX_ENTRIES		256
+
+/* queryid of the entry used by pg_stat_kcache_bench(), not added to events */
+#define PGSK_BENCH_QUERYID			((pgsk_queryid) 0x70677362)
+
 /*
  * Extension version number, for supporting older extension versions' objects
  */
@@ -110,18 +227,150 @@ typedef enum pgskVersion
 	PGSK_V2_0 = 0,
 	PGSK_V2_1,
 	PGSK_V2_2,
-	PGSK_V2_3
+	PGSK_V2_3,
+	PGSK_V2_4
 } pgskVersion;
 
-/* Magic number identifying the stats file format */
-static const uint32 PGSK_FILE_HEADER = 0x20240914;
+/*
+ * Optional restrictions on the entries returned by pg_stat_kcache_internal()
+ */
+typedef struct pgskFilter
+{
+	bool		has_userid;
+	Oid			userid;
+	bool		has_dbid;
+	Oid			dbid;
+	bool		has_queryid;
+	pgsk_queryid queryid;
+	bool		changes;		/* only return entries changed since "since" */
+	uint64		since;
+} pgskFilter;
+
+/*
+ * Each entry has one set of counters per pgskStoreKind, plus one set for the
+ * part of the executions done by parallel workers, which is also included in
+ * the PGSK_EXEC set, and one set for the tracked statements called during the
+ * executions, also included in the PGSK_EXEC set.  The calls of the
+ * PGSK_WORKERS set count the workers that reported, and the ones of the
+ * PGSK_NESTED set the nested statements executed.
+ */
+#define PGSK_WORKERS		PGSK_NUMKIND
+#define PGSK_NESTED			(PGSK_NUMKIND + 1)
+#define PGSK_NUMSETS		(PGSK_NUMKIND + 2)
+
+/*
+ * Serialized records, used both for the stats file and by
+ * pg_stat_kcache_export().  All the fields are stored in little-endian order,
+ * and the layout is documented in the README.  A header of
+ * PGSK_RECORD_HEADER_SIZE bytes is followed by an array of records of the
+ * advertised size, each being the key, the stats_since timestamp, the usage
+ * and PGSK_RECORD_NCOUNTERS counters per set, in the documented order,
+ * optionally followed by the histograms.  The stats file is additionally
+ * terminated by the CRC32C of all the previous bytes.  Bump
+ * PGSK_RECORD_VERSION if the layout changes.
+ */
+#define PGSK_RECORD_MAGIC			0x4B534750	/* "PGSK" */
+#define PGSK_RECORD_VERSION			6
+#define PGSK_RECORD_HAS_HIST		0x0001		/* histograms follow */
+#define PGSK_RECORD_HEADER_SIZE		24
+#define PGSK_RECORD_NCOUNTERS		28
+#define PGSK_RECORD_BASE_SIZE \
+	(40 + PGSK_NUMSETS * PGSK_RECORD_NCOUNTERS * sizeof(uint64))
+#define PGSK_RECORD_HIST_SIZE \
+	(PGSK_NUM_HISTS * PGSK_HIST_BUCKETS * sizeof(uint64))
+#define PGSK_RECORD_MAX_SIZE \
+	(PGSK_RECORD_BASE_SIZE + PGSK_RECORD_HIST_SIZE)
+#define PGSK_RECORD_CRC_SIZE		4
+
+/* Record position in the stats file buffer, used to select what to load */
+typedef struct pgskLoadItem
+{
+	const char *record;			/* start of the serialized record */
+	uint32		hashcode;		/* hash code of its key */
+	double		usage;			/* its usage factor */
+} pgskLoadItem;
+
+/*
+ * Resource usage snapshot, taken at the start and at the end of each
+ * measured operation.  The end snapshot must be taken using the same timing
+ * method as the start one.
+ */
+typedef struct pgskUsage
+{
+	bool			sampled;	/* false if the capture was skipped */
+	int				timing;		/* pg_stat_kcache.timing when captured */
+	instr_time		wallclock;	/* wall clock time */
+	struct rusage	rusage;		/* getrusage() counters, if captured */
+#ifdef PGSK_CPUTIME_CLOCK
+	struct timespec	cputime;	/* clock_gettime() CPU time, if captured */
+#endif
+#ifdef PGSK_HAVE_PROC_IO
+	bool			has_io;		/* whether io was captured */
+	pgskCounters	io;			/* /proc/self/io counters, if captured */
+#endif
+#ifdef PGSK_HAVE_PERF_EVENT
+	bool			has_perf;	/* whether perf counters were captured */
+	uint64			perf_enabled;	/* time the event group was enabled */
+	uint64			perf_running;	/* time the event group was running */
+	uint64			perf[PGSK_PERF_NUM_EVENTS];	/* raw event values */
+#endif
+#if PG_VERSION_NUM >= 180000
+	int64			shared_blks_read;	/* pgBufferUsage, see
+										   pg_stat_kcache.track_worker_io */
+#endif
+} pgskUsage;
 
-static struct	rusage exec_rusage_start[PGSK_MAX_NESTED_LEVEL];
+static pgskUsage exec_rusage_start[PGSK_MAX_NESTED_LEVEL];
 #if PG_VERSION_NUM >= 130000
-static struct	rusage plan_rusage_start[PGSK_MAX_NESTED_LEVEL];
+static pgskUsage plan_rusage_start[PGSK_MAX_NESTED_LEVEL];
+#endif
+
+/*
+ * Resource usage accumulated around the ExecutorRun and ExecutorFinish calls
+ * of an executor, with pg_stat_kcache.exec_accounting = run, so that the time
+ * a cursor or a portal spends waiting between two fetches isn't counted.  It's
+ * allocated in the executor's memory context, and unlinked from
+ * pgsk_run_states when that context is released, including on error.
+ */
+typedef struct pgskRunState
+{
+	QueryDesc  *queryDesc;		/* the executor being measured */
+	int			timing;			/* timing method chosen at ExecutorStart */
+	pgskCounters counters;		/* accumulated resource usage */
+#if PG_VERSION_NUM >= 90500
+	MemoryContextCallback callback;	/* unlinks the state */
 #endif
+	struct pgskRunState *next;
+} pgskRunState;
+
+static pgskRunState *pgsk_run_states = NULL;
+
+/*
+ * Counters of the statements that completed at each nesting level, not yet
+ * attributed to the statement that called them, see pgsk_nested_collect().
+ * pgsk_nested_max is the deepest level having counters, or -1.
+ */
+static pgskCounters pgsk_nested_usage[PGSK_MAX_NESTED_LEVEL];
+static int	pgsk_nested_max = -1;
+
+static int	pgsk_max = 0;	/* max #queries to store, pg_stat_kcache.max or
+							   pg_stat_statements.max */
+static int	pgsk_partition_max = 0;	/* max #queries to store per partition */
+
+/*
+ * Layout of the counters stored in each shared hashtable entry, see
+ * pgsk_setlayout().
+ */
+static bool pgsk_entry_has_plan = true;	/* planning counters are stored */
+static bool pgsk_entry_full = true;		/* all rusage counters are stored */
+static Size pgsk_entry_counters_size = 0;	/* size of one counter set */
+static Size pgsk_entry_hist_offset = 0;	/* offset of the histograms */
 
-static int	pgsk_max = 0;	/* max #queries to store. pg_stat_statements.max is used */
+/*
+ * Number of entries of each partition preallocated at startup, the others
+ * are allocated from the reserved shared memory the first time they're used.
+ */
+#define PGSK_PARTITION_INIT_SIZE	64
 
 /*
  * Hashtable key that defines the identity of a hashtable entry.  We use the
@@ -135,29 +384,361 @@ typedef struct pgskHashKey
 	bool		top;		/* whether statement is top level */
 } pgskHashKey;
 
+#ifdef PGSK_USE_ATOMICS
+/*
+ * Shared version of pgskCounters, updated with atomic operations.  CPU times
+ * are stored as a number of nanoseconds.
+ */
+typedef struct pgskSharedCounters
+{
+	pg_atomic_uint64	calls;		/* number of measured planning or executions */
+	pg_atomic_uint64	utime;		/* CPU user time */
+	pg_atomic_uint64	stime;		/* CPU system time */
+#ifdef HAVE_GETRUSAGE
+	pg_atomic_uint64	minflts;	/* page reclaims (soft page faults) */
+	pg_atomic_uint64	majflts;	/* page faults (hard page faults) */
+	pg_atomic_uint64	reads;		/* Physical block reads */
+	pg_atomic_uint64	writes;		/* Physical block writes */
+	pg_atomic_uint64	nvcsws;		/* voluntary context witches */
+	pg_atomic_uint64	nivcsws;	/* unvoluntary context witches */
+#endif
+	pg_atomic_uint64	rchar;		/* bytes read, including from the page cache */
+	pg_atomic_uint64	wchar;		/* bytes written, including to the page cache */
+	pg_atomic_uint64	syscr;		/* read syscalls */
+	pg_atomic_uint64	syscw;		/* write syscalls */
+	pg_atomic_uint64	read_bytes;	/* bytes read from the storage layer */
+	pg_atomic_uint64	write_bytes;	/* bytes sent to the storage layer */
+	pg_atomic_uint64	cancelled_write_bytes;	/* written bytes later truncated */
+	pg_atomic_uint64	cycles;		/* CPU cycles */
+	pg_atomic_uint64	instructions;	/* retired instructions */
+	pg_atomic_uint64	llc_misses;	/* last level cache misses */
+	pg_atomic_uint64	branch_misses;	/* mispredicted branches */
+	pg_atomic_uint64	dtlb_misses;	/* data TLB read misses */
+	pg_atomic_uint64	elapsed;	/* wall clock time, in ns */
+	pg_atomic_uint64	io_worker_reads;	/* shared buffers read, possibly by
+											   the I/O workers */
+	pg_atomic_uint64	rusage_calls;	/* calls that measured getrusage() */
+#ifdef HAVE_GETRUSAGE
+	/* Must be last, not stored in entries with the compact layout */
+	pg_atomic_uint64	nswaps;		/* swaps */
+	pg_atomic_uint64	msgsnds;	/* IPC messages sent */
+	pg_atomic_uint64	msgrcvs;	/* IPC messages received */
+	pg_atomic_uint64	nsignals;	/* signals received */
+#endif
+} pgskSharedCounters;
+
+/*
+ * Linux never maintains the swaps, IPC messages and signals counters of
+ * getrusage(), so the compact layout doesn't store them.
+ */
+#if defined(HAVE_GETRUSAGE) && defined(__linux__)
+#define PGSK_COMPACT_RUSAGE
+#endif
+
+typedef pgskSharedCounters pgskEntryCounters;
+#else
+typedef pgskCounters pgskEntryCounters;
+#endif
+
 /*
  * Statistics per database
+ *
+ * With atomics support, writers don't take any lock on the entry.  Each
+ * writer increments changes_started before updating the counters and
+ * changes_done after, so a reader knows that it got a consistent snapshot if
+ * changes_started was equal to the value of changes_done it read before
+ * copying the counters.  The usage factor is stored as a double, and updated
+ * with a compare-and-exchange loop.
+ *
+ * Without atomics support, the counters and the usage factor are protected by
+ * the mutex.
+ *
+ * The counter sets are stored right after the pgskEntry, and are accessed with
+ * pgsk_entry_counters() since their number and size depend on the layout
+ * chosen at startup, see pgsk_setlayout().  The histograms, if any, follow.
  */
 typedef struct pgskEntry
 {
 	pgskHashKey		key;		/* hash key of entry - MUST BE FIRST */
-	pgskCounters	counters[PGSK_NUMKIND];	/* statistics for this query */
-	slock_t			mutex;		/* protects the counters only */
-	TimestampTz		stats_since; /* timestamp of entry allocation */
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_uint64	usage;	/* usage factor */
+	pg_atomic_uint32	changes_started;	/* # of started updates */
+	pg_atomic_uint32	changes_done;		/* # of finished updates */
+#else
+	double			usage;		/* usage factor */
+	slock_t			mutex;		/* protects the usage and the counters */
+#endif
+	TimestampTz		stats_since; /* timestamp of entry allocation or reset */
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_uint64	generation;	/* global generation at last update */
+	pg_atomic_uint64	epoch;		/* global epoch at last reset */
+#else
+	uint64			generation;	/* global generation at last update */
+	uint64			epoch;		/* global epoch at last reset */
+#endif
+	int				slot;		/* position in the partition's slots array */
+	bool			referenced;	/* used since last clock sweep */
 } pgskEntry;
 
+/*
+ * Optional per-entry histograms of the executions, stored right after the
+ * counter sets of the entry in the shared hashtable if pg_stat_kcache.track_histograms is
+ * enabled.  Bucket 0 counts the executions with a value lower than 1 unit,
+ * and bucket N those with a value in [2^(N-1), 2^N) units, except for the last
+ * bucket which has no upper bound.  The CPU time (user + system) unit is a
+ * microsecond and the reads unit is a RUSAGE_BLOCK_SIZE block, so the last
+ * bucket respectively starts at about 18 minutes and 512GB.
+ */
+#define PGSK_HIST_BUCKETS			32
+
+typedef enum pgskHistKind
+{
+	PGSK_HIST_TIME = 0,
+	PGSK_HIST_READS,
+
+	PGSK_NUM_HISTS				/* Must be last value of this enum */
+} pgskHistKind;
+
+typedef struct pgskHistogram
+{
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_uint64	buckets[PGSK_NUM_HISTS][PGSK_HIST_BUCKETS];
+#else
+	uint64				buckets[PGSK_NUM_HISTS][PGSK_HIST_BUCKETS];
+#endif
+} pgskHistogram;
+
+/* Plain copy of a pgskHistogram */
+typedef struct pgskHistCounts
+{
+	uint64		buckets[PGSK_NUM_HISTS][PGSK_HIST_BUCKETS];
+} pgskHistCounts;
+
+#define PGSK_ENTRY_HIST(entry) \
+	((pgskHistogram *) ((char *) (entry) + pgsk_entry_hist_offset))
+
+/*
+ * Backend-local entry, used to accumulate counters before merging them into
+ * the shared hashtable when pg_stat_kcache.flush_interval is set.  The usage
+ * to add is accumulated in counters[0].usage, as for shared entries.
+ */
+typedef struct pgskLocalEntry
+{
+	pgskHashKey		key;		/* hash key of entry - MUST BE FIRST */
+	uint32			hashcode;	/* hash code of the key */
+	pgskCounters	counters[PGSK_NUMSETS];	/* pending statistics */
+	pgskHistCounts	hist;		/* pending histograms, if tracked */
+} pgskLocalEntry;
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Per-backend slot used for parallel queries.  The queryid isn't pushed to
+ * parallel workers, so the leader publishes the queryid of its current
+ * statement here.  Instead of updating the entry themselves, its workers add
+ * their counters to the slot, and the leader merges them into its own entry
+ * with a single update once the workers are done.
+ *
+ * If pg_stat_kcache.track_activity is enabled, the backend also publishes its
+ * current top-level statement and the process counters at its start, so that
+ * pg_stat_kcache_activity() can compute the resources used so far.
+ */
+typedef struct pgskParallelSlot
+{
+	pgsk_queryid	queryid;	/* statement of the leader, 0 if not tracked */
+	slock_t			mutex;		/* protects the following fields */
+	pgsk_queryid	workers_queryid;	/* statement the counters belong to */
+	pgskCounters	workers;	/* sum of the workers' counters */
+	pgsk_queryid	activity_queryid;	/* top-level statement, 0 if none */
+	int				activity_pid;		/* backend running it */
+	Oid				activity_userid;	/* user running it */
+	Oid				activity_dbid;		/* database it runs in */
+	TimestampTz		activity_start;		/* start of the statement */
+	pgskCounters	activity_usage;		/* process counters at the start */
+} pgskParallelSlot;
+#endif
+
+/*
+ * Counters of the extension's own activity, see pg_stat_kcache_info().
+ */
+typedef enum pgskStatKind
+{
+	PGSK_STAT_INSERTS = 0,		/* entries created */
+	PGSK_STAT_DEALLOCS,			/* calls to pgsk_entry_dealloc() */
+	PGSK_STAT_EVICTED,			/* entries evicted */
+	PGSK_STAT_DEALLOC_TIME,		/* time spent evicting entries, in us */
+	PGSK_STAT_PROMOTIONS,		/* entries not found with a shared lock */
+	PGSK_STAT_AGG_DROPPED,		/* activity not aggregated, no free slot */
+	PGSK_STAT_SAVES,			/* stats file writes */
+	PGSK_STAT_SAVE_TIME,		/* time spent writing the stats file, in us */
+	PGSK_STAT_LOAD_TIME,		/* time spent loading the stats file, in us */
+	PGSK_STAT_RESET,			/* TimestampTz of the last reset */
+
+	PGSK_NUM_STATS				/* Must be last value of this enum */
+} pgskStatKind;
+
 /*
  * Global shared state
  */
 typedef struct pgskSharedState
 {
-	LWLock	   *lock;					/* protects hashtable search/modification */
+	LWLock	   *locks[PGSK_NUM_PARTITIONS];	/* protect search/modification
+											   of each hashtable partition */
+	LWLock	   *agg_lock;		/* serializes the claims and releases of the
+								   aggregate slots */
+	int			clock_hands[PGSK_NUM_PARTITIONS];	/* next slot considered
+													   by the clock eviction */
+	double		median_usage[PGSK_NUM_PARTITIONS];	/* at the last eviction,
+													   see pgsk_entry_alloc() */
+	TimestampTz	agg_stats_since;	/* last reset of the aggregates */
+	bool		entry_has_plan;	/* entries store the planning counters */
+	TimestampTz	epoch_since;	/* time of the last lazy reset */
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_uint64	generation;	/* see pgsk_next_generation() */
+	pg_atomic_uint64	epoch;		/* see pgsk_entry_check_epoch() */
+	pg_atomic_uint64	stats[PGSK_NUM_STATS];	/* see pgskStatKind */
+#else
+	uint64		generation;		/* see pgsk_next_generation() */
+	uint64		epoch;			/* see pgsk_entry_check_epoch() */
+	uint64		stats[PGSK_NUM_STATS];	/* see pgskStatKind */
+	slock_t		mutex;			/* protects the generation, the epoch and
+								   the stats */
+#endif
 #if PG_VERSION_NUM >= 90600
-	pgsk_queryid	queryids[FLEXIBLE_ARRAY_MEMBER]; /* queryid info for
-														parallel leaders */
+	pgskParallelSlot parallel[FLEXIBLE_ARRAY_MEMBER]; /* one per backend */
 #endif
 } pgskSharedState;
 
+/*
+ * Running totals of the top-level statements of each database and role,
+ * maintained as the entries are updated so that they're not affected by
+ * evictions.
+ */
+typedef enum pgskAggKind
+{
+	PGSK_AGG_DATABASE = 0,
+	PGSK_AGG_USER,
+
+	PGSK_NUM_AGGS				/* Must be last value of this enum */
+} pgskAggKind;
+
+/* State of an aggregate slot */
+typedef enum pgskAggSlotState
+{
+	PGSK_AGG_SLOT_FREE = 0,		/* never used since the last reset */
+	PGSK_AGG_SLOT_USED,			/* holds the totals of its oid */
+	PGSK_AGG_SLOT_RELEASED		/* its oid was dropped, can be reused */
+} pgskAggSlotState;
+
+/*
+ * There are pg_stat_kcache.max_aggregates slots per aggregate kind, found by
+ * linear probing.  A slot is claimed for an oid the first time it's used, and
+ * released once the database or role is dropped.  A released slot doesn't end
+ * a lookup, so that the oids claimed after it are still found, but can be
+ * reused by the next claim.  The lookups don't take any lock, but the claims
+ * and releases are serialized by the agg_lock.  All the slots are freed by a
+ * full reset.
+ */
+typedef struct pgskAggEntry
+{
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_uint32	state;	/* see pgskAggSlotState */
+	pg_atomic_uint32	oid;	/* only meaningful if the slot is used */
+	pgskSharedCounters	counters[PGSK_NUMKIND];	/* the running totals */
+#else
+	int			state;			/* see pgskAggSlotState */
+	Oid			oid;			/* only meaningful if the slot is used */
+	pgskCounters counters[PGSK_NUMKIND];	/* the running totals */
+	slock_t		mutex;			/* protects the state, the oid and the
+								   counters */
+#endif
+} pgskAggEntry;
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * History ring, filled by the background worker every
+ * pg_stat_kcache.history_interval with the activity of each entry since the
+ * previous sample.  The counters are the sum of the planning and execution
+ * ones.
+ */
+typedef struct pgskHistoryRecord
+{
+	TimestampTz		ts;			/* end of the sampled interval */
+	pgskHashKey		key;		/* entry this activity belongs to */
+	int64			plan_calls;	/* number of measured planning */
+	int64			exec_calls;	/* number of measured executions */
+	float8			utime;		/* CPU user time */
+	float8			stime;		/* CPU system time */
+	int64			reads;		/* Physical block reads */
+	int64			writes;		/* Physical block writes */
+	int64			minflts;	/* page reclaims (soft page faults) */
+	int64			majflts;	/* page faults (hard page faults) */
+	int64			nvcsws;		/* voluntary context witches */
+	int64			nivcsws;	/* unvoluntary context witches */
+	int64			rchar;		/* bytes read, including from the page cache */
+	int64			wchar;		/* bytes written, including to the page cache */
+	int64			read_bytes;	/* bytes read from the storage layer */
+	int64			write_bytes;	/* bytes sent to the storage layer */
+	int64			rusage_calls;	/* calls that measured getrusage() */
+} pgskHistoryRecord;
+
+/*
+ * Maximum value of pg_stat_kcache.history_size, so that all the records can
+ * be copied in a single palloc'd array.
+ */
+#define PGSK_HISTORY_MAX_SIZE	((int) (MaxAllocSize / sizeof(pgskHistoryRecord)))
+
+typedef struct pgskHistoryState
+{
+	LWLock		   *lock;		/* protects the whole ring */
+	uint64			next;		/* number of records ever written */
+	pgskHistoryRecord records[FLEXIBLE_ARRAY_MEMBER];
+} pgskHistoryState;
+
+/*
+ * Events ring, with one event per execution.  The backends claim a position
+ * by advancing head with a compare-and-exchange, without ever waiting: if the
+ * ring is full the event is discarded and counted in dropped instead.  Once
+ * the event is written, its seq is set to its position + 1, so that the
+ * consumer knows it can read it.  The consumers are serialized by the lock,
+ * and advance tail once the events are copied, which frees their slots.
+ */
+typedef struct pgskEvent
+{
+	pg_atomic_uint64 seq;		/* position + 1 once written */
+	TimestampTz		ts;			/* end of the execution */
+	int				pid;		/* backend that ran the statement */
+	pgskHashKey		key;		/* entry the execution belongs to */
+	pgskCounters	counters;	/* execution counters, including the workers */
+} pgskEvent;
+
+/*
+ * Maximum value of pg_stat_kcache.events_size, so that all the events can be
+ * copied in a single palloc'd array.
+ */
+#define PGSK_EVENTS_MAX_SIZE	((int) (MaxAllocSize / sizeof(pgskEvent)))
+
+typedef struct pgskEventRing
+{
+	LWLock		   *lock;		/* serializes the consumers */
+	pg_atomic_uint64 head;		/* number of events ever claimed */
+	pg_atomic_uint64 tail;		/* number of events ever consumed */
+	pg_atomic_uint64 dropped;	/* events discarded as the ring was full */
+	pgskEvent		events[FLEXIBLE_ARRAY_MEMBER];
+} pgskEventRing;
+
+/*
+ * Counters of an entry at the previous history sample, only kept in the
+ * background worker's memory.
+ */
+typedef struct pgskHistoryPrev
+{
+	pgskHashKey		key;		/* hash key of entry - MUST BE FIRST */
+	TimestampTz		stats_since;	/* to detect a reallocated entry */
+	uint64			pass;		/* last sample that saw the entry */
+	pgskCounters	counters[PGSK_NUMKIND];
+} pgskHistoryPrev;
+#endif
+
 /*---- Local variables ----*/
 
 /* Current nesting depth of planner/ExecutorRun/ProcessUtility calls */
@@ -176,14 +757,50 @@ static ExecutorStart_hook_type prev_ExecutorStart = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static object_access_hook_type prev_object_access_hook = NULL;
+#if PG_VERSION_NUM >= 140000
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+/*
+ * Whether this parallel worker ran an executor, otherwise its whole resource
+ * usage is attributed to the leader's utility statement.
+ */
+static bool pgsk_worker_executed = false;
+#endif
+
+/*
+ * Databases and roles dropped by the current transaction, whose aggregate
+ * slots are released at commit, see pgsk_object_access().
+ */
+static List *pgsk_dropped_dbs = NIL;
+static List *pgsk_dropped_roles = NIL;
 
 /* Links to shared memory state */
 static pgskSharedState *pgsk = NULL;
-static HTAB *pgsk_hash = NULL;
+static HTAB *pgsk_hash[PGSK_NUM_PARTITIONS];
+static pgskAggEntry *pgsk_aggs = NULL;
+#if PG_VERSION_NUM >= 90600
+static pgskHistoryState *pgsk_history = NULL;
+static pgskEventRing *pgsk_events = NULL;
+#endif
+
+/*
+ * Dense arrays of all the entries of each partition, used by the eviction
+ * strategies that need to pick entries without scanning the whole partition.
+ * Entries [0, hash_get_num_entries()) are used.  They're protected by the
+ * partition locks, as the hashtables.
+ */
+static pgskEntry **pgsk_slots[PGSK_NUM_PARTITIONS];
+
+/* Backend-local pending counters, see pgsk_local_store() */
+static HTAB *pgsk_local_hash = NULL;
+static TimestampTz pgsk_local_pending_since = 0;
+static uint64 pgsk_local_epoch = 0;		/* global epoch of the pending batch */
 
 /*---- HOOK variables ----*/
 
 pgsk_counters_hook_type pgsk_counters_hook = NULL;
+const Size pgsk_counters_size = sizeof(pgskCounters);
 
 /*---- GUC variables ----*/
 
@@ -206,6 +823,178 @@ static int	pgsk_track = PGSK_TRACK_TOP;	/* tracking level */
 #if PG_VERSION_NUM >= 130000
 static bool pgsk_track_planning = false;	/* whether to track planning duration */
 #endif
+#if PG_VERSION_NUM >= 140000
+static bool pgsk_track_utility = true;	/* whether to track utility commands */
+#endif
+#if PG_VERSION_NUM >= 180000
+static bool pgsk_track_worker_io = false;	/* estimate the reads done by the
+											   I/O workers */
+static bool pgsk_io_workers = false;	/* whether io_method is worker */
+#endif
+#if PG_VERSION_NUM >= 90600
+static bool pgsk_track_activity = false;	/* publish the running statements */
+
+/* Whether this backend published a statement in its slot */
+static bool pgsk_activity_published = false;
+#endif
+typedef enum
+{
+	PGSK_EVICTION_SORT,			/* sort all entries, evict the 5% least used */
+	PGSK_EVICTION_CLOCK,		/* clock sweep, evict first unreferenced */
+	PGSK_EVICTION_SAMPLE		/* evict least used of a few random entries */
+}			PGSKEvictionStrategy;
+
+static const struct config_enum_entry pgsk_eviction_options[] =
+{
+	{"sort", PGSK_EVICTION_SORT, false},
+	{"clock", PGSK_EVICTION_CLOCK, false},
+	{"sample", PGSK_EVICTION_SAMPLE, false},
+	{NULL, 0, false}
+};
+
+static int	pgsk_eviction = PGSK_EVICTION_SORT;	/* eviction strategy */
+static int	pgsk_max_setting = -1;	/* pg_stat_kcache.max */
+static int	pgsk_eviction_threshold = -1;	/* # of entries above which
+											   entries are evicted */
+
+typedef enum
+{
+	PGSK_TIMING_RUSAGE,			/* getrusage() only */
+	PGSK_TIMING_CLOCK,			/* clock_gettime() CPU time only */
+	PGSK_TIMING_CLOCK_FULL		/* clock_gettime() CPU time and getrusage() */
+}			PGSKTimingMethod;
+
+static const struct config_enum_entry pgsk_timing_options[] =
+{
+	{"rusage", PGSK_TIMING_RUSAGE, false},
+	{"clock", PGSK_TIMING_CLOCK, false},
+	{"clock_full", PGSK_TIMING_CLOCK_FULL, false},
+	{NULL, 0, false}
+};
+
+static int	pgsk_timing = PGSK_TIMING_RUSAGE;	/* timing method */
+
+typedef enum
+{
+	PGSK_ACCOUNTING_STATEMENT,	/* from ExecutorStart to ExecutorEnd */
+	PGSK_ACCOUNTING_RUN			/* only inside ExecutorRun and ExecutorFinish */
+}			PGSKAccountingMode;
+
+static const struct config_enum_entry pgsk_accounting_options[] =
+{
+	{"statement", PGSK_ACCOUNTING_STATEMENT, false},
+#if PG_VERSION_NUM >= 90500
+	{"run", PGSK_ACCOUNTING_RUN, false},
+#endif
+	{NULL, 0, false}
+};
+
+static int	pgsk_exec_accounting = PGSK_ACCOUNTING_STATEMENT;	/* execution
+																   measure */
+static int	pgsk_log_min_cpu_time = -1;	/* log executions using more CPU
+										   time, in ms */
+#ifdef HAVE_GETRUSAGE
+static int	pgsk_log_min_reads = -1;	/* log executions reading more, in kB */
+static int	pgsk_log_min_majflts = -1;	/* log executions with more page
+										   faults */
+#endif
+static bool pgsk_log_query_text = false;	/* add the query text to the log */
+#ifdef PGSK_HAVE_PROC_IO
+static bool pgsk_track_io = false;	/* whether to read /proc/self/io */
+
+/*
+ * File descriptor on /proc/self/io, kept open for the whole backend lifetime
+ * and read with pread() to avoid an open() and close() per statement.  -1 if
+ * not opened yet, -2 if it couldn't be opened or read, in which case I/O
+ * accounting is disabled for this backend.  The file is opened by the backend
+ * itself, but remember its pid to detect an inherited descriptor.
+ */
+static int	pgsk_proc_io_fd = -1;
+static int	pgsk_proc_io_pid = 0;
+
+/* /proc/self/io fields, and the pgskCounters field they're stored in */
+static const struct
+{
+	const char *name;
+	size_t		offset;
+}			pgsk_proc_io_fields[] =
+{
+	{"rchar", offsetof(pgskCounters, rchar)},
+	{"wchar", offsetof(pgskCounters, wchar)},
+	{"syscr", offsetof(pgskCounters, syscr)},
+	{"syscw", offsetof(pgskCounters, syscw)},
+	{"read_bytes", offsetof(pgskCounters, read_bytes)},
+	{"write_bytes", offsetof(pgskCounters, write_bytes)},
+	{"cancelled_write_bytes", offsetof(pgskCounters, cancelled_write_bytes)}
+};
+#endif
+#ifdef PGSK_HAVE_PERF_EVENT
+static bool pgsk_track_perf = false;	/* whether to read perf counters */
+
+/*
+ * Per-backend perf event group, opened on first use and read with a single
+ * read() per capture.  pgsk_perf_fd is the group leader: -1 if not opened
+ * yet, -2 if it couldn't be opened, in which case hardware counters are
+ * disabled for this backend.  Some events may not be supported by the
+ * hardware, so only pgsk_perf_nevents of them are part of the group, and
+ * pgsk_perf_slots maps their order in the group to pgsk_perf_events.
+ */
+static int	pgsk_perf_fd = -1;
+static int	pgsk_perf_pid = 0;
+static int	pgsk_perf_fds[PGSK_PERF_NUM_EVENTS];
+static int	pgsk_perf_slots[PGSK_PERF_NUM_EVENTS];
+static int	pgsk_perf_nevents = 0;
+
+/* Hardware events, and the pgskCounters field they're stored in */
+static const struct
+{
+	const char *name;
+	uint32		type;
+	uint64		config;
+	size_t		offset;
+}			pgsk_perf_events[PGSK_PERF_NUM_EVENTS] =
+{
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+	offsetof(pgskCounters, cycles)},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+	offsetof(pgskCounters, instructions)},
+	{"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+	offsetof(pgskCounters, llc_misses)},
+	{"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,
+	offsetof(pgskCounters, branch_misses)},
+	{"dtlb_misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	offsetof(pgskCounters, dtlb_misses)}
+};
+#endif
+static int	pgsk_flush_interval = 0;	/* max delay before flushing local
+										   counters, in ms */
+static double pgsk_sample_rate = 1.0;	/* fraction of statements to track */
+static bool pgsk_track_histograms = false;	/* whether to maintain histograms */
+static bool pgsk_compact_layout = false;	/* store only the live counters */
+static int	pgsk_max_aggregates = 256;	/* # of databases and of roles with
+										   aggregated counters */
+#if PG_VERSION_NUM >= 90600
+static int	pgsk_save_interval = 300;	/* delay between periodic saves of the
+										   stats file, in s */
+static int	pgsk_history_size = 0;	/* # of records in the history ring */
+static int	pgsk_history_interval = 60;	/* delay between history samples,
+										   in s */
+static int	pgsk_events_size = 0;	/* # of events in the events ring */
+
+/* Flags set by the background worker signal handlers */
+static volatile sig_atomic_t pgsk_got_sighup = false;
+static volatile sig_atomic_t pgsk_got_sigterm = false;
+#endif
+
+/*
+ * Whether the current top-level statement is sampled, and whether that was
+ * decided by the planner, so that its execution follows the same decision.
+ */
+static bool pgsk_current_sampled = true;
+static bool pgsk_sample_planned = false;
 
 #define pgsk_enabled(level) \
 	((pgsk_track == PGSK_TRACK_ALL && (level) < PGSK_MAX_NESTED_LEVEL) || \
@@ -214,24 +1003,74 @@ static bool pgsk_track_planning = false;	/* whether to track planning duration *
 /*--- Functions --- */
 
 void	_PG_init(void);
+#if PG_VERSION_NUM >= 90600
+extern PGDLLEXPORT void pgsk_bgworker_main(Datum main_arg);
+#endif
 
 extern PGDLLEXPORT Datum	pg_stat_kcache_reset(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_reset_2_4(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_reset_lazy(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum	pg_stat_kcache(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum	pg_stat_kcache_2_1(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum	pg_stat_kcache_2_2(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum	pg_stat_kcache_2_3(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_2_4(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_2_4_filter(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_changes(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_export(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_history(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_events(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_activity(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_database(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_user(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_histogram(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_percentiles(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_bench(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum	pg_stat_kcache_info(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pg_stat_kcache_reset);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_reset_2_4);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_reset_lazy);
 PG_FUNCTION_INFO_V1(pg_stat_kcache);
 PG_FUNCTION_INFO_V1(pg_stat_kcache_2_1);
 PG_FUNCTION_INFO_V1(pg_stat_kcache_2_2);
 PG_FUNCTION_INFO_V1(pg_stat_kcache_2_3);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_2_4);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_2_4_filter);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_changes);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_export);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_history);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_events);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_activity);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_database);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_user);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_histogram);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_percentiles);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_bench);
+PG_FUNCTION_INFO_V1(pg_stat_kcache_info);
 
 static void pg_stat_kcache_internal(FunctionCallInfo fcinfo, pgskVersion
-		api_version);
+		api_version, const pgskFilter *filter);
+static bool pgsk_filter_match(const pgskFilter *filter, pgskEntry *entry);
+static double pgsk_off_cpu_time(const pgskCounters *counters);
+static int	pgsk_fill_self(Datum *values, bool *nulls, int i,
+						   const pgskCounters counters[PGSK_NUMSETS]);
+static int	pgsk_fill_counters(Datum *values, bool *nulls, int i,
+							   const pgskCounters tmp[PGSK_NUMKIND],
+							   int min_kind, bool full,
+							   pgskVersion api_version);
+static void pg_stat_kcache_agg_internal(FunctionCallInfo fcinfo,
+										pgskAggKind akind);
+static void pg_stat_kcache_histogram_internal(FunctionCallInfo fcinfo,
+											  bool percentiles);
 
 static void pgsk_setmax(void);
+static void pgsk_setlayout(bool has_plan);
+static int	pgsk_partition_limit(void);
 static Size pgsk_memsize(void);
+static Size pgsk_slots_array_size(void);
+static Size pgsk_aggs_array_size(void);
+static Size pgsk_entry_size(void);
 
 #if PG_VERSION_NUM >= 150000
 static void pgsk_shmem_request(void);
@@ -258,23 +1097,166 @@ static void pgsk_ExecutorRun(QueryDesc *queryDesc,
 );
 static void pgsk_ExecutorFinish(QueryDesc *queryDesc);
 static void pgsk_ExecutorEnd(QueryDesc *queryDesc);
-static pgskEntry *pgsk_entry_alloc(pgskHashKey *key);
-static void pgsk_entry_dealloc(void);
+#if PG_VERSION_NUM >= 140000
+static void pgsk_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+								bool readOnlyTree,
+								ProcessUtilityContext context,
+								ParamListInfo params,
+								QueryEnvironment *queryEnv,
+								DestReceiver *dest, QueryCompletion *qc);
+static void pgsk_worker_store(void);
+#endif
+static pgskEntry *pgsk_entry_alloc(pgskHashKey *key, uint32 hashcode);
+static void pgsk_entry_remove(int partition, pgskEntry *entry);
+static void pgsk_entry_dealloc(int partition);
+static void pgsk_entry_evict_sort(int partition);
+static void pgsk_entry_evict_clock(int partition);
+static void pgsk_entry_evict_sample(int partition);
 static void pgsk_entry_reset(void);
+static void pgsk_entry_reset_filtered(const pgskFilter *filter,
+									  bool histograms_only);
+static void pgsk_entry_reset_lazy(void);
+static void pgsk_advance_epoch(void);
+static void pgsk_nested_reset(int level);
+static void pgsk_nested_add(int level, pgskStoreKind kind,
+							const pgskCounters *counters);
+static bool pgsk_nested_collect(int level, pgskCounters *nested);
+static void pgsk_log_check(pgsk_queryid queryId, const pgskCounters *counters,
+						   const pgskCounters *workers,
+						   const char *query_text);
 static void pgsk_entry_store(pgsk_queryid queryId, pgskStoreKind kind,
-							 pgskCounters counters);
+							 pgskCounters counters,
+							 const pgskCounters *workers,
+							 const pgskCounters *nested);
+static void pgsk_counters_add(volatile pgskCounters *dst,
+							  const pgskCounters *src);
+static void pgsk_entry_init(pgskEntry *entry);
+static pgskEntryCounters *pgsk_entry_counters(pgskEntry *entry, int kind);
+static void pgsk_entry_accum(pgskEntry *entry, double usage,
+							 const pgskCounters counters[PGSK_NUMSETS]);
+static void pgsk_entry_snapshot(pgskEntry *entry,
+								pgskCounters counters[PGSK_NUMSETS]);
+static void pgsk_entry_zero(pgskEntry *entry, TimestampTz since);
+static bool pgsk_entry_check_epoch(pgskEntry *entry, uint64 epoch,
+								   TimestampTz since);
+#ifdef PGSK_USE_ATOMICS
+static void pgsk_shared_counters_zero(pgskSharedCounters *c, bool full,
+									  bool init);
+static void pgsk_shared_counters_add(pgskSharedCounters *c, bool full,
+									 const pgskCounters *src);
+static void pgsk_shared_counters_read(pgskSharedCounters *c, bool full,
+									  pgskCounters *dst);
+#endif
+static pgskAggEntry *pgsk_agg_find(pgskAggKind akind, Oid oid, bool create);
+static pgskAggSlotState pgsk_agg_read_slot(pgskAggEntry *agg, Oid *oid);
+static void pgsk_agg_claim(pgskAggEntry *agg, Oid oid);
+static void pgsk_agg_release(pgskAggKind akind, Oid oid);
+static void pgsk_agg_accum(const pgskHashKey *key,
+						   const pgskCounters counters[PGSK_NUMKIND]);
+static void pgsk_agg_reset(bool init);
+static void pgsk_object_access(ObjectAccessType access, Oid classId,
+							   Oid objectId, int subId, void *arg);
+static int	pgsk_hist_bucket(double value);
+static void pgsk_hist_observe(pgskHistCounts *hist,
+							  const pgskCounters *counters);
+static void pgsk_entry_hist_observe(pgskEntry *entry,
+									const pgskCounters *counters);
+static void pgsk_entry_hist_accum(pgskEntry *entry,
+								  const pgskHistCounts *hist);
+static void pgsk_entry_hist_snapshot(pgskEntry *entry, pgskHistCounts *hist);
+static void pgsk_entry_hist_zero(pgskEntry *entry);
+static void pgsk_entry_hist_reset(pgskEntry *entry);
+static double pgsk_hist_bound(pgskHistKind hkind, int bucket);
+static double pgsk_hist_percentile(const uint64 *buckets, uint64 total,
+								   pgskHistKind hkind, double fraction);
+static uint64 pgsk_get_generation(void);
+static uint64 pgsk_get_epoch(TimestampTz *since);
+static void pgsk_stat_add(pgskStatKind skind, uint64 value);
+static void pgsk_stat_set(pgskStatKind skind, uint64 value);
+static uint64 pgsk_stat_read(pgskStatKind skind);
+static void pgsk_stat_reset(bool init);
+static uint64 pgsk_next_generation(void);
+static uint64 pgsk_entry_get_generation(pgskEntry *entry);
+static void pgsk_entry_stamp(pgskEntry *entry);
+static double pgsk_entry_get_usage(pgskEntry *entry);
+static void pgsk_entry_set_usage(pgskEntry *entry, double usage);
+static char *pgsk_put_u32(char *p, uint32 v);
+static char *pgsk_put_u64(char *p, uint64 v);
+static char *pgsk_put_f64(char *p, double v);
+static uint32 pgsk_get_u32(const char **p);
+static uint64 pgsk_get_u64(const char **p);
+static double pgsk_get_f64(const char **p);
+static Size pgsk_record_size(uint16 flags);
+static void pgsk_serialize(StringInfo buf, uint16 flags, bool lock);
+static bool pgsk_write_file(bool lock);
+static int	load_item_cmp(const void *lhs, const void *rhs);
+#if PG_VERSION_NUM >= 90600
+static void pgsk_bgworker_sighup(SIGNAL_ARGS);
+static void pgsk_bgworker_sigterm(SIGNAL_ARGS);
+static long pgsk_bgworker_timeout(TimestampTz last, int interval);
+static Size pgsk_history_size_bytes(void);
+static HTAB *pgsk_history_create_prev(void);
+static bool pgsk_history_delta(pgskHistoryRecord *rec,
+							   const pgskCounters cur[PGSK_NUMKIND],
+							   const pgskCounters prev[PGSK_NUMKIND]);
+static void pgsk_history_sample(HTAB *prev, uint64 pass);
+static Size pgsk_events_size_bytes(void);
+static void pgsk_event_add(const pgskHashKey *key,
+						   const pgskCounters *counters);
+#endif
+static void pgsk_record_write_header(char *buf, uint16 flags, uint32 nrecords);
+static bool pgsk_record_read_header(const char *buf, uint16 *flags,
+									uint32 *nrecords);
+static void pgsk_record_write(char *buf, pgskEntry *entry, uint16 flags);
+static void pgsk_record_read_key(const char *buf, pgskHashKey *key,
+								 double *usage);
+static void pgsk_record_read(const char *buf, uint16 flags, pgskHashKey *key,
+							 pgskCounters counters[PGSK_NUMSETS],
+							 TimestampTz *stats_since, pgskHistCounts *hist);
+static void pgsk_local_store(pgskHashKey *key, pgskStoreKind kind,
+							 const pgskCounters counters[PGSK_NUMSETS]);
+static void pgsk_local_flush(void);
+static void pgsk_local_discard(void);
+static void pgsk_local_shutdown(int code, Datum arg);
+static void pgsk_xact_callback(XactEvent event, void *arg);
 static uint32 pgsk_hash_fn(const void *key, Size keysize);
 static int	pgsk_match_fn(const void *key1, const void *key2, Size keysize);
 
 
 static bool pgsk_assign_linux_hz_check_hook(int *newval, void **extra, GucSource source);
+static bool pgsk_timing_check_hook(int *newval, void **extra, GucSource source);
+#ifdef PGSK_HAVE_PROC_IO
+static bool pgsk_read_proc_io(pgskCounters *io);
+#endif
+#ifdef PGSK_HAVE_PERF_EVENT
+static void pgsk_perf_close(void);
+static bool pgsk_perf_open(void);
+static bool pgsk_read_perf(pgskUsage *usage);
+#endif
+static bool pgsk_is_sampled(bool planning);
+static void pgsk_capture_usage(pgskUsage *usage, int timing);
 static void pgsk_compute_counters(pgskCounters *counters,
-								  struct rusage *rusage_start,
-								  struct rusage *rusage_end,
+								  pgskUsage *rusage_start,
+								  pgskUsage *rusage_end,
 								  QueryDesc *queryDesc);
+static void pgsk_short_cputime(pgskCounters *counters, QueryDesc *queryDesc);
+static void pgsk_run_start(QueryDesc *queryDesc);
+static pgskRunState *pgsk_run_find(QueryDesc *queryDesc);
+static void pgsk_run_accum(pgskRunState *run, pgskUsage *rusage_start);
+#if PG_VERSION_NUM >= 90500
+static void pgsk_run_release(void *arg);
+#endif
 #if PG_VERSION_NUM >= 90600
-static Size pgsk_queryids_array_size(void);
+static int	pgsk_parallel_num_slots(void);
+static Size pgsk_parallel_array_size(void);
 static void pgsk_set_queryid(pgsk_queryid queryid);
+static void pgsk_activity_start(pgsk_queryid queryid, const pgskUsage *usage);
+static void pgsk_activity_end(void);
+static pgsk_queryid pgsk_leader_queryid(void);
+static void pgsk_worker_report(pgsk_queryid queryId,
+							   const pgskCounters *counters);
+static bool pgsk_workers_collect(pgsk_queryid queryId,
+								 pgskCounters *counters);
 #endif
 
 static int	pgsk_linux_hz = 0;
@@ -328,20 +1310,342 @@ _PG_init(void)
 							 NULL);
 #endif
 
-	EmitWarningsOnPlaceholders("pg_stat_kcache");
+#if PG_VERSION_NUM >= 140000
+	DefineCustomBoolVariable("pg_stat_kcache.track_utility",
+							 "Selects whether utility commands are tracked by pg_stat_kcache.",
+							 NULL,
+							 &pgsk_track_utility,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
 
-	/* set pgsk_max if needed */
-	pgsk_setmax();
-	/*
-	 * If you change code here, don't forget to also report the modifications
-	 * in pgsk_shmem_request() for pg15 and later.
-	 */
-#if PG_VERSION_NUM < 150000
-	RequestAddinShmemSpace(pgsk_memsize());
-#if PG_VERSION_NUM >= 90600
-	RequestNamedLWLockTranche("pg_stat_kcache", 1);
+#if PG_VERSION_NUM >= 180000
+	DefineCustomBoolVariable("pg_stat_kcache.track_worker_io",
+							 "Selects whether the reads done by the I/O workers are estimated.",
+							 "With io_method = worker, the shared buffers read by a "
+							 "statement are added to its reads.",
+							 &pgsk_track_worker_io,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/* io_method can only be set at server start */
+	{
+		const char *io_method = GetConfigOption("io_method", true, false);
+
+		pgsk_io_workers = (io_method != NULL && strcmp(io_method, "worker") == 0);
+	}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+	DefineCustomBoolVariable("pg_stat_kcache.track_activity",
+							 "Selects whether the running top-level statements are visible in pg_stat_kcache_activity.",
+							 NULL,
+							 &pgsk_track_activity,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomIntVariable("pg_stat_kcache.flush_interval",
+							"Maximum delay before locally accumulated counters are flushed to shared memory.",
+							"Zero, the default, stores counters in shared memory "
+							"after each statement.",
+							&pgsk_flush_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_stat_kcache.sample_rate",
+							 "Fraction of statements to track.",
+							 "The decision is made for each top-level statement, "
+							 "and applies to all its nested statements.",
+							 &pgsk_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_stat_kcache.exec_accounting",
+							 "Selects what the execution counters cover.",
+							 "statement measures from the start to the end of the "
+							 "execution. run only measures inside the executor "
+							 "runs, excluding the time a cursor is left open "
+							 "between two fetches.",
+							 &pgsk_exec_accounting,
+							 PGSK_ACCOUNTING_STATEMENT,
+							 pgsk_accounting_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.log_min_cpu_time",
+							"Sets the minimum CPU time above which executions are logged.",
+							"The CPU time is the sum of the user and system time. "
+							"-1, the default, disables this check.",
+							&pgsk_log_min_cpu_time,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+#ifdef HAVE_GETRUSAGE
+	DefineCustomIntVariable("pg_stat_kcache.log_min_reads",
+							"Sets the minimum amount of data read above which executions are logged.",
+							"-1, the default, disables this check.",
+							&pgsk_log_min_reads,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.log_min_majflts",
+							"Sets the minimum number of page faults above which executions are logged.",
+							"-1, the default, disables this check.",
+							&pgsk_log_min_majflts,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+#endif
+
+	DefineCustomBoolVariable("pg_stat_kcache.log_query_text",
+							 "Selects whether the query text is added to the logged executions.",
+							 NULL,
+							 &pgsk_log_query_text,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_stat_kcache.timing",
+							 "Selects how pg_stat_kcache measures resource usage.",
+							 "rusage uses getrusage() for all counters. clock only "
+							 "measures CPU time, with clock_gettime(). clock_full "
+							 "also uses getrusage() for the other counters.",
+							 &pgsk_timing,
+							 PGSK_TIMING_RUSAGE,
+							 pgsk_timing_options,
+							 PGC_SUSET,
+							 0,
+							 pgsk_timing_check_hook,
+							 NULL,
+							 NULL);
+
+#ifdef PGSK_HAVE_PROC_IO
+	DefineCustomBoolVariable("pg_stat_kcache.track_io",
+							 "Selects whether /proc/self/io counters are tracked by pg_stat_kcache.",
+							 NULL,
+							 &pgsk_track_io,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+#ifdef PGSK_HAVE_PERF_EVENT
+	DefineCustomBoolVariable("pg_stat_kcache.track_perf",
+							 "Selects whether hardware performance counters are tracked by pg_stat_kcache.",
+							 NULL,
+							 &pgsk_track_perf,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomBoolVariable("pg_stat_kcache.track_histograms",
+							 "Selects whether per-statement histograms of the executions are maintained.",
+							 "Each entry then uses an additional 512 bytes of shared memory.",
+							 &pgsk_track_histograms,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_stat_kcache.compact_layout",
+							 "Selects whether the entries only store the counters that can be maintained.",
+							 "The planning counters are then only stored if "
+							 "pg_stat_kcache.track_planning is enabled at server "
+							 "start.",
+							 &pgsk_compact_layout,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.max_aggregates",
+							"Sets the maximum number of databases and of roles with aggregated counters.",
+							"Activity of databases or roles beyond that number "
+							"isn't aggregated.",
+							&pgsk_max_aggregates,
+							256,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+#if PG_VERSION_NUM >= 90600
+	DefineCustomIntVariable("pg_stat_kcache.save_interval",
+							"Delay between periodic saves of the statistics to disk.",
+							"Zero disables the periodic saves, the statistics are "
+							"then only saved at shutdown.",
+							&pgsk_save_interval,
+							300,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.history_size",
+							"Number of records kept in the history ring.",
+							"Zero, the default, disables the history.",
+							&pgsk_history_size,
+							0,
+							0,
+							PGSK_HISTORY_MAX_SIZE,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.history_interval",
+							"Delay between samples of the activity added to the history ring.",
+							NULL,
+							&pgsk_history_interval,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.events_size",
+							"Number of executions kept in the events ring.",
+							"Zero, the default, disables the events ring.",
+							&pgsk_events_size,
+							0,
+							0,
+							PGSK_EVENTS_MAX_SIZE,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+#endif
+
+	DefineCustomEnumVariable("pg_stat_kcache.eviction",
+							 "Selects the strategy used to evict entries when the hashtable is full.",
+							 NULL,
+							 &pgsk_eviction,
+							 PGSK_EVICTION_SORT,
+							 pgsk_eviction_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.max",
+							"Sets the maximum number of entries.",
+							"-1, the default, uses pg_stat_statements.max.",
+							&pgsk_max_setting,
+							-1,
+							-1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_kcache.eviction_threshold",
+							"Sets the number of entries above which the least used ones are evicted.",
+							"-1, the default, only evicts entries once "
+							"pg_stat_kcache.max is reached.",
+							&pgsk_eviction_threshold,
+							-1,
+							-1,
+							INT_MAX / 2,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("pg_stat_kcache");
+
+	/* set pgsk_max if needed */
+	pgsk_setmax();
+
+	/* choose the layout of the entries, needed to size the hashtables */
+#if PG_VERSION_NUM >= 130000
+	pgsk_setlayout(pgsk_track_planning);
+#else
+	pgsk_setlayout(false);
+#endif
+	/*
+	 * If you change code here, don't forget to also report the modifications
+	 * in pgsk_shmem_request() for pg15 and later.
+	 */
+#if PG_VERSION_NUM < 150000
+	RequestAddinShmemSpace(pgsk_memsize());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("pg_stat_kcache", PGSK_NUM_LOCKS);
 #else
-	RequestAddinLWLocks(1);
+	RequestAddinLWLocks(PGSK_NUM_LOCKS);
 #endif		/* pg 9.6+ */
 #endif		/* pg 15- */
 
@@ -364,6 +1668,41 @@ _PG_init(void)
 	ExecutorFinish_hook = pgsk_ExecutorFinish;
 	prev_ExecutorEnd = ExecutorEnd_hook;
 	ExecutorEnd_hook = pgsk_ExecutorEnd;
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = pgsk_object_access;
+#if PG_VERSION_NUM >= 140000
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = pgsk_ProcessUtility;
+#endif
+
+	RegisterXactCallback(pgsk_xact_callback, NULL);
+
+#if PG_VERSION_NUM >= 90600
+	/*
+	 * Register the background worker saving the stats file and sampling the
+	 * history, unless it has nothing to do.
+	 */
+	if (pgsk_save_interval > 0 || pgsk_history_size > 0)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, sizeof(worker.bgw_library_name),
+				 "pg_stat_kcache");
+		snprintf(worker.bgw_function_name, sizeof(worker.bgw_function_name),
+				 "pgsk_bgworker_main");
+		snprintf(worker.bgw_name, sizeof(worker.bgw_name),
+				 "pg_stat_kcache writer");
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, sizeof(worker.bgw_type),
+				 "pg_stat_kcache writer");
+#endif
+		RegisterBackgroundWorker(&worker);
+	}
+#endif
 }
 
 static bool
@@ -391,359 +1730,1966 @@ pgsk_assign_linux_hz_check_hook(int *newval, void **extra, GucSource source)
 	return true;
 }
 
-static void
-pgsk_compute_counters(pgskCounters *counters,
-					  struct rusage *rusage_start,
-					  struct rusage *rusage_end,
-					  QueryDesc *queryDesc)
+static bool
+pgsk_timing_check_hook(int *newval, void **extra, GucSource source)
+{
+#ifndef PGSK_CPUTIME_CLOCK
+	if (*newval != PGSK_TIMING_RUSAGE)
+	{
+		GUC_check_errdetail("clock_gettime() CPU clocks are not supported on this platform.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+#ifdef PGSK_HAVE_PROC_IO
+/*
+ * Read the cumulated I/O counters of the current process.  Returns false if
+ * they're not available, in which case I/O accounting is disabled for the
+ * rest of the backend lifetime.
+ */
+static bool
+pgsk_read_proc_io(pgskCounters *io)
 {
-		/* Compute CPU time delta */
-		counters->utime = TIMEVAL_DIFF(rusage_start->ru_utime, rusage_end->ru_utime);
-		counters->stime = TIMEVAL_DIFF(rusage_start->ru_stime, rusage_end->ru_stime);
+	char		buf[512];
+	char	   *line;
+	ssize_t		len;
+
+	if (pgsk_proc_io_fd == -2)
+		return false;
 
-		if (queryDesc && queryDesc->totaltime)
+	if (pgsk_proc_io_fd >= 0 && pgsk_proc_io_pid != MyProcPid)
+	{
+		close(pgsk_proc_io_fd);
+		pgsk_proc_io_fd = -1;
+	}
+
+	if (pgsk_proc_io_fd == -1)
+	{
+		pgsk_proc_io_fd = open(PGSK_PROC_IO_PATH, O_RDONLY | O_CLOEXEC);
+		if (pgsk_proc_io_fd < 0)
 		{
-			/* Make sure stats accumulation is done */
-			InstrEndLoop(queryDesc->totaltime);
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pg_stat_kcache: could not open file \"%s\": %m",
+							PGSK_PROC_IO_PATH),
+					 errdetail("I/O accounting is disabled for this backend.")));
+			pgsk_proc_io_fd = -2;
+			return false;
+		}
+		pgsk_proc_io_pid = MyProcPid;
+	}
 
-			/*
-			 * We only consider values greater than 3 * linux tick, otherwise the
-			 * bias is too big
-			 */
-			if (queryDesc->totaltime->total < (3. / pgsk_linux_hz))
+	/* Reading at offset 0 makes the kernel generate fresh content */
+	len = pread(pgsk_proc_io_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_stat_kcache: could not read file \"%s\": %m",
+						PGSK_PROC_IO_PATH),
+				 errdetail("I/O accounting is disabled for this backend.")));
+		close(pgsk_proc_io_fd);
+		pgsk_proc_io_fd = -2;
+		return false;
+	}
+	buf[len] = '\0';
+
+	/* Each line is "name: value" */
+	for (line = buf; line != NULL && *line != '\0'; line = strchr(line, '\n'))
+	{
+		int			i;
+
+		if (*line == '\n')
+			line++;
+
+		for (i = 0; i < lengthof(pgsk_proc_io_fields); i++)
+		{
+			const char *name = pgsk_proc_io_fields[i].name;
+			size_t		namelen = strlen(name);
+
+			if (strncmp(line, name, namelen) == 0 && line[namelen] == ':')
 			{
-				counters->stime = 0;
-				counters->utime = queryDesc->totaltime->total;
+				*(int64 *) ((char *) io + pgsk_proc_io_fields[i].offset) =
+					(int64) strtoll(line + namelen + 1, NULL, 10);
+				break;
 			}
 		}
+	}
 
-#ifdef HAVE_GETRUSAGE
-		/* Compute the rest of the counters */
-		counters->minflts = rusage_end->ru_minflt - rusage_start->ru_minflt;
-		counters->majflts = rusage_end->ru_majflt - rusage_start->ru_majflt;
-		counters->nswaps = rusage_end->ru_nswap - rusage_start->ru_nswap;
-		counters->reads = rusage_end->ru_inblock - rusage_start->ru_inblock;
-		counters->writes = rusage_end->ru_oublock - rusage_start->ru_oublock;
-		counters->msgsnds = rusage_end->ru_msgsnd - rusage_start->ru_msgsnd;
-		counters->msgrcvs = rusage_end->ru_msgrcv - rusage_start->ru_msgrcv;
-		counters->nsignals = rusage_end->ru_nsignals - rusage_start->ru_nsignals;
-		counters->nvcsws = rusage_end->ru_nvcsw - rusage_start->ru_nvcsw;
-		counters->nivcsws = rusage_end->ru_nivcsw - rusage_start->ru_nivcsw;
-#endif
+	return true;
 }
+#endif
 
-#if PG_VERSION_NUM >= 90600
+#ifdef PGSK_HAVE_PERF_EVENT
 static void
-pgsk_set_queryid(pgsk_queryid queryid)
+pgsk_perf_close(void)
 {
-	/* Only the leader knows the queryid. */
-	Assert(!IsParallelWorker());
+	int			i;
 
-	pgsk->queryids[MyProcNumber] = queryid;
+	for (i = 0; i < pgsk_perf_nevents; i++)
+		close(pgsk_perf_fds[i]);
+	pgsk_perf_nevents = 0;
+	pgsk_perf_fd = -1;
 }
-#endif
 
-#if PG_VERSION_NUM >= 150000
 /*
- * Request additional shared memory resources.
- *
- * If you change code here, don't forget to also report the modifications in
- * _PG_init() for pg14 and below.
+ * Open the perf event group for the current process, only counting user
+ * space so that it works with the default kernel.perf_event_paranoid setting.
+ * The events that can't be opened are ignored, but the cycles one is
+ * required as it's the group leader.
  */
-static void
-pgsk_shmem_request(void)
+static bool
+pgsk_perf_open(void)
 {
-	if (prev_shmem_request_hook)
-		prev_shmem_request_hook();
+	int			i;
 
-	RequestAddinShmemSpace(pgsk_memsize());
-	RequestNamedLWLockTranche("pg_stat_kcache", 1);
-}
-#endif
+	for (i = 0; i < PGSK_PERF_NUM_EVENTS; i++)
+	{
+		struct perf_event_attr attr;
+		int			fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pgsk_perf_events[i].type;
+		attr.config = pgsk_perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP |
+			PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+					 i == 0 ? -1 : pgsk_perf_fds[0], PERF_FLAG_FD_CLOEXEC);
+		if (fd < 0)
+		{
+			if (i == 0)
+			{
+				ereport(LOG,
+						(errmsg("pg_stat_kcache: could not open perf event \"%s\": %m",
+								pgsk_perf_events[i].name),
+						 errdetail("Hardware performance counters are disabled for this backend."),
+						 errhint("Check the kernel.perf_event_paranoid sysctl.")));
+				pgsk_perf_fd = -2;
+				return false;
+			}
 
-static void
-pgsk_shmem_startup(void)
-{
-	bool		found;
-	HASHCTL		info;
-	FILE		*file;
-	int			i;
-	uint32		header;
-	int32		num;
-	pgskEntry	*buffer = NULL;
+			ereport(DEBUG1,
+					(errmsg("pg_stat_kcache: could not open perf event \"%s\": %m",
+							pgsk_perf_events[i].name)));
+			continue;
+		}
 
-	if (prev_shmem_startup_hook)
-		prev_shmem_startup_hook();
-
-	/* reset in case this is a restart within the postmaster */
-	pgsk = NULL;
-
-	/* Create or attach to the shared memory state */
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-
-	/* global access lock */
-	pgsk = ShmemInitStruct("pg_stat_kcache",
-					(sizeof(pgskSharedState)
-#if PG_VERSION_NUM >= 90600
-					 + pgsk_queryids_array_size()
-#endif
-					),
-					&found);
-
-	if (!found)
-	{
-		/* First time through ... */
-#if PG_VERSION_NUM >= 90600
-		pgsk->lock = &(GetNamedLWLockTranche("pg_stat_kcache"))->lock;
-#else
-		pgsk->lock = LWLockAssign();
-#endif
+		pgsk_perf_fds[pgsk_perf_nevents] = fd;
+		pgsk_perf_slots[pgsk_perf_nevents] = i;
+		pgsk_perf_nevents++;
 	}
 
-	/* set pgsk_max if needed */
-	pgsk_setmax();
+	pgsk_perf_fd = pgsk_perf_fds[0];
+	pgsk_perf_pid = MyProcPid;
 
-	memset(&info, 0, sizeof(info));
-	info.keysize = sizeof(pgskHashKey);
-	info.entrysize = sizeof(pgskEntry);
-	info.hash = pgsk_hash_fn;
-	info.match = pgsk_match_fn;
+	return true;
+}
 
-	/* allocate stats shared memory hash */
-	pgsk_hash = ShmemInitHash("pg_stat_kcache hash",
-							  pgsk_max, pgsk_max,
-							  &info,
-							  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+/*
+ * Read all the hardware counters of the group at once.
+ */
+static bool
+pgsk_read_perf(pgskUsage *usage)
+{
+	uint64		buf[3 + PGSK_PERF_NUM_EVENTS];
+	ssize_t		len;
+	int			i;
 
-	LWLockRelease(AddinShmemInitLock);
+	if (pgsk_perf_fd == -2)
+		return false;
 
-	if (!IsUnderPostmaster)
-		on_shmem_exit(pgsk_shmem_shutdown, (Datum) 0);
+	/* Counters of another process are useless */
+	if (pgsk_perf_fd >= 0 && pgsk_perf_pid != MyProcPid)
+		pgsk_perf_close();
 
-	/*
-	 * Done if some other process already completed our initialization.
-	 */
-	if (found)
-		return;
+	if (pgsk_perf_fd == -1 && !pgsk_perf_open())
+		return false;
 
-	/* Load stat file, don't care about locking */
-	file = AllocateFile(PGSK_DUMP_FILE, PG_BINARY_R);
-	if (file == NULL)
+	/* Layout is nr, time_enabled, time_running, values[nr] */
+	len = read(pgsk_perf_fd, buf, sizeof(buf));
+	if (len != (3 + pgsk_perf_nevents) * sizeof(uint64) ||
+		buf[0] != pgsk_perf_nevents)
 	{
-		if (errno == ENOENT)
-			return;			/* ignore not-found error */
-		goto error;
+		ereport(LOG,
+				(errmsg("pg_stat_kcache: could not read perf events: %m"),
+				 errdetail("Hardware performance counters are disabled for this backend.")));
+		pgsk_perf_close();
+		pgsk_perf_fd = -2;
+		return false;
 	}
 
-	/* check is header is valid */
-	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
-		header != PGSK_FILE_HEADER)
-		goto error;
+	usage->perf_enabled = buf[1];
+	usage->perf_running = buf[2];
+	memset(usage->perf, 0, sizeof(usage->perf));
+	for (i = 0; i < pgsk_perf_nevents; i++)
+		usage->perf[pgsk_perf_slots[i]] = buf[3 + i];
 
-	/* get number of entries */
-	if (fread(&num, sizeof(int32), 1, file) != 1)
-		goto error;
+	return true;
+}
+#endif
 
-	for (i = 0; i < num ; i++)
+/*
+ * Decide whether the current statement is tracked, according to
+ * pg_stat_kcache.sample_rate.  The decision is only made for top-level
+ * statements, nested ones inherit it.  The execution of a top-level
+ * statement follows the decision made when planning it, if any.  That
+ * decision is forgotten once the executor starts, when a utility statement
+ * runs instead and at transaction abort, so that a statement planned but
+ * never executed doesn't leak it to the next one.
+ */
+static bool
+pgsk_is_sampled(bool planning)
+{
+	if (nesting_level == 0)
 	{
-		pgskEntry	temp;
-		pgskEntry  *entry;
-
-		if (fread(&temp, sizeof(pgskEntry), 1, file) != 1)
-			goto error;
-
-		/* make the hashtable entry (discards old entries if too many) */
-		entry = pgsk_entry_alloc(&temp.key);
-
-		/* copy in the actual stats */
-		entry->counters[0] = temp.counters[0];
-		entry->counters[1] = temp.counters[1];
-		entry->stats_since = temp.stats_since;
-		/* don't initialize spinlock, already done */
+		if (planning || !pgsk_sample_planned)
+		{
+			if (pgsk_sample_rate >= 1.0)
+				pgsk_current_sampled = true;
+			else if (pgsk_sample_rate <= 0.0)
+				pgsk_current_sampled = false;
+			else
+#if PG_VERSION_NUM >= 150000
+				pgsk_current_sampled =
+					(pg_prng_double(&pg_global_prng_state) < pgsk_sample_rate);
+#else
+				pgsk_current_sampled =
+					(random() <= (MAX_RANDOM_VALUE * pgsk_sample_rate));
+#endif
+		}
+		pgsk_sample_planned = planning;
 	}
 
-	FreeFile(file);
+	return pgsk_current_sampled;
+}
+
+/*
+ * Capture the current resource usage using the given timing method.
+ */
+static void
+pgsk_capture_usage(pgskUsage *usage, int timing)
+{
+	usage->sampled = true;
+	usage->timing = timing;
 
+#ifdef PGSK_HAVE_PROC_IO
 	/*
-	 * Remove the file so it's not included in backups/replication slaves,
-	 * etc. A new file will be written on next shutdown.
+	 * The setting can change between the start and the end capture, the I/O
+	 * counters are only computed if both captured them.
 	 */
-	unlink(PGSK_DUMP_FILE);
+	usage->has_io = false;
+	if (pgsk_track_io)
+		usage->has_io = pgsk_read_proc_io(&usage->io);
+#endif
 
-	return;
+#ifdef PGSK_HAVE_PERF_EVENT
+	usage->has_perf = false;
+	if (pgsk_track_perf)
+		usage->has_perf = pgsk_read_perf(usage);
+#endif
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not read pg_stat_kcache file \"%s\": %m",
-					PGSK_DUMP_FILE)));
-	if (buffer)
-		pfree(buffer);
-	if (file)
-		FreeFile(file);
-	/* delete bogus file, don't care of errors in this case */
-	unlink(PGSK_DUMP_FILE);
+#ifdef PGSK_CPUTIME_CLOCK
+	if (timing != PGSK_TIMING_RUSAGE)
+		clock_gettime(PGSK_CPUTIME_CLOCK, &usage->cputime);
+#endif
+
+	if (timing != PGSK_TIMING_CLOCK)
+		getrusage(RUSAGE_SELF, &usage->rusage);
+
+#if PG_VERSION_NUM >= 180000
+	usage->shared_blks_read = pgBufferUsage.shared_blks_read;
+#endif
+
+	INSTR_TIME_SET_CURRENT(usage->wallclock);
 }
 
 /*
- * shmem_shutdown hook: dump statistics into file.
- *
+ * getrusage() CPU times are only precise up to the kernel tick, so use the
+ * executor's instrumentation instead for short executions.
  */
 static void
-pgsk_shmem_shutdown(int code, Datum arg)
+pgsk_short_cputime(pgskCounters *counters, QueryDesc *queryDesc)
 {
-	FILE	*file;
-	HASH_SEQ_STATUS hash_seq;
-	int32	num_entries;
-	pgskEntry	*entry;
+	if (queryDesc && queryDesc->totaltime)
+	{
+		/* Make sure stats accumulation is done */
+		InstrEndLoop(queryDesc->totaltime);
 
-	/* Don't try to dump during a crash. */
-	if (code)
-		return;
+		/*
+		 * We only consider values greater than 3 * linux tick, otherwise the
+		 * bias is too big
+		 */
+		if (queryDesc->totaltime->total < (3. / pgsk_linux_hz))
+		{
+			counters->stime = 0;
+			counters->utime = queryDesc->totaltime->total;
+		}
+	}
+}
 
-	if (!pgsk)
-		return;
+static void
+pgsk_compute_counters(pgskCounters *counters,
+					  pgskUsage *rusage_start,
+					  pgskUsage *rusage_end,
+					  QueryDesc *queryDesc)
+{
+		struct rusage *ru_start = &rusage_start->rusage;
+		struct rusage *ru_end = &rusage_end->rusage;
+		int			timing = rusage_start->timing;
+		instr_time	elapsed;
 
-	file = AllocateFile(PGSK_DUMP_FILE ".tmp", PG_BINARY_W);
-	if (file == NULL)
-		goto error;
+		Assert(rusage_end->timing == timing);
 
-	if (fwrite(&PGSK_FILE_HEADER, sizeof(uint32), 1, file) != 1)
-		goto error;
+		memset(counters, 0, sizeof(pgskCounters));
+		counters->calls = 1;
 
-	num_entries = hash_get_num_entries(pgsk_hash);
+		elapsed = rusage_end->wallclock;
+		INSTR_TIME_SUBTRACT(elapsed, rusage_start->wallclock);
+		counters->elapsed = INSTR_TIME_GET_DOUBLE(elapsed);
 
-	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
-		goto error;
+#ifdef PGSK_CPUTIME_CLOCK
+		if (timing != PGSK_TIMING_RUSAGE)
+		{
+			double		cputime = TIMESPEC_DIFF(rusage_start->cputime,
+												rusage_end->cputime);
 
-	hash_seq_init(&hash_seq, pgsk_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		if (fwrite(entry, sizeof(pgskEntry), 1, file) != 1)
+			/*
+			 * clock_gettime() doesn't distinguish user and system time.  If
+			 * getrusage() was also called, use its ratio to split the precise
+			 * CPU time, otherwise report it all as user time.
+			 */
+			if (timing == PGSK_TIMING_CLOCK_FULL)
+			{
+				double		utime = TIMEVAL_DIFF(ru_start->ru_utime, ru_end->ru_utime);
+				double		stime = TIMEVAL_DIFF(ru_start->ru_stime, ru_end->ru_stime);
+
+				if (utime + stime > 0)
+				{
+					counters->utime = cputime * utime / (utime + stime);
+					counters->stime = cputime - counters->utime;
+				}
+				else
+					counters->utime = cputime;
+			}
+			else
+				counters->utime = cputime;
+		}
+		else
+#endif
 		{
-			/* note: we assume hash_seq_term won't change errno */
-			hash_seq_term(&hash_seq);
-			goto error;
+			/* Compute CPU time delta */
+			counters->utime = TIMEVAL_DIFF(ru_start->ru_utime, ru_end->ru_utime);
+			counters->stime = TIMEVAL_DIFF(ru_start->ru_stime, ru_end->ru_stime);
+
+			pgsk_short_cputime(counters, queryDesc);
 		}
-	}
 
-	if (FreeFile(file))
-	{
-		file = NULL;
-		goto error;
-	}
+#ifdef PGSK_HAVE_PROC_IO
+		if (rusage_start->has_io && rusage_end->has_io)
+		{
+			pgskCounters *io_start = &rusage_start->io;
+			pgskCounters *io_end = &rusage_end->io;
+
+			counters->rchar = io_end->rchar - io_start->rchar;
+			counters->wchar = io_end->wchar - io_start->wchar;
+			counters->syscr = io_end->syscr - io_start->syscr;
+			counters->syscw = io_end->syscw - io_start->syscw;
+			counters->read_bytes = io_end->read_bytes - io_start->read_bytes;
+			counters->write_bytes = io_end->write_bytes - io_start->write_bytes;
+			counters->cancelled_write_bytes = io_end->cancelled_write_bytes -
+				io_start->cancelled_write_bytes;
+		}
+#endif
 
-	/*
-	 * Rename file inplace
-	 */
-	if (rename(PGSK_DUMP_FILE ".tmp", PGSK_DUMP_FILE) != 0)
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not rename pg_stat_kcache file \"%s\": %m",
-						PGSK_DUMP_FILE ".tmp")));
+#ifdef PGSK_HAVE_PERF_EVENT
+		if (rusage_start->has_perf && rusage_end->has_perf)
+		{
+			uint64		enabled = rusage_end->perf_enabled - rusage_start->perf_enabled;
+			uint64		running = rusage_end->perf_running - rusage_start->perf_running;
+			int			i;
 
-	return;
+			for (i = 0; i < PGSK_PERF_NUM_EVENTS; i++)
+			{
+				double		val = rusage_end->perf[i] - rusage_start->perf[i];
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not read pg_stat_kcache file \"%s\": %m",
-					PGSK_DUMP_FILE)));
+				/*
+				 * If the kernel had to multiplex the group with other events,
+				 * extrapolate the value for the whole duration.
+				 */
+				if (running > 0 && running < enabled)
+					val = val * enabled / running;
 
-	if (file)
-		FreeFile(file);
-	unlink(PGSK_DUMP_FILE);
+				*(int64 *) ((char *) counters + pgsk_perf_events[i].offset) =
+					(int64) val;
+			}
+		}
+#endif
+
+#if PG_VERSION_NUM >= 180000
+		/*
+		 * With io_method = worker, the reads of the shared buffers are done by
+		 * the I/O workers and don't show up in our getrusage() counters, so
+		 * count the shared buffers read in the meantime instead.  The buffer
+		 * usage of the parallel workers is accumulated in their leader's one
+		 * once they're done, so they don't count it themselves.
+		 */
+		if (pgsk_io_workers && pgsk_track_worker_io && !IsParallelWorker())
+			counters->io_worker_reads = rusage_end->shared_blks_read -
+				rusage_start->shared_blks_read;
+#endif
+
+		/* Only CPU time is available with the clock timing method */
+		if (timing == PGSK_TIMING_CLOCK)
+			return;
+
+		counters->rusage_calls = 1;
+
+#ifdef HAVE_GETRUSAGE
+		/* Compute the rest of the counters */
+		counters->minflts = ru_end->ru_minflt - ru_start->ru_minflt;
+		counters->majflts = ru_end->ru_majflt - ru_start->ru_majflt;
+		counters->nswaps = ru_end->ru_nswap - ru_start->ru_nswap;
+		counters->reads = ru_end->ru_inblock - ru_start->ru_inblock;
+		counters->writes = ru_end->ru_oublock - ru_start->ru_oublock;
+		counters->msgsnds = ru_end->ru_msgsnd - ru_start->ru_msgsnd;
+		counters->msgrcvs = ru_end->ru_msgrcv - ru_start->ru_msgrcv;
+		counters->nsignals = ru_end->ru_nsignals - ru_start->ru_nsignals;
+		counters->nvcsws = ru_end->ru_nvcsw - ru_start->ru_nvcsw;
+		counters->nivcsws = ru_end->ru_nivcsw - ru_start->ru_nivcsw;
+#endif
 }
 
-/*
- * Retrieve pg_stat_statement.max GUC value and store it into pgsk_max, since
- * we want to store the same number of entries as pg_stat_statements. Don't do
- * anything if pgsk_max is already set.
- */
-static void pgsk_setmax(void)
+#if PG_VERSION_NUM >= 90600
+static void
+pgsk_set_queryid(pgsk_queryid queryid)
 {
-	const char *pgss_max;
-	const char *name = "pg_stat_statements.max";
+	volatile pgskParallelSlot *slot = &pgsk->parallel[MyProcNumber];
 
-	if (pgsk_max != 0)
-		return;
+	/* Only the leader knows the queryid. */
+	Assert(!IsParallelWorker());
 
-	pgss_max = GetConfigOption(name, true, false);
+	slot->queryid = queryid;
 
 	/*
-	 * Retrieving pg_stat_statements.max can fail if pgss is loaded after pgsk
-	 * in shared_preload_libraries.  Hint user in case this happens.
+	 * Discard what the workers of a failed statement reported.  The workers of
+	 * this statement aren't launched yet.
 	 */
-	if (!pgss_max)
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_OBJECT),
-				 errmsg("unrecognized configuration parameter \"%s\"",
-						name),
-				 errhint("make sure pg_stat_statements is loaded,\n"
-					 "and make sure pg_stat_kcache is present after pg_stat_statements"
-					 " in the shared_preload_libraries setting")));
+	if (nesting_level == 0 && slot->workers_queryid != UINT64CONST(0))
+	{
+		SpinLockAcquire(&slot->mutex);
+		slot->workers_queryid = UINT64CONST(0);
+		memset((pgskCounters *) &slot->workers, 0, sizeof(pgskCounters));
+		SpinLockRelease(&slot->mutex);
+	}
+}
 
-	pgsk_max = atoi(pgss_max);
+/*
+ * Get the queryid of the statement of our parallel leader
+ */
+static pgsk_queryid
+pgsk_leader_queryid(void)
+{
+	Assert(IsParallelWorker());
+
+	return pgsk->parallel[ParallelLeaderProcNumber].queryid;
 }
 
-static Size pgsk_memsize(void)
+/*
+ * Publish the top-level statement this backend is starting, with the process
+ * counters at its start.  The getrusage() counters of the start capture are
+ * reused if there's one.
+ */
+static void
+pgsk_activity_start(pgsk_queryid queryid, const pgskUsage *usage)
 {
-	Size	size;
+	volatile pgskParallelSlot *slot = &pgsk->parallel[MyProcNumber];
+	struct rusage myrusage;
+	const struct rusage *ru = &myrusage;
 
-	Assert(pgsk_max != 0);
+	if (!pgsk_track_activity || queryid == UINT64CONST(0))
+	{
+		pgsk_activity_end();
+		return;
+	}
 
-	size = MAXALIGN(sizeof(pgskSharedState));
-	size = add_size(size, hash_estimate_size(pgsk_max, sizeof(pgskEntry)));
-#if PG_VERSION_NUM >= 90600
-	size = add_size(size, MAXALIGN(pgsk_queryids_array_size()));
+	if (usage && usage->sampled && usage->timing != PGSK_TIMING_CLOCK)
+		ru = &usage->rusage;
+	else
+		getrusage(RUSAGE_SELF, &myrusage);
+
+	SpinLockAcquire(&slot->mutex);
+	slot->activity_queryid = queryid;
+	slot->activity_pid = MyProcPid;
+	slot->activity_userid = GetUserId();
+	slot->activity_dbid = MyDatabaseId;
+	slot->activity_start = GetCurrentStatementStartTimestamp();
+	slot->activity_usage.utime = (double) ru->ru_utime.tv_sec +
+		(double) ru->ru_utime.tv_usec / 1000000.0;
+	slot->activity_usage.stime = (double) ru->ru_stime.tv_sec +
+		(double) ru->ru_stime.tv_usec / 1000000.0;
+#ifdef HAVE_GETRUSAGE
+	slot->activity_usage.minflts = ru->ru_minflt;
+	slot->activity_usage.majflts = ru->ru_majflt;
+	slot->activity_usage.reads = ru->ru_inblock;
+	slot->activity_usage.writes = ru->ru_oublock;
+	slot->activity_usage.nvcsws = ru->ru_nvcsw;
+	slot->activity_usage.nivcsws = ru->ru_nivcsw;
 #endif
+	SpinLockRelease(&slot->mutex);
 
-	return size;
+	pgsk_activity_published = true;
 }
 
-#if PG_VERSION_NUM >= 90600
-static Size
-pgsk_queryids_array_size(void)
+/*
+ * Remove the statement this backend published, if any.
+ */
+static void
+pgsk_activity_end(void)
 {
-	/*
-	 * queryid isn't pushed to parallel workers.  We store them in shared mem
-	 * for each query, identified by their BackendId.  It therefore needs room
-	 * for all possible backends, plus autovacuum launcher and workers, plus bg
-	 * workers and an extra one since BackendId numerotation starts at 1.
-	 * Starting with pg12, wal senders aren't part of MaxConnections anymore,
-	 * so they need to be accounted for.
-	 */
-#if PG_VERSION_NUM >= 150000
-	Assert (MaxBackends > 0);
-	return (sizeof(pgsk_queryid) * (MaxBackends + 1));
-#else
-	return (sizeof(pgsk_queryid) * (MaxConnections + autovacuum_max_workers + 1
-							+ max_worker_processes
-#if PG_VERSION_NUM >= 120000
-							+ max_wal_senders
-#endif		/* pg12+ */
-							+ 1));
-#endif		/* pg15- */
-}
-#endif
+	volatile pgskParallelSlot *slot;
+
+	if (!pgsk_activity_published)
+		return;
 
+	slot = &pgsk->parallel[MyProcNumber];
+	SpinLockAcquire(&slot->mutex);
+	slot->activity_queryid = UINT64CONST(0);
+	SpinLockRelease(&slot->mutex);
+
+	pgsk_activity_published = false;
+}
 
 /*
- * support functions
+ * Add the counters of a parallel worker to its leader's slot.  They're
+ * discarded if the leader moved to another statement in the meantime.
  */
-
 static void
-pgsk_entry_store(pgsk_queryid queryId, pgskStoreKind kind,
-				 pgskCounters counters)
+pgsk_worker_report(pgsk_queryid queryId, const pgskCounters *counters)
 {
-	volatile pgskEntry *e;
+	volatile pgskParallelSlot *slot = &pgsk->parallel[ParallelLeaderProcNumber];
 
-	pgskHashKey key;
-	pgskEntry  *entry;
+	Assert(IsParallelWorker());
 
-	/* Safety check... */
-	if (!pgsk || !pgsk_hash)
-		return;
+	SpinLockAcquire(&slot->mutex);
+	if (slot->workers_queryid != queryId)
+	{
+		slot->workers_queryid = queryId;
+		memset((pgskCounters *) &slot->workers, 0, sizeof(pgskCounters));
+	}
+	pgsk_counters_add(&slot->workers, counters);
+	SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * Retrieve and clear the counters reported by our parallel workers for the
+ * given statement.  Returns false if there aren't any.
+ */
+static bool
+pgsk_workers_collect(pgsk_queryid queryId, pgskCounters *counters)
+{
+	volatile pgskParallelSlot *slot = &pgsk->parallel[MyProcNumber];
+	bool		found = false;
+
+	Assert(!IsParallelWorker());
+
+	/* Cheap unlocked test for the common case of non parallel statements */
+	if (slot->workers_queryid == UINT64CONST(0))
+		return false;
+
+	/*
+	 * The counters may belong to an outer statement whose workers are still
+	 * running, e.g. if this one is a nested statement executed by the leader.
+	 */
+	SpinLockAcquire(&slot->mutex);
+	if (slot->workers_queryid == queryId)
+	{
+		*counters = slot->workers;
+		found = true;
+		slot->workers_queryid = UINT64CONST(0);
+		memset((pgskCounters *) &slot->workers, 0, sizeof(pgskCounters));
+	}
+	SpinLockRelease(&slot->mutex);
+
+	return found;
+}
+#endif
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Request additional shared memory resources.
+ *
+ * If you change code here, don't forget to also report the modifications in
+ * _PG_init() for pg14 and below.
+ */
+static void
+pgsk_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pgsk_memsize());
+	RequestNamedLWLockTranche("pg_stat_kcache", PGSK_NUM_LOCKS);
+}
+#endif
+
+static void
+pgsk_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+	FILE		*file;
+	struct stat	st;
+	uint32		i;
+	uint16		flags;
+	uint32		num;
+	Size		record_size;
+	const char *p;
+	char	   *buffer = NULL;
+	pgskLoadItem *items = NULL;
+	int			loaded[PGSK_NUM_PARTITIONS];
+	int			limit;
+	pg_crc32c	crc;
+	int			part;
+	pgskEntry  **slots;
+	bool		found_slots;
+	bool		found_aggs;
+	instr_time	load_start;
+	instr_time	load_duration;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	/* reset in case this is a restart within the postmaster */
+	pgsk = NULL;
+
+	/* Create or attach to the shared memory state */
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	/* global access lock */
+	pgsk = ShmemInitStruct("pg_stat_kcache",
+					(sizeof(pgskSharedState)
+#if PG_VERSION_NUM >= 90600
+					 + pgsk_parallel_array_size()
+#endif
+					),
+					&found);
+
+	if (!found)
+	{
+		/* First time through ... */
+#if PG_VERSION_NUM >= 90600
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_stat_kcache");
+
+		for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+			pgsk->locks[part] = &(locks[part].lock);
+		pgsk->agg_lock = &(locks[PGSK_NUM_PARTITIONS + 2].lock);
+#else
+		for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+			pgsk->locks[part] = LWLockAssign();
+		pgsk->agg_lock = LWLockAssign();
+#endif
+		for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+		{
+			pgsk->clock_hands[part] = 0;
+			pgsk->median_usage[part] = 0;
+		}
+		pgsk->entry_has_plan = pgsk_entry_has_plan;
+
+		/*
+		 * The generation isn't saved across restarts.  Start from the current
+		 * time in microseconds, so that it's still higher than any generation
+		 * a client got before a restart.
+		 */
+#ifdef PGSK_USE_ATOMICS
+		pg_atomic_init_u64(&pgsk->generation, (uint64) GetCurrentTimestamp());
+		pg_atomic_init_u64(&pgsk->epoch, 0);
+#else
+		pgsk->generation = (uint64) GetCurrentTimestamp();
+		pgsk->epoch = 0;
+		SpinLockInit(&pgsk->mutex);
+#endif
+		pgsk->epoch_since = 0;
+		pgsk_stat_reset(true);
+
+#if PG_VERSION_NUM >= 90600
+		for (i = 0; i < pgsk_parallel_num_slots(); i++)
+		{
+			pgskParallelSlot *slot = &pgsk->parallel[i];
+
+			slot->queryid = UINT64CONST(0);
+			SpinLockInit(&slot->mutex);
+			slot->workers_queryid = UINT64CONST(0);
+			memset(&slot->workers, 0, sizeof(pgskCounters));
+			slot->activity_queryid = UINT64CONST(0);
+		}
+#endif
+	}
+
+	/* set pgsk_max if needed */
+	pgsk_setmax();
+
+	/*
+	 * track_planning can have changed since the postmaster chose the layout,
+	 * so always use the one of the existing entries.
+	 */
+	pgsk_setlayout(pgsk->entry_has_plan);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgskHashKey);
+	info.entrysize = pgsk_entry_size();
+	info.hash = pgsk_hash_fn;
+	info.match = pgsk_match_fn;
+
+	/* allocate stats shared memory hash, one per partition */
+	slots = ShmemInitStruct("pg_stat_kcache slots",
+							pgsk_slots_array_size(),
+							&found_slots);
+	Assert(found == found_slots);
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		char		name[64];
+
+		pgsk_slots[part] = slots + (part * pgsk_partition_max);
+
+		/*
+		 * Only preallocate a few entries, so that the memory of the others is
+		 * only committed once they're used.  It's accounted for in
+		 * pgsk_memsize(), but another module could use it up in the meantime,
+		 * see pgsk_entry_alloc().
+		 */
+		snprintf(name, sizeof(name), "pg_stat_kcache hash %d", part);
+		pgsk_hash[part] = ShmemInitHash(name,
+										Min(pgsk_partition_max,
+											PGSK_PARTITION_INIT_SIZE),
+										pgsk_partition_max,
+										&info,
+										HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+	}
+
+	pgsk_aggs = ShmemInitStruct("pg_stat_kcache aggregates",
+								pgsk_aggs_array_size(),
+								&found_aggs);
+	if (!found_aggs)
+		pgsk_agg_reset(true);
+
+#if PG_VERSION_NUM >= 90600
+	if (pgsk_history_size > 0)
+	{
+		bool		found_history;
+
+		pgsk_history = ShmemInitStruct("pg_stat_kcache history",
+									   pgsk_history_size_bytes(),
+									   &found_history);
+		if (!found_history)
+		{
+			LWLockPadded *locks = GetNamedLWLockTranche("pg_stat_kcache");
+
+			pgsk_history->lock = &(locks[PGSK_NUM_PARTITIONS].lock);
+			pgsk_history->next = 0;
+		}
+	}
+
+	if (pgsk_events_size > 0)
+	{
+		bool		found_events;
+
+		pgsk_events = ShmemInitStruct("pg_stat_kcache events",
+									  pgsk_events_size_bytes(),
+									  &found_events);
+		if (!found_events)
+		{
+			LWLockPadded *locks = GetNamedLWLockTranche("pg_stat_kcache");
+			int			i;
+
+			pgsk_events->lock = &(locks[PGSK_NUM_PARTITIONS + 1].lock);
+			pg_atomic_init_u64(&pgsk_events->head, 0);
+			pg_atomic_init_u64(&pgsk_events->tail, 0);
+			pg_atomic_init_u64(&pgsk_events->dropped, 0);
+			for (i = 0; i < pgsk_events_size; i++)
+				pg_atomic_init_u64(&pgsk_events->events[i].seq, 0);
+		}
+	}
+#endif
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (!IsUnderPostmaster)
+		on_shmem_exit(pgsk_shmem_shutdown, (Datum) 0);
+
+	/*
+	 * Done if some other process already completed our initialization.
+	 */
+	if (found)
+		return;
+
+	/* Load stat file, don't care about locking */
+	INSTR_TIME_SET_CURRENT(load_start);
+	file = AllocateFile(PGSK_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno == ENOENT)
+			return;			/* ignore not-found error */
+		goto error;
+	}
+
+	/*
+	 * Read the whole file at once, and validate it before loading anything.
+	 * The file is never bigger than MaxAllocSize, see pgsk_write_file().
+	 */
+	if (fstat(fileno(file), &st) != 0)
+		goto error;
+
+	if (st.st_size < PGSK_RECORD_HEADER_SIZE + PGSK_RECORD_CRC_SIZE ||
+		st.st_size > MaxAllocSize)
+		goto invalid;
+
+	buffer = palloc(st.st_size);
+	if (fread(buffer, st.st_size, 1, file) != 1)
+		goto error;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buffer, st.st_size - PGSK_RECORD_CRC_SIZE);
+	FIN_CRC32C(crc);
+	p = buffer + st.st_size - PGSK_RECORD_CRC_SIZE;
+	if (!EQ_CRC32C(crc, (pg_crc32c) pgsk_get_u32(&p)))
+		goto invalid;
+
+	/* check if header is valid, and get the number of entries */
+	if (!pgsk_record_read_header(buffer, &flags, &num))
+		goto invalid;
+
+	record_size = pgsk_record_size(flags);
+	if (st.st_size != PGSK_RECORD_HEADER_SIZE + (Size) num * record_size +
+		PGSK_RECORD_CRC_SIZE)
+		goto invalid;
+
+	/*
+	 * The hashtable can't grow, so if there are more entries than what a
+	 * partition can hold, only load the most used ones rather than evicting
+	 * entries in the middle of the load.
+	 */
+	items = palloc(sizeof(pgskLoadItem) * Max(num, 1));
+	for (i = 0; i < num; i++)
+	{
+		pgskHashKey	key;
+
+		items[i].record = buffer + PGSK_RECORD_HEADER_SIZE + i * record_size;
+		pgsk_record_read_key(items[i].record, &key, &items[i].usage);
+		items[i].hashcode = pgsk_hash_fn(&key, sizeof(pgskHashKey));
+	}
+	qsort(items, num, sizeof(pgskLoadItem), load_item_cmp);
+
+	memset(loaded, 0, sizeof(loaded));
+	limit = pgsk_partition_limit();
+	for (i = 0; i < num; i++)
+	{
+		pgskHashKey		key;
+		pgskEntry  *entry;
+		pgskCounters	counters[PGSK_NUMSETS];
+		pgskHistCounts	hist;
+		TimestampTz		stats_since;
+
+		part = PGSK_PARTITION(items[i].hashcode);
+		if (loaded[part] >= limit)
+			continue;
+		loaded[part]++;
+
+		pgsk_record_read(items[i].record, flags, &key, counters,
+						 &stats_since, &hist);
+
+		/* make the hashtable entry, unless shared memory is exhausted */
+		entry = pgsk_entry_alloc(&key, items[i].hashcode);
+		if (!entry)
+			continue;
+
+		/* copy in the actual stats */
+		pgsk_entry_accum(entry, 0, counters);
+		pgsk_entry_set_usage(entry, counters[0].usage);
+		entry->stats_since = stats_since;
+
+		if ((flags & PGSK_RECORD_HAS_HIST) && pgsk_track_histograms)
+			pgsk_entry_hist_accum(entry, &hist);
+	}
+
+	pfree(items);
+	pfree(buffer);
+	FreeFile(file);
+
+	/*
+	 * Remove the file so it's not included in backups/replication slaves,
+	 * etc. A new file will be written on next shutdown.  Keep it if it's
+	 * periodically saved, as it's then what a crash restart would load.
+	 */
+#if PG_VERSION_NUM >= 90600
+	if (pgsk_save_interval == 0)
+#endif
+		unlink(PGSK_DUMP_FILE);
+
+	INSTR_TIME_SET_CURRENT(load_duration);
+	INSTR_TIME_SUBTRACT(load_duration, load_start);
+	pgsk_stat_set(PGSK_STAT_LOAD_TIME, INSTR_TIME_GET_MICROSEC(load_duration));
+
+	return;
+
+invalid:
+	ereport(LOG,
+			(errmsg("ignoring invalid pg_stat_kcache file \"%s\"",
+					PGSK_DUMP_FILE)));
+	goto cleanup;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read pg_stat_kcache file \"%s\": %m",
+					PGSK_DUMP_FILE)));
+cleanup:
+	if (items)
+		pfree(items);
+	if (buffer)
+		pfree(buffer);
+	if (file)
+		FreeFile(file);
+	/* delete bogus file, don't care of errors in this case */
+	unlink(PGSK_DUMP_FILE);
+}
+
+/*
+ * shmem_shutdown hook: dump statistics into file.
+ *
+ */
+static void
+pgsk_shmem_shutdown(int code, Datum arg)
+{
+	/* Don't try to dump during a crash. */
+	if (code)
+		return;
+
+	if (!pgsk)
+		return;
+
+	/* The postmaster can't take LWLocks, but there's no activity left */
+	pgsk_write_file(false);
+}
+
+/*
+ * Write the stats file, atomically replacing a previous version.  The whole
+ * file is serialized in memory and written with a single call, then fsynced
+ * before being renamed in place, so that a crash at any point leaves either
+ * the previous or the new version.  Errors are only logged.  If lock is
+ * false, the caller must ensure that the hashtable can't be modified
+ * concurrently.
+ */
+static bool
+pgsk_write_file(bool lock)
+{
+	FILE	   *file = NULL;
+	StringInfoData buf;
+	uint16		flags = pgsk_track_histograms ? PGSK_RECORD_HAS_HIST : 0;
+	uint64		num_entries = 0;
+	pg_crc32c	crc;
+	char		crcbuf[PGSK_RECORD_CRC_SIZE];
+	int			part;
+	instr_time	start;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* neither enlargeStringInfo() nor the load could handle a bigger file */
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+		num_entries += hash_get_num_entries(pgsk_hash[part]);
+
+	if (PGSK_RECORD_HEADER_SIZE + num_entries * pgsk_record_size(flags) +
+		PGSK_RECORD_CRC_SIZE > MaxAllocSize)
+	{
+		ereport(LOG,
+				(errmsg("could not write pg_stat_kcache file \"%s\": too many entries",
+						PGSK_DUMP_FILE)));
+		return false;
+	}
+
+	initStringInfo(&buf);
+	pgsk_serialize(&buf, flags, lock);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buf.data, buf.len);
+	FIN_CRC32C(crc);
+	pgsk_put_u32(crcbuf, (uint32) crc);
+	appendBinaryStringInfo(&buf, crcbuf, PGSK_RECORD_CRC_SIZE);
+
+	file = AllocateFile(PGSK_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(buf.data, buf.len, 1, file) != 1 ||
+		fflush(file) != 0 ||
+		pg_fsync(fileno(file)) != 0)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+	pfree(buf.data);
+
+	/*
+	 * Rename file inplace
+	 */
+#if PG_VERSION_NUM >= 100000
+	if (durable_rename(PGSK_DUMP_FILE ".tmp", PGSK_DUMP_FILE, LOG) != 0)
+		return false;
+#else
+	if (rename(PGSK_DUMP_FILE ".tmp", PGSK_DUMP_FILE) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename pg_stat_kcache file \"%s\": %m",
+						PGSK_DUMP_FILE ".tmp")));
+		return false;
+	}
+#endif
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	pgsk_stat_add(PGSK_STAT_SAVES, 1);
+	pgsk_stat_add(PGSK_STAT_SAVE_TIME, INSTR_TIME_GET_MICROSEC(duration));
+
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write pg_stat_kcache file \"%s\": %m",
+					PGSK_DUMP_FILE ".tmp")));
+
+	if (file)
+		FreeFile(file);
+	pfree(buf.data);
+	unlink(PGSK_DUMP_FILE ".tmp");
+
+	return false;
+}
+
+/*
+ * Little-endian encoding helpers for the serialized records
+ */
+static char *
+pgsk_put_u32(char *p, uint32 v)
+{
+	int			i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (char) ((v >> (8 * i)) & 0xFF);
+
+	return p + 4;
+}
+
+static char *
+pgsk_put_u64(char *p, uint64 v)
+{
+	int			i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (char) ((v >> (8 * i)) & 0xFF);
+
+	return p + 8;
+}
+
+static char *
+pgsk_put_f64(char *p, double v)
+{
+	uint64		bits;
+
+	memcpy(&bits, &v, sizeof(uint64));
+
+	return pgsk_put_u64(p, bits);
+}
+
+static uint32
+pgsk_get_u32(const char **p)
+{
+	const unsigned char *b = (const unsigned char *) *p;
+	uint32		v = 0;
+	int			i;
+
+	for (i = 0; i < 4; i++)
+		v |= ((uint32) b[i]) << (8 * i);
+	*p += 4;
+
+	return v;
+}
+
+static uint64
+pgsk_get_u64(const char **p)
+{
+	const unsigned char *b = (const unsigned char *) *p;
+	uint64		v = 0;
+	int			i;
+
+	for (i = 0; i < 8; i++)
+		v |= ((uint64) b[i]) << (8 * i);
+	*p += 8;
+
+	return v;
+}
+
+static double
+pgsk_get_f64(const char **p)
+{
+	uint64		bits = pgsk_get_u64(p);
+	double		v;
+
+	memcpy(&v, &bits, sizeof(double));
+
+	return v;
+}
+
+/*
+ * Size of a serialized record with the given flags
+ */
+static Size
+pgsk_record_size(uint16 flags)
+{
+	Size		size = PGSK_RECORD_BASE_SIZE;
+
+	if (flags & PGSK_RECORD_HAS_HIST)
+		size += PGSK_RECORD_HIST_SIZE;
+
+	return size;
+}
+
+/*
+ * Serialize the header for nrecords records with the given flags
+ */
+static void
+pgsk_record_write_header(char *buf, uint16 flags, uint32 nrecords)
+{
+	char	   *p = buf;
+
+	p = pgsk_put_u32(p, PGSK_RECORD_MAGIC);
+	p = pgsk_put_u32(p, ((uint32) flags << 16) | PGSK_RECORD_VERSION);
+	p = pgsk_put_u32(p, (uint32) pgsk_record_size(flags));
+	p = pgsk_put_u32(p, nrecords);
+	p = pgsk_put_u64(p, (uint64) GetCurrentTimestamp());
+
+	Assert(p - buf == PGSK_RECORD_HEADER_SIZE);
+}
+
+/*
+ * Check a serialized header, and extract the flags and number of records.
+ * Returns false if the header isn't one this version can read.
+ */
+static bool
+pgsk_record_read_header(const char *buf, uint16 *flags, uint32 *nrecords)
+{
+	const char *p = buf;
+	uint32		version;
+
+	if (pgsk_get_u32(&p) != PGSK_RECORD_MAGIC)
+		return false;
+
+	version = pgsk_get_u32(&p);
+	if ((version & 0xFFFF) != PGSK_RECORD_VERSION)
+		return false;
+	*flags = (uint16) (version >> 16);
+
+	if (pgsk_get_u32(&p) != pgsk_record_size(*flags))
+		return false;
+
+	*nrecords = pgsk_get_u32(&p);
+
+	return true;
+}
+
+/*
+ * Serialize the given entry.  buf must have room for pgsk_record_size(flags)
+ * bytes.
+ */
+static void
+pgsk_record_write(char *buf, pgskEntry *entry, uint16 flags)
+{
+	pgskCounters	counters[PGSK_NUMSETS];
+	char		   *p = buf;
+	int				kind;
+
+	pgsk_entry_snapshot(entry, counters);
+
+	p = pgsk_put_u32(p, entry->key.userid);
+	p = pgsk_put_u32(p, entry->key.dbid);
+	p = pgsk_put_u64(p, (uint64) entry->key.queryid);
+	p = pgsk_put_u32(p, entry->key.top ? 1 : 0);
+	p = pgsk_put_u32(p, 0);		/* reserved */
+	p = pgsk_put_u64(p, (uint64) entry->stats_since);
+	p = pgsk_put_f64(p, counters[0].usage);
+
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskCounters *c = &counters[kind];
+
+		p = pgsk_put_u64(p, (uint64) c->calls);
+		p = pgsk_put_f64(p, c->utime);
+		p = pgsk_put_f64(p, c->stime);
+#ifdef HAVE_GETRUSAGE
+		p = pgsk_put_u64(p, (uint64) c->minflts);
+		p = pgsk_put_u64(p, (uint64) c->majflts);
+		p = pgsk_put_u64(p, (uint64) c->nswaps);
+		p = pgsk_put_u64(p, (uint64) c->reads * RUSAGE_BLOCK_SIZE);
+		p = pgsk_put_u64(p, (uint64) c->writes * RUSAGE_BLOCK_SIZE);
+		p = pgsk_put_u64(p, (uint64) c->msgsnds);
+		p = pgsk_put_u64(p, (uint64) c->msgrcvs);
+		p = pgsk_put_u64(p, (uint64) c->nsignals);
+		p = pgsk_put_u64(p, (uint64) c->nvcsws);
+		p = pgsk_put_u64(p, (uint64) c->nivcsws);
+#else
+		memset(p, 0, 10 * sizeof(uint64));
+		p += 10 * sizeof(uint64);
+#endif
+		p = pgsk_put_u64(p, (uint64) c->rchar);
+		p = pgsk_put_u64(p, (uint64) c->wchar);
+		p = pgsk_put_u64(p, (uint64) c->syscr);
+		p = pgsk_put_u64(p, (uint64) c->syscw);
+		p = pgsk_put_u64(p, (uint64) c->read_bytes);
+		p = pgsk_put_u64(p, (uint64) c->write_bytes);
+		p = pgsk_put_u64(p, (uint64) c->cancelled_write_bytes);
+		p = pgsk_put_u64(p, (uint64) c->cycles);
+		p = pgsk_put_u64(p, (uint64) c->instructions);
+		p = pgsk_put_u64(p, (uint64) c->llc_misses);
+		p = pgsk_put_u64(p, (uint64) c->branch_misses);
+		p = pgsk_put_u64(p, (uint64) c->dtlb_misses);
+		p = pgsk_put_f64(p, c->elapsed);
+		p = pgsk_put_u64(p, (uint64) c->io_worker_reads * BLCKSZ);
+		p = pgsk_put_u64(p, (uint64) c->rusage_calls);
+	}
+
+	Assert(p - buf == PGSK_RECORD_BASE_SIZE);
+
+	if (flags & PGSK_RECORD_HAS_HIST)
+	{
+		pgskHistCounts	hist;
+		int				h, b;
+
+		pgsk_entry_hist_snapshot(entry, &hist);
+		for (h = 0; h < PGSK_NUM_HISTS; h++)
+			for (b = 0; b < PGSK_HIST_BUCKETS; b++)
+				p = pgsk_put_u64(p, hist.buckets[h][b]);
+	}
+}
+
+/*
+ * Deserialize a record written by pgsk_record_write().  The usage is
+ * returned in counters[0].usage, and hist is only filled if the record has
+ * histograms.
+ */
+static void
+pgsk_record_read(const char *buf, uint16 flags, pgskHashKey *key,
+				 pgskCounters counters[PGSK_NUMSETS],
+				 TimestampTz *stats_since, pgskHistCounts *hist)
+{
+	const char *p = buf;
+	int			kind;
+
+	memset(counters, 0, sizeof(pgskCounters) * PGSK_NUMSETS);
+
+	key->userid = (Oid) pgsk_get_u32(&p);
+	key->dbid = (Oid) pgsk_get_u32(&p);
+	key->queryid = (pgsk_queryid) pgsk_get_u64(&p);
+	key->top = (pgsk_get_u32(&p) != 0);
+	(void) pgsk_get_u32(&p);	/* reserved */
+	*stats_since = (TimestampTz) pgsk_get_u64(&p);
+	counters[0].usage = pgsk_get_f64(&p);
+
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskCounters *c = &counters[kind];
+
+		c->calls = (int64) pgsk_get_u64(&p);
+		c->utime = pgsk_get_f64(&p);
+		c->stime = pgsk_get_f64(&p);
+#ifdef HAVE_GETRUSAGE
+		c->minflts = (int64) pgsk_get_u64(&p);
+		c->majflts = (int64) pgsk_get_u64(&p);
+		c->nswaps = (int64) pgsk_get_u64(&p);
+		c->reads = (int64) (pgsk_get_u64(&p) / RUSAGE_BLOCK_SIZE);
+		c->writes = (int64) (pgsk_get_u64(&p) / RUSAGE_BLOCK_SIZE);
+		c->msgsnds = (int64) pgsk_get_u64(&p);
+		c->msgrcvs = (int64) pgsk_get_u64(&p);
+		c->nsignals = (int64) pgsk_get_u64(&p);
+		c->nvcsws = (int64) pgsk_get_u64(&p);
+		c->nivcsws = (int64) pgsk_get_u64(&p);
+#else
+		p += 10 * sizeof(uint64);
+#endif
+		c->rchar = (int64) pgsk_get_u64(&p);
+		c->wchar = (int64) pgsk_get_u64(&p);
+		c->syscr = (int64) pgsk_get_u64(&p);
+		c->syscw = (int64) pgsk_get_u64(&p);
+		c->read_bytes = (int64) pgsk_get_u64(&p);
+		c->write_bytes = (int64) pgsk_get_u64(&p);
+		c->cancelled_write_bytes = (int64) pgsk_get_u64(&p);
+		c->cycles = (int64) pgsk_get_u64(&p);
+		c->instructions = (int64) pgsk_get_u64(&p);
+		c->llc_misses = (int64) pgsk_get_u64(&p);
+		c->branch_misses = (int64) pgsk_get_u64(&p);
+		c->dtlb_misses = (int64) pgsk_get_u64(&p);
+		c->elapsed = pgsk_get_f64(&p);
+		c->io_worker_reads = (int64) (pgsk_get_u64(&p) / BLCKSZ);
+		c->rusage_calls = (int64) pgsk_get_u64(&p);
+	}
+
+	Assert(p - buf == PGSK_RECORD_BASE_SIZE);
+
+	if (flags & PGSK_RECORD_HAS_HIST)
+	{
+		int			h, b;
+
+		for (h = 0; h < PGSK_NUM_HISTS; h++)
+			for (b = 0; b < PGSK_HIST_BUCKETS; b++)
+				hist->buckets[h][b] = pgsk_get_u64(&p);
+	}
+}
+
+/*
+ * Deserialize only the key and the usage of a record
+ */
+static void
+pgsk_record_read_key(const char *buf, pgskHashKey *key, double *usage)
+{
+	const char *p = buf;
+
+	key->userid = (Oid) pgsk_get_u32(&p);
+	key->dbid = (Oid) pgsk_get_u32(&p);
+	key->queryid = (pgsk_queryid) pgsk_get_u64(&p);
+	key->top = (pgsk_get_u32(&p) != 0);
+	(void) pgsk_get_u32(&p);	/* reserved */
+	(void) pgsk_get_u64(&p);	/* stats_since */
+	*usage = pgsk_get_f64(&p);
+}
+
+/*
+ * Append the header and the records of all the entries to buf.  Each
+ * partition is serialized while holding its lock, if asked to.
+ */
+static void
+pgsk_serialize(StringInfo buf, uint16 flags, bool lock)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	pgskEntry	   *entry;
+	Size			record_size = pgsk_record_size(flags);
+	int				header_off = buf->len;
+	uint32			num_entries = 0;
+	int				part;
+
+	/* room for the header, filled in below */
+	enlargeStringInfo(buf, PGSK_RECORD_HEADER_SIZE);
+	buf->len += PGSK_RECORD_HEADER_SIZE;
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		if (lock)
+			LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+		/* reserve the space for the whole partition at once */
+		enlargeStringInfo(buf,
+						  hash_get_num_entries(pgsk_hash[part]) * record_size);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			pgsk_record_write(buf->data + buf->len, entry, flags);
+			buf->len += record_size;
+			num_entries++;
+		}
+
+		if (lock)
+			LWLockRelease(pgsk->locks[part]);
+	}
+
+	pgsk_record_write_header(buf->data + header_off, flags, num_entries);
+}
+
+/*
+ * qsort comparator for the stats file loading: group the records by
+ * partition, most used first.
+ */
+static int
+load_item_cmp(const void *lhs, const void *rhs)
+{
+	const pgskLoadItem *l = (const pgskLoadItem *) lhs;
+	const pgskLoadItem *r = (const pgskLoadItem *) rhs;
+	int			l_part = PGSK_PARTITION(l->hashcode);
+	int			r_part = PGSK_PARTITION(r->hashcode);
+
+	if (l_part != r_part)
+		return l_part < r_part ? -1 : 1;
+	if (l->usage > r->usage)
+		return -1;
+	else if (l->usage < r->usage)
+		return +1;
+	else
+		return 0;
+}
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Signal handlers for the background worker
+ */
+static void
+pgsk_bgworker_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	pgsk_got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+pgsk_bgworker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	pgsk_got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Number of milliseconds before the next action that should happen every
+ * interval seconds since last, or -1 if it's disabled.
+ */
+static long
+pgsk_bgworker_timeout(TimestampTz last, int interval)
+{
+	long		secs;
+	int			usecs;
+
+	if (interval <= 0)
+		return -1;
+
+	TimestampDifference(last, GetCurrentTimestamp(), &secs, &usecs);
+
+	return Max(0, (interval - secs) * 1000L - usecs / 1000);
+}
+
+/*
+ * Background worker periodically saving the stats file, so that a crash
+ * loses at most pg_stat_kcache.save_interval of statistics, and sampling the
+ * activity into the history ring if configured.  The file saved at shutdown
+ * is still written by the postmaster.
+ */
+void
+pgsk_bgworker_main(Datum main_arg)
+{
+	TimestampTz	last_save = GetCurrentTimestamp();
+	TimestampTz	last_history = last_save;
+	HTAB	   *prev = NULL;
+	uint64		pass = 0;
+
+	pqsignal(SIGHUP, pgsk_bgworker_sighup);
+	pqsignal(SIGTERM, pgsk_bgworker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	while (!pgsk_got_sigterm)
+	{
+		int			rc;
+		int			events = WL_LATCH_SET | WL_POSTMASTER_DEATH;
+		long		timeout;
+		long		history_timeout = -1;
+
+		timeout = pgsk_bgworker_timeout(last_save, pgsk_save_interval);
+		if (pgsk_history)
+			history_timeout = pgsk_bgworker_timeout(last_history,
+													pgsk_history_interval);
+		if (history_timeout >= 0 && (timeout < 0 || history_timeout < timeout))
+			timeout = history_timeout;
+		if (timeout >= 0)
+			events |= WL_TIMEOUT;
+
+		rc = WaitLatch(MyLatch, events, timeout
+#if PG_VERSION_NUM >= 100000
+					   , PG_WAIT_EXTENSION
+#endif
+					   );
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (pgsk_got_sighup)
+		{
+			pgsk_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (pgsk_bgworker_timeout(last_save, pgsk_save_interval) == 0)
+		{
+			pgsk_write_file(true);
+			last_save = GetCurrentTimestamp();
+		}
+
+		if (pgsk_history &&
+			pgsk_bgworker_timeout(last_history, pgsk_history_interval) == 0)
+		{
+			/* The first pass only records the current counters */
+			if (prev == NULL)
+				prev = pgsk_history_create_prev();
+			pgsk_history_sample(prev, pass++);
+			last_history = GetCurrentTimestamp();
+		}
+	}
+
+	proc_exit(1);
+}
+
+/*
+ * Size of the history ring shared memory
+ */
+static Size
+pgsk_history_size_bytes(void)
+{
+	if (pgsk_history_size <= 0)
+		return 0;
+
+	return add_size(offsetof(pgskHistoryState, records),
+					mul_size(sizeof(pgskHistoryRecord), pgsk_history_size));
+}
+
+/*
+ * Size of the events ring shared memory
+ */
+static Size
+pgsk_events_size_bytes(void)
+{
+	if (pgsk_events_size <= 0)
+		return 0;
+
+	return add_size(offsetof(pgskEventRing, events),
+					mul_size(sizeof(pgskEvent), pgsk_events_size));
+}
+
+/*
+ * Add an execution to the events ring, or count it as dropped if the ring is
+ * full.  This never waits, neither for other backends nor for the consumers.
+ */
+static void
+pgsk_event_add(const pgskHashKey *key, const pgskCounters *counters)
+{
+	pgskEvent  *event;
+	uint64		head;
+
+	head = pg_atomic_read_u64(&pgsk_events->head);
+	for (;;)
+	{
+		uint64		tail = pg_atomic_read_u64(&pgsk_events->tail);
+
+		if (head - tail >= (uint64) pgsk_events_size)
+		{
+			pg_atomic_fetch_add_u64(&pgsk_events->dropped, 1);
+			return;
+		}
+
+		/* head is updated on failure */
+		if (pg_atomic_compare_exchange_u64(&pgsk_events->head, &head,
+										   head + 1))
+			break;
+	}
+
+	/* The slot is ours until the consumers move past it */
+	event = &pgsk_events->events[head % pgsk_events_size];
+	event->ts = GetCurrentTimestamp();
+	event->pid = MyProcPid;
+	event->key = *key;
+	event->counters = *counters;
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&event->seq, head + 1);
+}
+
+static HTAB *
+pgsk_history_create_prev(void)
+{
+	HASHCTL		info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgskHashKey);
+	info.entrysize = sizeof(pgskHistoryPrev);
+	info.hash = pgsk_hash_fn;
+	info.match = pgsk_match_fn;
+
+	return hash_create("pg_stat_kcache history previous counters",
+					   pgsk_max, &info,
+					   HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+}
+
+/*
+ * Compute the activity between two sets of counters, prev being NULL for a
+ * new entry.  Returns false if the entry wasn't used in the meantime.
+ */
+static bool
+pgsk_history_delta(pgskHistoryRecord *rec,
+				   const pgskCounters cur[PGSK_NUMKIND],
+				   const pgskCounters prev[PGSK_NUMKIND])
+{
+	int			kind;
+
+	rec->plan_calls = cur[PGSK_PLAN].calls;
+	rec->exec_calls = cur[PGSK_EXEC].calls;
+	if (prev)
+	{
+		rec->plan_calls -= prev[PGSK_PLAN].calls;
+		rec->exec_calls -= prev[PGSK_EXEC].calls;
+	}
+
+	if (rec->plan_calls == 0 && rec->exec_calls == 0)
+		return false;
+
+	rec->utime = rec->stime = 0;
+	rec->reads = rec->writes = 0;
+	rec->minflts = rec->majflts = rec->nvcsws = rec->nivcsws = 0;
+	rec->rchar = rec->wchar = rec->read_bytes = rec->write_bytes = 0;
+	rec->rusage_calls = 0;
+
+	for (kind = 0; kind < PGSK_NUMKIND; kind++)
+	{
+		const pgskCounters *c = &cur[kind];
+		const pgskCounters *p = prev ? &prev[kind] : NULL;
+
+#define PGSK_HISTORY_ADD(field, dst) \
+		rec->dst += c->field - (p ? p->field : 0)
+		PGSK_HISTORY_ADD(utime, utime);
+		PGSK_HISTORY_ADD(stime, stime);
+#ifdef HAVE_GETRUSAGE
+		PGSK_HISTORY_ADD(reads, reads);
+		PGSK_HISTORY_ADD(writes, writes);
+		PGSK_HISTORY_ADD(minflts, minflts);
+		PGSK_HISTORY_ADD(majflts, majflts);
+		PGSK_HISTORY_ADD(nvcsws, nvcsws);
+		PGSK_HISTORY_ADD(nivcsws, nivcsws);
+#endif
+		PGSK_HISTORY_ADD(rchar, rchar);
+		PGSK_HISTORY_ADD(wchar, wchar);
+		PGSK_HISTORY_ADD(read_bytes, read_bytes);
+		PGSK_HISTORY_ADD(write_bytes, write_bytes);
+		PGSK_HISTORY_ADD(rusage_calls, rusage_calls);
+#undef PGSK_HISTORY_ADD
+	}
+
+	return true;
+}
+
+/*
+ * Add the activity of all the entries since the previous pass to the history
+ * ring.  The records are first built locally, so that each partition lock is
+ * only held to copy the counters, and the ring lock only to copy the records.
+ * Nothing is added for the first pass, which only records the counters.
+ */
+static void
+pgsk_history_sample(HTAB *prev, uint64 pass)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	pgskEntry	   *entry;
+	pgskHistoryPrev *p;
+	pgskHistoryRecord *records;
+	uint64			nrecords = 0;
+	int				maxrecords = Min(64, pgsk_history_size);
+	TimestampTz		now = GetCurrentTimestamp();
+	uint64			i;
+	int				part;
+
+	records = palloc(sizeof(pgskHistoryRecord) * maxrecords);
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			pgskCounters	cur[PGSK_NUMSETS];
+			bool			found;
+			bool			reused;
+
+			pgsk_entry_snapshot(entry, cur);
+
+			p = (pgskHistoryPrev *) hash_search(prev, &entry->key,
+												HASH_ENTER, &found);
+
+			/* Ignore the previous counters of an evicted or reset entry */
+			reused = found &&
+				(p->stats_since != entry->stats_since ||
+				 cur[PGSK_PLAN].calls < p->counters[PGSK_PLAN].calls ||
+				 cur[PGSK_EXEC].calls < p->counters[PGSK_EXEC].calls);
+
+			if (pass > 0)
+			{
+				pgskHistoryRecord rec;
+
+				if (pgsk_history_delta(&rec, cur,
+									   (found && !reused) ? p->counters : NULL))
+				{
+					/*
+					 * Never keep more records than the ring can hold, the
+					 * oldest ones would be overwritten anyway.
+					 */
+					if (nrecords >= maxrecords && maxrecords < pgsk_history_size)
+					{
+						maxrecords = Min(maxrecords * 2, pgsk_history_size);
+						records = repalloc(records, sizeof(pgskHistoryRecord) *
+										   maxrecords);
+					}
+
+					rec.ts = now;
+					rec.key = entry->key;
+					records[nrecords % maxrecords] = rec;
+					nrecords++;
+				}
+			}
+
+			p->stats_since = entry->stats_since;
+			p->pass = pass;
+			memcpy(p->counters, cur, sizeof(p->counters));
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+
+	/* Forget about the entries that don't exist anymore */
+	hash_seq_init(&hash_seq, prev);
+	while ((p = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (p->pass != pass)
+			hash_search(prev, &p->key, HASH_REMOVE, NULL);
+	}
+
+	if (nrecords > 0)
+	{
+		LWLockAcquire(pgsk_history->lock, LW_EXCLUSIVE);
+		for (i = nrecords > (uint64) maxrecords ? nrecords - maxrecords : 0;
+			 i < nrecords; i++)
+		{
+			pgsk_history->records[pgsk_history->next % pgsk_history_size] =
+				records[i % maxrecords];
+			pgsk_history->next++;
+		}
+		LWLockRelease(pgsk_history->lock);
+	}
+
+	pfree(records);
+}
+#endif
+
+/*
+ * Choose the layout of the counters stored in the shared hashtable entries.
+ *
+ * The default layout stores all the counter sets.  With
+ * pg_stat_kcache.compact_layout, the planning counters are only stored if
+ * has_plan is true, and on Linux the rusage counters that the kernel never
+ * maintains aren't stored either, which saves about a third of the memory of
+ * each entry.
+ */
+static void
+pgsk_setlayout(bool has_plan)
+{
+	int			nsets = PGSK_NUMSETS;
+
+	pgsk_entry_has_plan = has_plan || !pgsk_compact_layout;
+	if (!pgsk_entry_has_plan)
+		nsets--;
+
+	pgsk_entry_full = true;
+	pgsk_entry_counters_size = sizeof(pgskEntryCounters);
+#ifdef PGSK_COMPACT_RUSAGE
+	if (pgsk_compact_layout)
+	{
+		pgsk_entry_full = false;
+		pgsk_entry_counters_size = offsetof(pgskSharedCounters, nswaps);
+	}
+#endif
+
+	pgsk_entry_hist_offset = MAXALIGN(sizeof(pgskEntry))
+		+ MAXALIGN(nsets * pgsk_entry_counters_size);
+}
+
+/*
+ * Store the maximum number of entries into pgsk_max.  Unless
+ * pg_stat_kcache.max is set, retrieve pg_stat_statement.max GUC value, since
+ * we want to store the same number of entries as pg_stat_statements. Don't do
+ * anything if pgsk_max is already set.
+ */
+static void pgsk_setmax(void)
+{
+	const char *pgss_max;
+	const char *name = "pg_stat_statements.max";
+
+	if (pgsk_max != 0)
+		return;
+
+	if (pgsk_max_setting > 0)
+	{
+		pgsk_max = pgsk_max_setting;
+		pgsk_partition_max = (pgsk_max + PGSK_NUM_PARTITIONS - 1) /
+			PGSK_NUM_PARTITIONS;
+		return;
+	}
+
+	pgss_max = GetConfigOption(name, true, false);
+
+	/*
+	 * Retrieving pg_stat_statements.max can fail if pgss is loaded after pgsk
+	 * in shared_preload_libraries.  Hint user in case this happens.
+	 */
+	if (!pgss_max)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("unrecognized configuration parameter \"%s\"",
+						name),
+				 errhint("make sure pg_stat_statements is loaded,\n"
+					 "and make sure pg_stat_kcache is present after pg_stat_statements"
+					 " in the shared_preload_libraries setting")));
+
+	pgsk_max = atoi(pgss_max);
+	pgsk_partition_max = (pgsk_max + PGSK_NUM_PARTITIONS - 1) /
+		PGSK_NUM_PARTITIONS;
+}
+
+/*
+ * Number of entries of a partition above which entries are evicted, which is
+ * never more than the partition can hold.
+ */
+static int
+pgsk_partition_limit(void)
+{
+	int			limit;
+
+	if (pgsk_eviction_threshold < 0 || pgsk_eviction_threshold >= pgsk_max)
+		return pgsk_partition_max;
+
+	limit = (pgsk_eviction_threshold + PGSK_NUM_PARTITIONS - 1) /
+		PGSK_NUM_PARTITIONS;
+
+	return Max(limit, 1);
+}
+
+static Size pgsk_memsize(void)
+{
+	Size	size;
+
+	Assert(pgsk_max != 0);
+
+	size = MAXALIGN(sizeof(pgskSharedState));
+	size = add_size(size, mul_size(PGSK_NUM_PARTITIONS,
+								   hash_estimate_size(pgsk_partition_max,
+													  pgsk_entry_size())));
+	size = add_size(size, MAXALIGN(pgsk_slots_array_size()));
+	size = add_size(size, MAXALIGN(pgsk_aggs_array_size()));
+#if PG_VERSION_NUM >= 90600
+	size = add_size(size, MAXALIGN(pgsk_parallel_array_size()));
+	size = add_size(size, MAXALIGN(pgsk_history_size_bytes()));
+	size = add_size(size, MAXALIGN(pgsk_events_size_bytes()));
+#endif
+
+	return size;
+}
+
+/*
+ * Size of the aggregates arrays, one per aggregate kind
+ */
+static Size
+pgsk_aggs_array_size(void)
+{
+	return mul_size(sizeof(pgskAggEntry),
+					mul_size(PGSK_NUM_AGGS, pgsk_max_aggregates));
+}
+
+/*
+ * Size of a shared hashtable entry, including its counter sets and the
+ * histograms if tracked.  pgsk_setlayout() must have been called.
+ */
+static Size
+pgsk_entry_size(void)
+{
+	Assert(pgsk_entry_hist_offset != 0);
+
+	if (pgsk_track_histograms)
+		return add_size(pgsk_entry_hist_offset, sizeof(pgskHistogram));
+
+	return pgsk_entry_hist_offset;
+}
+
+static Size
+pgsk_slots_array_size(void)
+{
+	return mul_size(sizeof(pgskEntry *),
+					mul_size(PGSK_NUM_PARTITIONS, pgsk_partition_max));
+}
+
+#if PG_VERSION_NUM >= 90600
+static int
+pgsk_parallel_num_slots(void)
+{
+	/*
+	 * The parallel slots are identified by the BackendId of the leader.
+	 * There's therefore one for all possible backends, plus autovacuum
+	 * launcher and workers, plus bg workers and an extra one since BackendId
+	 * numerotation starts at 1.  Starting with pg12, wal senders aren't part
+	 * of MaxConnections anymore, so they need to be accounted for.
+	 */
+#if PG_VERSION_NUM >= 150000
+	Assert (MaxBackends > 0);
+	return MaxBackends + 1;
+#else
+	return MaxConnections + autovacuum_max_workers + 1
+		+ max_worker_processes
+#if PG_VERSION_NUM >= 120000
+		+ max_wal_senders
+#endif		/* pg12+ */
+		+ 1;
+#endif		/* pg15- */
+}
+
+static Size
+pgsk_parallel_array_size(void)
+{
+	return mul_size(sizeof(pgskParallelSlot), pgsk_parallel_num_slots());
+}
+#endif
+
+
+/*
+ * support functions
+ */
+
+/*
+ * Store the counters of a planning or execution.  For an execution, the
+ * counters of its parallel workers, if any, are also given and added to the
+ * entry in the same update.
+ */
+static void
+pgsk_entry_store(pgsk_queryid queryId, pgskStoreKind kind,
+				 pgskCounters counters, const pgskCounters *workers,
+				 const pgskCounters *nested)
+{
+	pgskHashKey key;
+	pgskEntry  *entry;
+	pgskCounters all_counters[PGSK_NUMSETS];
+	uint32		hashcode;
+	int			part;
+
+	/* Safety check... */
+	if (!pgsk || !pgsk_hash[0])
+		return;
 
 	/* Set up key for hashtable search */
 	key.userid = GetUserId();
@@ -751,474 +3697,4462 @@ pgsk_entry_store(pgsk_queryid queryId, pgskStoreKind kind,
 	key.queryid = queryId;
 	key.top = (nesting_level == 0);
 
-	/* Lookup the hash table entry with shared lock. */
-	LWLockAcquire(pgsk->lock, LW_SHARED);
+	memset(all_counters, 0, sizeof(all_counters));
+	all_counters[kind] = counters;
+	if (workers)
+	{
+		Assert(kind == PGSK_EXEC);
+
+		/* The workers' calls aren't executions of the statement */
+		all_counters[PGSK_WORKERS] = *workers;
+		pgsk_counters_add(&all_counters[PGSK_EXEC], workers);
+		all_counters[PGSK_EXEC].calls = counters.calls;
+		all_counters[PGSK_EXEC].rusage_calls = counters.rusage_calls;
+	}
+	if (nested)
+	{
+		Assert(kind == PGSK_EXEC);
+		all_counters[PGSK_NESTED] = *nested;
+	}
+
+#if PG_VERSION_NUM >= 90600
+	if (pgsk_events && kind == PGSK_EXEC && queryId != PGSK_BENCH_QUERYID)
+		pgsk_event_add(&key, &all_counters[PGSK_EXEC]);
+#endif
+
+	/* Accumulate the counters locally if asked to */
+	if (pgsk_flush_interval > 0)
+	{
+		pgsk_local_store(&key, kind, all_counters);
+		return;
+	}
+
+	hashcode = pgsk_hash_fn(&key, sizeof(pgskHashKey));
+	part = PGSK_PARTITION(hashcode);
+
+	/* Lookup the hash table entry with shared lock. */
+	LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+	entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part], &key,
+													  hashcode, HASH_FIND,
+													  NULL);
+
+	/* Create new entry, if not present */
+	if (!entry)
+	{
+		/* Need exclusive lock to make a new hashtable entry - promote */
+		LWLockRelease(pgsk->locks[part]);
+		LWLockAcquire(pgsk->locks[part], LW_EXCLUSIVE);
+		pgsk_stat_add(PGSK_STAT_PROMOTIONS, 1);
+
+		/* OK to create a new hashtable entry */
+		entry = pgsk_entry_alloc(&key, hashcode);
+	}
+
+	/* The counters are lost if there's no memory left for the entry */
+	if (entry)
+	{
+		pgsk_entry_accum(entry, USAGE_INCREASE, all_counters);
+
+		if (pgsk_track_histograms && kind == PGSK_EXEC)
+			pgsk_entry_hist_observe(entry, &all_counters[PGSK_EXEC]);
+	}
+
+	LWLockRelease(pgsk->locks[part]);
+
+	pgsk_agg_accum(&key, all_counters);
+}
+
+/*
+ * Log the counters of an execution, including the ones of its parallel
+ * workers if any, if they cross one of the pg_stat_kcache.log_min_* thresholds.
+ * This is only a few comparisons unless something has to be logged.
+ */
+static void
+pgsk_log_check(pgsk_queryid queryId, const pgskCounters *counters,
+			   const pgskCounters *workers, const char *query_text)
+{
+	pgskCounters total;
+	StringInfoData buf;
+
+	/* Nothing to do with the default settings */
+	if (pgsk_log_min_cpu_time < 0
+#ifdef HAVE_GETRUSAGE
+		&& pgsk_log_min_reads < 0 && pgsk_log_min_majflts < 0
+#endif
+		)
+		return;
+
+	total = *counters;
+	if (workers)
+		pgsk_counters_add(&total, workers);
+
+	if (!((pgsk_log_min_cpu_time >= 0 &&
+		   (total.utime + total.stime) * 1000.0 >= pgsk_log_min_cpu_time)
+#ifdef HAVE_GETRUSAGE
+		  || (pgsk_log_min_reads >= 0 &&
+			  total.reads * (RUSAGE_BLOCK_SIZE / 1024.0) >= pgsk_log_min_reads)
+		  || (pgsk_log_min_majflts >= 0 &&
+			  total.majflts >= pgsk_log_min_majflts)
+#endif
+		  ))
+		return;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "user time: %.6f s, system time: %.6f s, "
+					 "elapsed time: %.6f s",
+					 total.utime, total.stime, total.elapsed);
+#ifdef HAVE_GETRUSAGE
+	appendStringInfo(&buf, ", minflts: " INT64_FORMAT
+					 ", majflts: " INT64_FORMAT
+					 ", nswaps: " INT64_FORMAT
+					 ", reads: " INT64_FORMAT " bytes"
+					 ", writes: " INT64_FORMAT " bytes"
+					 ", msgsnds: " INT64_FORMAT
+					 ", msgrcvs: " INT64_FORMAT
+					 ", nsignals: " INT64_FORMAT
+					 ", nvcsws: " INT64_FORMAT
+					 ", nivcsws: " INT64_FORMAT,
+					 total.minflts, total.majflts, total.nswaps,
+					 total.reads * RUSAGE_BLOCK_SIZE,
+					 total.writes * RUSAGE_BLOCK_SIZE,
+					 total.msgsnds, total.msgrcvs, total.nsignals,
+					 total.nvcsws, total.nivcsws);
+#endif
+#ifdef PGSK_HAVE_PROC_IO
+	if (pgsk_track_io)
+		appendStringInfo(&buf, ", rchar: " INT64_FORMAT
+						 ", wchar: " INT64_FORMAT
+						 ", syscr: " INT64_FORMAT
+						 ", syscw: " INT64_FORMAT
+						 ", read_bytes: " INT64_FORMAT
+						 ", write_bytes: " INT64_FORMAT
+						 ", cancelled_write_bytes: " INT64_FORMAT,
+						 total.rchar, total.wchar, total.syscr, total.syscw,
+						 total.read_bytes, total.write_bytes,
+						 total.cancelled_write_bytes);
+#endif
+#ifdef PGSK_HAVE_PERF_EVENT
+	if (pgsk_track_perf)
+		appendStringInfo(&buf, ", cycles: " INT64_FORMAT
+						 ", instructions: " INT64_FORMAT
+						 ", llc_misses: " INT64_FORMAT
+						 ", branch_misses: " INT64_FORMAT
+						 ", dtlb_misses: " INT64_FORMAT,
+						 total.cycles, total.instructions, total.llc_misses,
+						 total.branch_misses, total.dtlb_misses);
+#endif
+	if (pgsk_log_query_text && query_text)
+		appendStringInfo(&buf, "\nQuery Text: %s", query_text);
+
+	ereport(LOG,
+			(errmsg("pg_stat_kcache: execution of queryid " INT64_FORMAT
+					" at nesting level %d exceeded a threshold",
+					(int64) queryId, nesting_level),
+			 errdetail("%s", buf.data),
+			 errhidestmt(true)));
+
+	pfree(buf.data);
+}
+
+/*
+ * Forget the counters of the statements completed below the given nesting
+ * level, which can't be attributed to a statement starting at this level.
+ */
+static void
+pgsk_nested_reset(int level)
+{
+	int			l;
+
+	for (l = level + 1; l <= pgsk_nested_max; l++)
+		memset(&pgsk_nested_usage[l], 0, sizeof(pgskCounters));
+
+	pgsk_nested_max = Min(pgsk_nested_max, level);
+}
+
+/*
+ * Remember the counters of a statement completed at the given nesting level,
+ * so that they're attributed to the statement that called it.  Nested
+ * planning is also part of the caller's execution, but doesn't count as a
+ * nested call.  The counters must not include the parallel workers, which
+ * aren't part of the caller's resource usage.
+ */
+static void
+pgsk_nested_add(int level, pgskStoreKind kind, const pgskCounters *counters)
+{
+	pgskCounters *usage;
+	int64		calls;
+
+	if (level == 0)
+		return;
+
+	usage = &pgsk_nested_usage[level];
+	calls = usage->calls;
+	pgsk_counters_add(usage, counters);
+	if (kind != PGSK_EXEC)
+		usage->calls = calls;
+
+	pgsk_nested_max = Max(pgsk_nested_max, level);
+}
+
+/*
+ * Get the counters of the statements completed below the given nesting level
+ * since the statement at this level started, and reset them.  Those expanding
+ * other statements were already collected by them, so they're all called by
+ * the statement at this level, directly or not.  Returns false if there are
+ * none.
+ */
+static bool
+pgsk_nested_collect(int level, pgskCounters *nested)
+{
+	int			l;
+
+	if (pgsk_nested_max <= level)
+		return false;
+
+	memset(nested, 0, sizeof(pgskCounters));
+	for (l = level + 1; l <= pgsk_nested_max; l++)
+	{
+		pgsk_counters_add(nested, &pgsk_nested_usage[l]);
+		memset(&pgsk_nested_usage[l], 0, sizeof(pgskCounters));
+	}
+
+	pgsk_nested_max = level;
+
+	return true;
+}
+
+/*
+ * Add all the counters of src to dst, except the usage.
+ */
+static void
+pgsk_counters_add(volatile pgskCounters *dst, const pgskCounters *src)
+{
+	dst->calls += src->calls;
+	dst->utime += src->utime;
+	dst->stime += src->stime;
+#ifdef HAVE_GETRUSAGE
+	dst->minflts += src->minflts;
+	dst->majflts += src->majflts;
+	dst->nswaps += src->nswaps;
+	dst->reads += src->reads;
+	dst->writes += src->writes;
+	dst->msgsnds += src->msgsnds;
+	dst->msgrcvs += src->msgrcvs;
+	dst->nsignals += src->nsignals;
+	dst->nvcsws += src->nvcsws;
+	dst->nivcsws += src->nivcsws;
+#endif
+	dst->rchar += src->rchar;
+	dst->wchar += src->wchar;
+	dst->syscr += src->syscr;
+	dst->syscw += src->syscw;
+	dst->read_bytes += src->read_bytes;
+	dst->write_bytes += src->write_bytes;
+	dst->cancelled_write_bytes += src->cancelled_write_bytes;
+	dst->cycles += src->cycles;
+	dst->instructions += src->instructions;
+	dst->llc_misses += src->llc_misses;
+	dst->branch_misses += src->branch_misses;
+	dst->dtlb_misses += src->dtlb_misses;
+	dst->elapsed += src->elapsed;
+	dst->io_worker_reads += src->io_worker_reads;
+	dst->rusage_calls += src->rusage_calls;
+}
+
+/*
+ * Initialize the counters of a new entry.  Caller must make sure that no one
+ * else can access the entry.
+ */
+static void
+pgsk_entry_init(pgskEntry *entry)
+{
+#ifdef PGSK_USE_ATOMICS
+	int			kind;
+
+	pg_atomic_init_u64(&entry->usage, 0);
+	pg_atomic_init_u32(&entry->changes_started, 0);
+	pg_atomic_init_u32(&entry->changes_done, 0);
+
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskEntryCounters *c = pgsk_entry_counters(entry, kind);
+
+		if (c)
+			pgsk_shared_counters_zero(c, pgsk_entry_full, true);
+	}
+#else
+	memset((char *) entry + MAXALIGN(sizeof(pgskEntry)), 0,
+		   pgsk_entry_hist_offset - MAXALIGN(sizeof(pgskEntry)));
+	/* re-initialize the mutex each time ... we assume no one using it */
+	SpinLockInit(&entry->mutex);
+#endif
+
+	if (pgsk_track_histograms)
+	{
+		pgskHistogram *h = PGSK_ENTRY_HIST(entry);
+#ifdef PGSK_USE_ATOMICS
+		int			hkind,
+					bucket;
+
+		for (hkind = 0; hkind < PGSK_NUM_HISTS; hkind++)
+			for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+				pg_atomic_init_u64(&h->buckets[hkind][bucket], 0);
+#else
+		memset(h, 0, sizeof(pgskHistogram));
+#endif
+	}
+
+	/* set the appropriate initial usage count */
+	pgsk_entry_set_usage(entry, USAGE_INIT);
+
+	/* a new entry is a change, even if it doesn't have any counter yet */
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_init_u64(&entry->generation, pgsk_get_generation());
+	pg_atomic_init_u64(&entry->epoch, pgsk_get_epoch(NULL));
+#else
+	entry->generation = pgsk_get_generation();
+	entry->epoch = pgsk_get_epoch(NULL);
+#endif
+}
+
+/*
+ * Get the given counter set of an entry, or NULL if the layout doesn't store
+ * it.
+ */
+static pgskEntryCounters *
+pgsk_entry_counters(pgskEntry *entry, int kind)
+{
+	if (!pgsk_entry_has_plan)
+	{
+		if (kind == PGSK_PLAN)
+			return NULL;
+		kind--;
+	}
+
+	return (pgskEntryCounters *) ((char *) entry
+								  + MAXALIGN(sizeof(pgskEntry))
+								  + kind * pgsk_entry_counters_size);
+}
+
+#ifdef PGSK_USE_ATOMICS
+/*
+ * Atomically add a value to a shared counter, skipping the atomic operation
+ * for the many counters that are usually zero.
+ */
+#define PGSK_ATOMIC_ADD(counter, value) \
+	do { \
+		int64	_val = (value); \
+		if (_val != 0) \
+			pg_atomic_fetch_add_u64(&(counter), _val); \
+	} while (0)
+
+#define PGSK_TIME_TO_NS(t)	((int64) ((t) * PGSK_NS_PER_S))
+#define PGSK_NS_TO_TIME(ns)	((double) (int64) (ns) / PGSK_NS_PER_S)
+#endif
+
+#ifdef PGSK_USE_ATOMICS
+/*
+ * Set all the shared counters to zero.  Unless init is true, this can be done
+ * concurrently with updates.  The counters that Linux never maintains are only
+ * present if full is true, see pgsk_setlayout().
+ */
+static void
+pgsk_shared_counters_zero(pgskSharedCounters *c, bool full, bool init)
+{
+#define PGSK_ATOMIC_ZERO(counter) \
+	do { \
+		if (init) \
+			pg_atomic_init_u64(&c->counter, 0); \
+		else \
+			pg_atomic_write_u64(&c->counter, 0); \
+	} while (0)
+
+	PGSK_ATOMIC_ZERO(calls);
+	PGSK_ATOMIC_ZERO(utime);
+	PGSK_ATOMIC_ZERO(stime);
+#ifdef HAVE_GETRUSAGE
+	PGSK_ATOMIC_ZERO(minflts);
+	PGSK_ATOMIC_ZERO(majflts);
+	PGSK_ATOMIC_ZERO(reads);
+	PGSK_ATOMIC_ZERO(writes);
+	PGSK_ATOMIC_ZERO(nvcsws);
+	PGSK_ATOMIC_ZERO(nivcsws);
+#endif
+	PGSK_ATOMIC_ZERO(rchar);
+	PGSK_ATOMIC_ZERO(wchar);
+	PGSK_ATOMIC_ZERO(syscr);
+	PGSK_ATOMIC_ZERO(syscw);
+	PGSK_ATOMIC_ZERO(read_bytes);
+	PGSK_ATOMIC_ZERO(write_bytes);
+	PGSK_ATOMIC_ZERO(cancelled_write_bytes);
+	PGSK_ATOMIC_ZERO(cycles);
+	PGSK_ATOMIC_ZERO(instructions);
+	PGSK_ATOMIC_ZERO(llc_misses);
+	PGSK_ATOMIC_ZERO(branch_misses);
+	PGSK_ATOMIC_ZERO(dtlb_misses);
+	PGSK_ATOMIC_ZERO(elapsed);
+	PGSK_ATOMIC_ZERO(io_worker_reads);
+	PGSK_ATOMIC_ZERO(rusage_calls);
+#ifdef HAVE_GETRUSAGE
+	if (full)
+	{
+		PGSK_ATOMIC_ZERO(nswaps);
+		PGSK_ATOMIC_ZERO(msgsnds);
+		PGSK_ATOMIC_ZERO(msgrcvs);
+		PGSK_ATOMIC_ZERO(nsignals);
+	}
+#endif
+
+#undef PGSK_ATOMIC_ZERO
+}
+
+/*
+ * Atomically add the given counters, except the usage, to shared counters
+ */
+static void
+pgsk_shared_counters_add(pgskSharedCounters *c, bool full,
+						 const pgskCounters *src)
+{
+	PGSK_ATOMIC_ADD(c->calls, src->calls);
+	PGSK_ATOMIC_ADD(c->utime, PGSK_TIME_TO_NS(src->utime));
+	PGSK_ATOMIC_ADD(c->stime, PGSK_TIME_TO_NS(src->stime));
+#ifdef HAVE_GETRUSAGE
+	PGSK_ATOMIC_ADD(c->minflts, src->minflts);
+	PGSK_ATOMIC_ADD(c->majflts, src->majflts);
+	PGSK_ATOMIC_ADD(c->reads, src->reads);
+	PGSK_ATOMIC_ADD(c->writes, src->writes);
+	PGSK_ATOMIC_ADD(c->nvcsws, src->nvcsws);
+	PGSK_ATOMIC_ADD(c->nivcsws, src->nivcsws);
+#endif
+	PGSK_ATOMIC_ADD(c->rchar, src->rchar);
+	PGSK_ATOMIC_ADD(c->wchar, src->wchar);
+	PGSK_ATOMIC_ADD(c->syscr, src->syscr);
+	PGSK_ATOMIC_ADD(c->syscw, src->syscw);
+	PGSK_ATOMIC_ADD(c->read_bytes, src->read_bytes);
+	PGSK_ATOMIC_ADD(c->write_bytes, src->write_bytes);
+	PGSK_ATOMIC_ADD(c->cancelled_write_bytes, src->cancelled_write_bytes);
+	PGSK_ATOMIC_ADD(c->cycles, src->cycles);
+	PGSK_ATOMIC_ADD(c->instructions, src->instructions);
+	PGSK_ATOMIC_ADD(c->llc_misses, src->llc_misses);
+	PGSK_ATOMIC_ADD(c->branch_misses, src->branch_misses);
+	PGSK_ATOMIC_ADD(c->dtlb_misses, src->dtlb_misses);
+	PGSK_ATOMIC_ADD(c->elapsed, PGSK_TIME_TO_NS(src->elapsed));
+	PGSK_ATOMIC_ADD(c->io_worker_reads, src->io_worker_reads);
+	PGSK_ATOMIC_ADD(c->rusage_calls, src->rusage_calls);
+#ifdef HAVE_GETRUSAGE
+	if (full)
+	{
+		PGSK_ATOMIC_ADD(c->nswaps, src->nswaps);
+		PGSK_ATOMIC_ADD(c->msgsnds, src->msgsnds);
+		PGSK_ATOMIC_ADD(c->msgrcvs, src->msgrcvs);
+		PGSK_ATOMIC_ADD(c->nsignals, src->nsignals);
+	}
+#endif
+}
+
+/*
+ * Copy shared counters, except the usage.  Each counter is individually
+ * consistent, but they can be read in the middle of an update.  The counters
+ * not present if full is false are returned as 0.
+ */
+static void
+pgsk_shared_counters_read(pgskSharedCounters *c, bool full, pgskCounters *dst)
+{
+	dst->usage = 0;
+	dst->calls = (int64) pg_atomic_read_u64(&c->calls);
+	dst->utime = PGSK_NS_TO_TIME(pg_atomic_read_u64(&c->utime));
+	dst->stime = PGSK_NS_TO_TIME(pg_atomic_read_u64(&c->stime));
+#ifdef HAVE_GETRUSAGE
+	dst->minflts = (int64) pg_atomic_read_u64(&c->minflts);
+	dst->majflts = (int64) pg_atomic_read_u64(&c->majflts);
+	dst->reads = (int64) pg_atomic_read_u64(&c->reads);
+	dst->writes = (int64) pg_atomic_read_u64(&c->writes);
+	dst->nvcsws = (int64) pg_atomic_read_u64(&c->nvcsws);
+	dst->nivcsws = (int64) pg_atomic_read_u64(&c->nivcsws);
+#endif
+	dst->rchar = (int64) pg_atomic_read_u64(&c->rchar);
+	dst->wchar = (int64) pg_atomic_read_u64(&c->wchar);
+	dst->syscr = (int64) pg_atomic_read_u64(&c->syscr);
+	dst->syscw = (int64) pg_atomic_read_u64(&c->syscw);
+	dst->read_bytes = (int64) pg_atomic_read_u64(&c->read_bytes);
+	dst->write_bytes = (int64) pg_atomic_read_u64(&c->write_bytes);
+	dst->cancelled_write_bytes = (int64) pg_atomic_read_u64(&c->cancelled_write_bytes);
+	dst->cycles = (int64) pg_atomic_read_u64(&c->cycles);
+	dst->instructions = (int64) pg_atomic_read_u64(&c->instructions);
+	dst->llc_misses = (int64) pg_atomic_read_u64(&c->llc_misses);
+	dst->branch_misses = (int64) pg_atomic_read_u64(&c->branch_misses);
+	dst->dtlb_misses = (int64) pg_atomic_read_u64(&c->dtlb_misses);
+	dst->elapsed = PGSK_NS_TO_TIME(pg_atomic_read_u64(&c->elapsed));
+	dst->io_worker_reads = (int64) pg_atomic_read_u64(&c->io_worker_reads);
+	dst->rusage_calls = (int64) pg_atomic_read_u64(&c->rusage_calls);
+#ifdef HAVE_GETRUSAGE
+	if (full)
+	{
+		dst->nswaps = (int64) pg_atomic_read_u64(&c->nswaps);
+		dst->msgsnds = (int64) pg_atomic_read_u64(&c->msgsnds);
+		dst->msgrcvs = (int64) pg_atomic_read_u64(&c->msgrcvs);
+		dst->nsignals = (int64) pg_atomic_read_u64(&c->nsignals);
+	}
+	else
+	{
+		dst->nswaps = 0;
+		dst->msgsnds = 0;
+		dst->msgrcvs = 0;
+		dst->nsignals = 0;
+	}
+#endif
+}
+#endif
+
+/*
+ * Add the given usage and counters, one per kind, to a shared entry.
+ *
+ * Caller must hold at least a shared lock on the entry's partition.  With
+ * atomics support, concurrent writers never block each other or readers.
+ */
+static void
+pgsk_entry_accum(pgskEntry *entry, double usage,
+				 const pgskCounters counters[PGSK_NUMSETS])
+{
+#ifdef PGSK_USE_ATOMICS
+	int			kind;
+#endif
+
+	TimestampTz	since;
+	uint64		epoch = pgsk_get_epoch(&since);
+
+	/* Racy, but only ever set to true outside of the clock sweep */
+	if (!entry->referenced)
+		entry->referenced = true;
+
+#ifdef PGSK_USE_ATOMICS
+	for (;;)
+	{
+		pgsk_entry_check_epoch(entry, epoch, since);
+
+		/* This is a full memory barrier */
+		pg_atomic_fetch_add_u32(&entry->changes_started, 1);
+
+		/*
+		 * If a reset started concurrently, complete this change without doing
+		 * anything and wait for the reset to finish, see
+		 * pgsk_entry_check_epoch().
+		 */
+		if ((pg_atomic_read_u64(&entry->epoch) & PGSK_EPOCH_RESETTING) == 0)
+			break;
+
+		pg_atomic_fetch_add_u32(&entry->changes_done, 1);
+	}
+
+	if (usage != 0)
+	{
+		uint64		oldval = pg_atomic_read_u64(&entry->usage);
+
+		for (;;)
+		{
+			double		newusage;
+			uint64		newval;
+
+			memcpy(&newusage, &oldval, sizeof(double));
+			newusage += usage;
+			memcpy(&newval, &newusage, sizeof(double));
+
+			/* oldval is updated on failure */
+			if (pg_atomic_compare_exchange_u64(&entry->usage, &oldval, newval))
+				break;
+		}
+	}
+
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskEntryCounters *c = pgsk_entry_counters(entry, kind);
+
+		if (c)
+			pgsk_shared_counters_add(c, pgsk_entry_full, &counters[kind]);
+	}
+
+	/* Stamp the entry once updated, see pgsk_next_generation() */
+	pgsk_entry_stamp(entry);
+
+	/* This is a full memory barrier */
+	pg_atomic_fetch_add_u32(&entry->changes_done, 1);
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+	uint64		generation = pgsk_get_generation();
+	int			kind;
+
+	SpinLockAcquire(&e->mutex);
+	pgsk_entry_check_epoch(entry, epoch, since);
+	e->usage += usage;
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskCounters *c = pgsk_entry_counters(entry, kind);
+
+		if (c)
+			pgsk_counters_add(c, &counters[kind]);
+	}
+	if (e->generation < generation)
+		e->generation = generation;
+	SpinLockRelease(&e->mutex);
+#endif
+}
+
+/*
+ * Get the current global generation.
+ */
+static uint64
+pgsk_get_generation(void)
+{
+#ifdef PGSK_USE_ATOMICS
+	return pg_atomic_read_u64(&pgsk->generation);
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+	uint64		generation;
+
+	SpinLockAcquire(&s->mutex);
+	generation = s->generation;
+	SpinLockRelease(&s->mutex);
+
+	return generation;
+#endif
+}
+
+/*
+ * Get the current global epoch, see pgsk_entry_check_epoch(), and the time it
+ * was last advanced if since isn't NULL.
+ */
+static uint64
+pgsk_get_epoch(TimestampTz *since)
+{
+#ifdef PGSK_USE_ATOMICS
+	uint64		epoch = pg_atomic_read_u64(&pgsk->epoch);
+
+	/* Pairs with the write barrier in pgsk_entry_reset_lazy() */
+	pg_read_barrier();
+	if (since)
+		*since = pgsk->epoch_since;
+
+	return epoch;
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+	uint64		epoch;
+
+	SpinLockAcquire(&s->mutex);
+	epoch = s->epoch;
+	if (since)
+		*since = s->epoch_since;
+	SpinLockRelease(&s->mutex);
+
+	return epoch;
+#endif
+}
+
+/*
+ * Advance the global generation, and return its previous value.
+ *
+ * Writers stamp each entry with the current global generation after updating
+ * it.  A reader that advances the generation before scanning the entries
+ * therefore sees all the changes made to the entries stamped with a lower
+ * generation, and all the entries stamped with the returned generation or
+ * higher may have changed since.  Returning the previous value rather than the
+ * new one makes sure that an update stamped right when the generation is
+ * advanced isn't missed by the next scan, at the cost of possibly returning it
+ * twice.
+ */
+static uint64
+pgsk_next_generation(void)
+{
+#ifdef PGSK_USE_ATOMICS
+	return pg_atomic_fetch_add_u64(&pgsk->generation, 1);
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+	uint64		generation;
+
+	SpinLockAcquire(&s->mutex);
+	generation = s->generation++;
+	SpinLockRelease(&s->mutex);
+
+	return generation;
+#endif
+}
+
+/*
+ * Add the given value to one of the extension's own counters.
+ */
+static void
+pgsk_stat_add(pgskStatKind skind, uint64 value)
+{
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_fetch_add_u64(&pgsk->stats[skind], (int64) value);
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+
+	SpinLockAcquire(&s->mutex);
+	s->stats[skind] += value;
+	SpinLockRelease(&s->mutex);
+#endif
+}
+
+static void
+pgsk_stat_set(pgskStatKind skind, uint64 value)
+{
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_write_u64(&pgsk->stats[skind], value);
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+
+	SpinLockAcquire(&s->mutex);
+	s->stats[skind] = value;
+	SpinLockRelease(&s->mutex);
+#endif
+}
+
+static uint64
+pgsk_stat_read(pgskStatKind skind)
+{
+#ifdef PGSK_USE_ATOMICS
+	return pg_atomic_read_u64(&pgsk->stats[skind]);
+#else
+	volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+	uint64		value;
+
+	SpinLockAcquire(&s->mutex);
+	value = s->stats[skind];
+	SpinLockRelease(&s->mutex);
+
+	return value;
+#endif
+}
+
+/*
+ * Reset the extension's own counters, except the duration of the stats file
+ * load which only happens at startup.  If init is true, the counters are
+ * initialized instead.
+ */
+static void
+pgsk_stat_reset(bool init)
+{
+	int			skind;
+
+	for (skind = 0; skind < PGSK_NUM_STATS; skind++)
+	{
+		if (skind == PGSK_STAT_LOAD_TIME && !init)
+			continue;
+
+#ifdef PGSK_USE_ATOMICS
+		if (init)
+		{
+			pg_atomic_init_u64(&pgsk->stats[skind], 0);
+			continue;
+		}
+#else
+		if (init)
+		{
+			pgsk->stats[skind] = 0;
+			continue;
+		}
+#endif
+		pgsk_stat_set(skind, 0);
+	}
+
+	pgsk_stat_set(PGSK_STAT_RESET, (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Get the generation of the last update of an entry.
+ */
+static uint64
+pgsk_entry_get_generation(pgskEntry *entry)
+{
+#ifdef PGSK_USE_ATOMICS
+	return pg_atomic_read_u64(&entry->generation);
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+	uint64		generation;
+
+	SpinLockAcquire(&e->mutex);
+	generation = e->generation;
+	SpinLockRelease(&e->mutex);
+
+	return generation;
+#endif
+}
+
+/*
+ * Stamp an entry with the current global generation after updating it, see
+ * pgsk_next_generation().  The stamp only ever moves forward, so that a
+ * backend that read the global generation before a concurrent one can't hide
+ * the more recent update.  Without atomics support, caller must not hold the
+ * entry's mutex.
+ */
+static void
+pgsk_entry_stamp(pgskEntry *entry)
+{
+	uint64		generation = pgsk_get_generation();
+#ifdef PGSK_USE_ATOMICS
+	uint64		oldval = pg_atomic_read_u64(&entry->generation);
+
+	/* oldval is updated on failure */
+	while (oldval < generation &&
+		   !pg_atomic_compare_exchange_u64(&entry->generation, &oldval,
+										   generation))
+		;
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+
+	SpinLockAcquire(&e->mutex);
+	if (e->generation < generation)
+		e->generation = generation;
+	SpinLockRelease(&e->mutex);
+#endif
+}
+
+/*
+ * Copy the counters of a shared entry, one per kind.  The usage is returned
+ * in counters[0].usage, and the counter sets that the layout doesn't store
+ * are returned as zero.
+ *
+ * With atomics support, this never blocks writers.  Instead, the copy is
+ * retried until no update happened concurrently.  Since each counter is
+ * always individually correct, a copy only partially consistent is returned
+ * if the entry is updated so often that this doesn't happen after
+ * PGSK_SNAPSHOT_MAX_RETRIES attempts.
+ */
+static void
+pgsk_entry_snapshot(pgskEntry *entry, pgskCounters counters[PGSK_NUMSETS])
+{
+	TimestampTz	since;
+	uint64		epoch = pgsk_get_epoch(&since);
+#ifdef PGSK_USE_ATOMICS
+	int			retries;
+
+	pgsk_entry_check_epoch(entry, epoch, since);
+
+	for (retries = 0; retries < PGSK_SNAPSHOT_MAX_RETRIES; retries++)
+	{
+		uint32		done;
+		int			kind;
+
+		done = pg_atomic_read_u32(&entry->changes_done);
+		pg_read_barrier();
+
+		for (kind = 0; kind < PGSK_NUMSETS; kind++)
+		{
+			pgskEntryCounters *c = pgsk_entry_counters(entry, kind);
+
+			if (c)
+				pgsk_shared_counters_read(c, pgsk_entry_full, &counters[kind]);
+			else
+				memset(&counters[kind], 0, sizeof(pgskCounters));
+		}
+		counters[0].usage = pgsk_entry_get_usage(entry);
+
+		pg_read_barrier();
+		if (pg_atomic_read_u32(&entry->changes_started) == done)
+			break;
+
+		pg_spin_delay();
+	}
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+	bool		reset;
+	int			kind;
+
+	SpinLockAcquire(&e->mutex);
+	reset = pgsk_entry_check_epoch(entry, epoch, since);
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskCounters *c = pgsk_entry_counters(entry, kind);
+
+		if (c)
+			counters[kind] = *c;
+		else
+			memset(&counters[kind], 0, sizeof(pgskCounters));
+	}
+	counters[0].usage = e->usage;
+	SpinLockRelease(&e->mutex);
+
+	if (reset)
+		pgsk_entry_stamp(entry);
+#endif
+}
+
+/*
+ * Zero the counters and the histograms of a shared entry, keeping its usage,
+ * and record the given time as the start of its statistics.  With atomics
+ * support, caller must make sure that concurrent snapshots are retried, and
+ * must otherwise hold the entry's mutex.
+ */
+static void
+pgsk_entry_zero(pgskEntry *entry, TimestampTz since)
+{
+	int			kind;
+
+	for (kind = 0; kind < PGSK_NUMSETS; kind++)
+	{
+		pgskEntryCounters *c = pgsk_entry_counters(entry, kind);
+
+		if (!c)
+			continue;
+#ifdef PGSK_USE_ATOMICS
+		pgsk_shared_counters_zero(c, pgsk_entry_full, false);
+#else
+		memset(c, 0, sizeof(pgskCounters));
+#endif
+	}
+
+	if (pgsk_track_histograms)
+		pgsk_entry_hist_zero(entry);
+
+	entry->stats_since = since;
+}
+
+/*
+ * Lazily reset an entry if the global epoch was advanced since its last reset,
+ * see pgsk_entry_reset_lazy().  This is done by the first writer or reader
+ * seeing the entry after the epoch was advanced, so that no one has to
+ * visit all the entries.  The caller must hold at least a shared lock on the
+ * entry's partition, and without atomics support the entry's mutex.  Returns
+ * true if the entry was reset, in which case caller must stamp it with the
+ * current generation once the mutex is released if there's no atomics
+ * support.
+ *
+ * With atomics support, the backend that manages to advance the entry's epoch
+ * first flags it as being reset, so that the other writers and readers wait
+ * for the reset to finish, and waits for the updates already in progress to
+ * complete.  The entry is then zeroed and stamped as a single change, so that
+ * the counters are never seen partially reset.
+ */
+static bool
+pgsk_entry_check_epoch(pgskEntry *entry, uint64 epoch, TimestampTz since)
+{
+#ifdef PGSK_USE_ATOMICS
+	uint64		oldval = pg_atomic_read_u64(&entry->epoch);
+	uint32		done;
+
+	for (;;)
+	{
+		/* Another backend is resetting the entry, wait for it */
+		if (oldval & PGSK_EPOCH_RESETTING)
+		{
+			pg_spin_delay();
+			oldval = pg_atomic_read_u64(&entry->epoch);
+			continue;
+		}
+
+		/* Don't go backward if we read the global epoch before a reset */
+		if (oldval >= epoch)
+			return false;
+
+		/* oldval is updated on failure */
+		if (pg_atomic_compare_exchange_u64(&entry->epoch, &oldval,
+										   epoch | PGSK_EPOCH_RESETTING))
+			break;
+	}
+
+	/*
+	 * Wait for the updates started before the flag was set.  The ones started
+	 * later will see it and back off.  changes_done must be read first, so
+	 * that an update completed between the two reads can't hide one still in
+	 * progress.
+	 */
+	for (;;)
+	{
+		done = pg_atomic_read_u32(&entry->changes_done);
+		pg_read_barrier();
+		if (pg_atomic_read_u32(&entry->changes_started) == done)
+			break;
+		pg_spin_delay();
+	}
+
+	/* Make the concurrent snapshots retry, see pgsk_entry_snapshot() */
+	pg_atomic_fetch_add_u32(&entry->changes_started, 1);
+	pgsk_entry_zero(entry, since);
+	pgsk_entry_stamp(entry);
+	pg_atomic_fetch_add_u32(&entry->changes_done, 1);
+
+	/* The previous atomic operation is a full memory barrier */
+	pg_atomic_write_u64(&entry->epoch, epoch);
+
+	return true;
+#else
+	if (entry->epoch >= epoch)
+		return false;
+
+	entry->epoch = epoch;
+	pgsk_entry_zero(entry, since);
+
+	return true;
+#endif
+}
+
+/*
+ * Get the histogram bucket of a value, expressed in the histogram unit.
+ */
+static int
+pgsk_hist_bucket(double value)
+{
+	uint64		v;
+	int			bucket = 0;
+
+	if (value < 1.0)
+		return 0;
+
+	v = (uint64) value;
+	while (v != 0 && bucket < PGSK_HIST_BUCKETS - 1)
+	{
+		bucket++;
+		v >>= 1;
+	}
+
+	return bucket;
+}
+
+/*
+ * Account an execution in local histograms.
+ */
+static void
+pgsk_hist_observe(pgskHistCounts *hist, const pgskCounters *counters)
+{
+	hist->buckets[PGSK_HIST_TIME][pgsk_hist_bucket((counters->utime + counters->stime) * 1000000.0)]++;
+#ifdef HAVE_GETRUSAGE
+	/* The reads aren't measured with pg_stat_kcache.timing = clock */
+	if (counters->rusage_calls > 0)
+		hist->buckets[PGSK_HIST_READS][pgsk_hist_bucket((double) counters->reads)]++;
+#endif
+}
+
+/*
+ * Account an execution in the histograms of a shared entry.  Caller must
+ * hold at least a shared lock on the entry's partition.
+ */
+static void
+pgsk_entry_hist_observe(pgskEntry *entry, const pgskCounters *counters)
+{
+	pgskHistogram *h = PGSK_ENTRY_HIST(entry);
+	int			time_bucket;
+#ifdef HAVE_GETRUSAGE
+	int			reads_bucket = pgsk_hist_bucket((double) counters->reads);
+
+	/* The reads aren't measured with pg_stat_kcache.timing = clock */
+	bool		has_reads = (counters->rusage_calls > 0);
+#endif
+
+	time_bucket = pgsk_hist_bucket((counters->utime + counters->stime) * 1000000.0);
+
+#ifdef PGSK_USE_ATOMICS
+	pg_atomic_fetch_add_u64(&h->buckets[PGSK_HIST_TIME][time_bucket], 1);
+#ifdef HAVE_GETRUSAGE
+	if (has_reads)
+		pg_atomic_fetch_add_u64(&h->buckets[PGSK_HIST_READS][reads_bucket], 1);
+#endif
+#else
+	{
+		volatile pgskEntry *e = (volatile pgskEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		h->buckets[PGSK_HIST_TIME][time_bucket]++;
+#ifdef HAVE_GETRUSAGE
+		if (has_reads)
+			h->buckets[PGSK_HIST_READS][reads_bucket]++;
+#endif
+		SpinLockRelease(&e->mutex);
+	}
+#endif
+}
+
+/*
+ * Add locally accumulated histograms to a shared entry.  Caller must hold at
+ * least a shared lock on the entry's partition.
+ */
+static void
+pgsk_entry_hist_accum(pgskEntry *entry, const pgskHistCounts *hist)
+{
+	pgskHistogram *h = PGSK_ENTRY_HIST(entry);
+	int			hkind,
+				bucket;
+#ifndef PGSK_USE_ATOMICS
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+
+	SpinLockAcquire(&e->mutex);
+#endif
+	for (hkind = 0; hkind < PGSK_NUM_HISTS; hkind++)
+	{
+		for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+		{
+			uint64		val = hist->buckets[hkind][bucket];
+
+			if (val == 0)
+				continue;
+#ifdef PGSK_USE_ATOMICS
+			pg_atomic_fetch_add_u64(&h->buckets[hkind][bucket], val);
+#else
+			h->buckets[hkind][bucket] += val;
+#endif
+		}
+	}
+#ifndef PGSK_USE_ATOMICS
+	SpinLockRelease(&e->mutex);
+#endif
+}
+
+/*
+ * Copy the histograms of a shared entry.  Each bucket is individually
+ * correct, but the copy isn't guaranteed to be consistent with a concurrent
+ * update.
+ */
+static void
+pgsk_entry_hist_snapshot(pgskEntry *entry, pgskHistCounts *hist)
+{
+	pgskHistogram *h = PGSK_ENTRY_HIST(entry);
+	TimestampTz	since;
+	uint64		epoch = pgsk_get_epoch(&since);
+#ifdef PGSK_USE_ATOMICS
+	int			hkind,
+				bucket;
+
+	pgsk_entry_check_epoch(entry, epoch, since);
+
+	for (hkind = 0; hkind < PGSK_NUM_HISTS; hkind++)
+		for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+			hist->buckets[hkind][bucket] =
+				pg_atomic_read_u64(&h->buckets[hkind][bucket]);
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+	bool		reset;
+
+	SpinLockAcquire(&e->mutex);
+	reset = pgsk_entry_check_epoch(entry, epoch, since);
+	memcpy(hist, h, sizeof(pgskHistCounts));
+	SpinLockRelease(&e->mutex);
+
+	if (reset)
+		pgsk_entry_stamp(entry);
+#endif
+}
+
+/*
+ * Zero the histograms of a shared entry, without blocking writers with
+ * atomics support.  Caller must hold at least a shared lock on the entry's
+ * partition.
+ */
+static void
+pgsk_entry_hist_reset(pgskEntry *entry)
+{
+#ifdef PGSK_USE_ATOMICS
+	pgsk_entry_hist_zero(entry);
+#else
+	volatile pgskEntry *e = (volatile pgskEntry *) entry;
+
+	SpinLockAcquire(&e->mutex);
+	pgsk_entry_hist_zero(entry);
+	SpinLockRelease(&e->mutex);
+#endif
+
+	pgsk_entry_stamp(entry);
+}
+
+/*
+ * Zero the histograms of a shared entry.  With atomics support, this can be
+ * done concurrently with updates, and caller must otherwise hold the entry's
+ * mutex.
+ */
+static void
+pgsk_entry_hist_zero(pgskEntry *entry)
+{
+	pgskHistogram *h = PGSK_ENTRY_HIST(entry);
+#ifdef PGSK_USE_ATOMICS
+	int			hkind,
+				bucket;
+
+	for (hkind = 0; hkind < PGSK_NUM_HISTS; hkind++)
+		for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+			pg_atomic_write_u64(&h->buckets[hkind][bucket], 0);
+#else
+	memset(h, 0, sizeof(pgskHistogram));
+#endif
+}
+
+/*
+ * Lower bound of a histogram bucket, in seconds or bytes.  This is also the
+ * upper bound of the previous bucket.
+ */
+static double
+pgsk_hist_bound(pgskHistKind hkind, int bucket)
+{
+	double		unit = (hkind == PGSK_HIST_TIME ? 0.000001 : RUSAGE_BLOCK_SIZE);
+
+	if (bucket == 0)
+		return 0;
+
+	return unit * (double) (UINT64CONST(1) << (bucket - 1));
+}
+
+/*
+ * Estimate a percentile of a histogram, assuming that the values are evenly
+ * distributed within a bucket.  The lower bound of the last bucket is
+ * returned if the percentile falls in it.
+ */
+static double
+pgsk_hist_percentile(const uint64 *buckets, uint64 total,
+					 pgskHistKind hkind, double fraction)
+{
+	double		target = fraction * total;
+	uint64		cumul = 0;
+	int			bucket;
+
+	for (bucket = 0; bucket < PGSK_HIST_BUCKETS - 1; bucket++)
+	{
+		if (buckets[bucket] > 0 && cumul + buckets[bucket] >= target)
+		{
+			double		lower = pgsk_hist_bound(hkind, bucket);
+			double		upper = pgsk_hist_bound(hkind, bucket + 1);
+
+			return lower + (upper - lower) * (target - cumul) / buckets[bucket];
+		}
+		cumul += buckets[bucket];
+	}
+
+	return pgsk_hist_bound(hkind, PGSK_HIST_BUCKETS - 1);
+}
+
+/*
+ * Get the usage factor of an entry.
+ */
+static double
+pgsk_entry_get_usage(pgskEntry *entry)
+{
+#ifdef PGSK_USE_ATOMICS
+	uint64		val = pg_atomic_read_u64(&entry->usage);
+	double		usage;
+
+	memcpy(&usage, &val, sizeof(double));
+
+	return usage;
+#else
+	return entry->usage;
+#endif
+}
+
+/*
+ * Set the usage factor of an entry.  Caller must hold an exclusive lock on
+ * the entry's partition, or otherwise make sure that no one else can access
+ * the entry.
+ */
+static void
+pgsk_entry_set_usage(pgskEntry *entry, double usage)
+{
+#ifdef PGSK_USE_ATOMICS
+	uint64		val;
+
+	memcpy(&val, &usage, sizeof(double));
+	pg_atomic_write_u64(&entry->usage, val);
+#else
+	entry->usage = usage;
+#endif
+}
+
+/*
+ * Accumulate the counters in a backend-local hashtable, and merge them into
+ * the shared hashtable if the oldest pending counters are older than
+ * pg_stat_kcache.flush_interval or if the local hashtable is full.
+ */
+static void
+pgsk_local_store(pgskHashKey *key, pgskStoreKind kind,
+				 const pgskCounters counters[PGSK_NUMSETS])
+{
+	pgskLocalEntry *entry;
+	TimestampTz		now;
+	uint32			hashcode;
+	bool			found;
+	int				i;
+
+	if (!pgsk_local_hash)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgskHashKey);
+		info.entrysize = sizeof(pgskLocalEntry);
+		info.hash = pgsk_hash_fn;
+		info.match = pgsk_match_fn;
+
+		pgsk_local_hash = hash_create("pg_stat_kcache local hash",
+									  PGSK_LOCAL_MAX_ENTRIES,
+									  &info,
+									  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+
+		/* Don't lose the pending counters when the backend exits */
+		before_shmem_exit(pgsk_local_shutdown, (Datum) 0);
+	}
+
+	/* The pending counters were accumulated before a reset, forget them */
+	if (hash_get_num_entries(pgsk_local_hash) > 0 &&
+		pgsk_get_epoch(NULL) != pgsk_local_epoch)
+		pgsk_local_discard();
+
+	if (hash_get_num_entries(pgsk_local_hash) >= PGSK_LOCAL_MAX_ENTRIES)
+		pgsk_local_flush();
+
+	now = GetCurrentTimestamp();
+	hashcode = pgsk_hash_fn(key, sizeof(pgskHashKey));
+
+	entry = (pgskLocalEntry *) hash_search_with_hash_value(pgsk_local_hash,
+														   key, hashcode,
+														   HASH_ENTER,
+														   &found);
+	if (!found)
+	{
+		entry->hashcode = hashcode;
+		memset(&entry->counters, 0, sizeof(pgskCounters) * PGSK_NUMSETS);
+		memset(&entry->hist, 0, sizeof(pgskHistCounts));
+		if (hash_get_num_entries(pgsk_local_hash) == 1)
+		{
+			pgsk_local_pending_since = now;
+			pgsk_local_epoch = pgsk_get_epoch(NULL);
+		}
+	}
+
+	entry->counters[0].usage += USAGE_INCREASE;
+	for (i = 0; i < PGSK_NUMSETS; i++)
+		pgsk_counters_add(&entry->counters[i], &counters[i]);
+	if (pgsk_track_histograms && kind == PGSK_EXEC)
+		pgsk_hist_observe(&entry->hist, &counters[PGSK_EXEC]);
+
+	if (TimestampDifferenceExceeds(pgsk_local_pending_since, now,
+								   pgsk_flush_interval))
+		pgsk_local_flush();
+}
+
+/*
+ * qsort comparator for sorting local entries by partition
+ */
+static int
+local_entry_cmp(const void *lhs, const void *rhs)
+{
+	int		l_part = PGSK_PARTITION((*(pgskLocalEntry *const *) lhs)->hashcode);
+	int		r_part = PGSK_PARTITION((*(pgskLocalEntry *const *) rhs)->hashcode);
+
+	if (l_part < r_part)
+		return -1;
+	else if (l_part > r_part)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Merge all the locally accumulated counters into the shared hashtable.
+ *
+ * The entries are processed one partition at a time.  For each partition,
+ * existing entries are all updated under a single shared lock acquisition,
+ * and the missing ones are then all created under a single exclusive lock
+ * acquisition.
+ *
+ * The counters are discarded instead if the statistics were reset since they
+ * started to be accumulated, see pgsk_advance_epoch().  This is checked again
+ * with each partition's lock held, as a full reset advances the epoch before
+ * removing the entries, so that the counters of a partition are either merged
+ * before its entries are removed or discarded.  The per-database and per-role
+ * aggregates are only updated along with the entries, so that they're either
+ * merged or discarded the same way.
+ */
+static void
+pgsk_local_flush(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgskLocalEntry **locals;
+	pgskLocalEntry *local;
+	int				nlocals;
+	int				start,
+					end;
+
+	if (!pgsk_local_hash || hash_get_num_entries(pgsk_local_hash) == 0)
+		return;
+
+	/* Safety check... */
+	if (!pgsk || !pgsk_hash[0])
+		return;
+
+	if (pgsk_get_epoch(NULL) != pgsk_local_epoch)
+	{
+		pgsk_local_discard();
+		return;
+	}
+
+	locals = palloc(hash_get_num_entries(pgsk_local_hash) *
+					sizeof(pgskLocalEntry *));
+
+	nlocals = 0;
+	hash_seq_init(&hash_seq, pgsk_local_hash);
+	while ((local = hash_seq_search(&hash_seq)) != NULL)
+		locals[nlocals++] = local;
+
+	qsort(locals, nlocals, sizeof(pgskLocalEntry *), local_entry_cmp);
+
+	for (start = 0; start < nlocals; start = end)
+	{
+		int			part = PGSK_PARTITION(locals[start]->hashcode);
+		int			nmissing = 0;
+		int			i;
+
+		for (end = start; end < nlocals; end++)
+		{
+			if (PGSK_PARTITION(locals[end]->hashcode) != part)
+				break;
+		}
+
+		LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+		if (pgsk_get_epoch(NULL) != pgsk_local_epoch)
+		{
+			LWLockRelease(pgsk->locks[part]);
+			break;
+		}
+
+		for (i = start; i < end; i++)
+		{
+			pgskEntry  *entry;
+
+			local = locals[i];
+			entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part],
+															  &local->key,
+															  local->hashcode,
+															  HASH_FIND, NULL);
+
+			if (!entry)
+			{
+				nmissing++;
+				continue;
+			}
+
+			pgsk_entry_accum(entry, local->counters[0].usage, local->counters);
+			if (pgsk_track_histograms)
+				pgsk_entry_hist_accum(entry, &local->hist);
+			pgsk_agg_accum(&local->key, local->counters);
+
+			/* Mark it as done */
+			locals[i] = NULL;
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+
+		if (nmissing == 0)
+			continue;
+
+		LWLockAcquire(pgsk->locks[part], LW_EXCLUSIVE);
+
+		/* The statistics could have been reset while the lock was released */
+		if (pgsk_get_epoch(NULL) != pgsk_local_epoch)
+		{
+			LWLockRelease(pgsk->locks[part]);
+			break;
+		}
+
+		for (i = start; i < end; i++)
+		{
+			pgskEntry  *entry;
+
+			local = locals[i];
+			if (local == NULL)
+				continue;
+
+			/* The counters are lost if there's no memory left for the entry */
+			entry = pgsk_entry_alloc(&local->key, local->hashcode);
+			if (entry)
+			{
+				pgsk_entry_accum(entry, local->counters[0].usage,
+								 local->counters);
+				if (pgsk_track_histograms)
+					pgsk_entry_hist_accum(entry, &local->hist);
+			}
+			pgsk_agg_accum(&local->key, local->counters);
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+
+	pfree(locals);
+
+	pgsk_local_discard();
+}
+
+/*
+ * Discard all the locally accumulated counters.
+ */
+static void
+pgsk_local_discard(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgskLocalEntry *local;
+
+	if (!pgsk_local_hash)
+		return;
+
+	hash_seq_init(&hash_seq, pgsk_local_hash);
+	while ((local = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pgsk_local_hash, &local->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * before_shmem_exit hook: flush the locally accumulated counters.
+ */
+static void
+pgsk_local_shutdown(int code, Datum arg)
+{
+	int			part;
+
+	if (!pgsk)
+		return;
+
+	/*
+	 * We could be exiting because of an error raised while holding a lock,
+	 * in which case the pending counters are lost.
+	 */
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		if (LWLockHeldByMe(pgsk->locks[part]))
+			return;
+	}
+
+	pgsk_local_flush();
+}
+
+/*
+ * Transaction callback: flush the locally accumulated counters at the end of
+ * each top-level transaction, so that the counters of an idle backend are
+ * never kept pending.
+ */
+static void
+pgsk_xact_callback(XactEvent event, void *arg)
+{
+#if PG_VERSION_NUM >= 140000
+	if (event == XACT_EVENT_PARALLEL_COMMIT)
+	{
+		pgsk_worker_store();
+		return;
+	}
+#endif
+
+	/* The statement that failed won't execute what it planned */
+	if (event == XACT_EVENT_ABORT)
+		pgsk_sample_planned = false;
+
+#if PG_VERSION_NUM >= 90600
+	/* The statement that failed is not running anymore */
+	if (event == XACT_EVENT_ABORT)
+		pgsk_activity_end();
+#endif
+
+	/* The lists are allocated in the transaction's memory */
+	if ((pgsk_dropped_dbs != NIL || pgsk_dropped_roles != NIL) &&
+		(event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+		 event == XACT_EVENT_PREPARE))
+	{
+		if (event == XACT_EVENT_COMMIT)
+		{
+			ListCell   *lc;
+
+			foreach(lc, pgsk_dropped_dbs)
+				pgsk_agg_release(PGSK_AGG_DATABASE, lfirst_oid(lc));
+			foreach(lc, pgsk_dropped_roles)
+				pgsk_agg_release(PGSK_AGG_USER, lfirst_oid(lc));
+		}
+
+		pgsk_dropped_dbs = NIL;
+		pgsk_dropped_roles = NIL;
+	}
+
+	if (!pgsk_local_hash || hash_get_num_entries(pgsk_local_hash) == 0)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+		case XACT_EVENT_ABORT:
+			/* All the LWLocks are already released at abort time */
+			pgsk_local_flush();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Allocate a new hashtable entry in the partition the given hash code
+ * belongs to.  If the shared memory is exhausted, the partition evicts entries
+ * to make room, and NULL is only returned if it has none to evict.
+ * caller must hold an exclusive lock on this partition's lock
+ */
+static pgskEntry *pgsk_entry_alloc(pgskHashKey *key, uint32 hashcode)
+{
+	pgskEntry  *entry;
+	int			part = PGSK_PARTITION(hashcode);
+	int			limit;
+	bool		found;
+
+	/*
+	 * Make space if needed.  If pg_stat_kcache.eviction_threshold was lowered,
+	 * the partition can be way above the limit, but only do a single eviction
+	 * pass so that no insert holds the exclusive lock for too long.  Each pass
+	 * evicts at least one entry, so the partition never grows, and eventually
+	 * shrinks to the limit.
+	 */
+	limit = pgsk_partition_limit();
+	if (hash_get_num_entries(pgsk_hash[part]) >= limit)
+		pgsk_entry_dealloc(part);
+
+	/* Find or create an entry with desired hash code */
+	entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part], key,
+													  hashcode, HASH_ENTER_NULL,
+													  &found);
+
+	/* Out of shared memory, reuse the memory of evicted entries */
+	if (!entry && hash_get_num_entries(pgsk_hash[part]) > 0)
+	{
+		pgsk_entry_dealloc(part);
+		entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part],
+														  key, hashcode,
+														  HASH_ENTER_NULL,
+														  &found);
+	}
+
+	if (!entry)
+		return NULL;
+
+	if (!found)
+	{
+		/* New entry, initialize it */
+		pgsk_entry_init(entry);
+		entry->stats_since = GetCurrentTimestamp();
+
+		/*
+		 * Like pg_stat_statements, start from the median usage of the
+		 * partition at the last eviction, and with a second chance from the
+		 * clock, so that a new entry isn't evicted before it gets a chance to
+		 * build up its own usage.
+		 */
+		pgsk_entry_set_usage(entry, Max(USAGE_INIT, pgsk->median_usage[part]));
+
+		/* and add it to the partition slots */
+		entry->slot = hash_get_num_entries(pgsk_hash[part]) - 1;
+		entry->referenced = true;
+		pgsk_slots[part][entry->slot] = entry;
+
+		pgsk_stat_add(PGSK_STAT_INSERTS, 1);
+	}
+
+	return entry;
+}
+
+/*
+ * qsort comparator for sorting into increasing usage order
+ */
+static int
+entry_cmp(const void *lhs, const void *rhs)
+{
+	double		l_usage = pgsk_entry_get_usage(*(pgskEntry *const *) lhs);
+	double		r_usage = pgsk_entry_get_usage(*(pgskEntry *const *) rhs);
+
+	if (l_usage < r_usage)
+		return -1;
+	else if (l_usage > r_usage)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Remove an entry from the given partition, keeping the partition's slots
+ * array dense by moving its last entry into the freed slot.
+ * Caller must hold an exclusive lock on this partition's lock.
+ */
+static void
+pgsk_entry_remove(int partition, pgskEntry *entry)
+{
+	pgskEntry **slots = pgsk_slots[partition];
+	int			slot = entry->slot;
+	int			last = hash_get_num_entries(pgsk_hash[partition]) - 1;
+
+	Assert(slots[slot] == entry);
+
+	if (slot != last)
+	{
+		slots[slot] = slots[last];
+		slots[slot]->slot = slot;
+	}
+	slots[last] = NULL;
+
+	hash_search(pgsk_hash[partition], &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Make room in the given partition, using the configured eviction strategy.
+ * Caller must hold an exclusive lock on this partition's lock.
+ */
+static void
+pgsk_entry_dealloc(int partition)
+{
+	long		nentries = hash_get_num_entries(pgsk_hash[partition]);
+	instr_time	start;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	switch (pgsk_eviction)
+	{
+		case PGSK_EVICTION_CLOCK:
+			pgsk_entry_evict_clock(partition);
+			break;
+		case PGSK_EVICTION_SAMPLE:
+			pgsk_entry_evict_sample(partition);
+			break;
+		default:
+			pgsk_entry_evict_sort(partition);
+			break;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	pgsk_stat_add(PGSK_STAT_DEALLOCS, 1);
+	pgsk_stat_add(PGSK_STAT_EVICTED,
+				  nentries - hash_get_num_entries(pgsk_hash[partition]));
+	pgsk_stat_add(PGSK_STAT_DEALLOC_TIME, INSTR_TIME_GET_MICROSEC(duration));
+}
+
+/*
+ * Deallocate least used entries of the given partition.
+ * Caller must hold an exclusive lock on this partition's lock.
+ */
+static void
+pgsk_entry_evict_sort(int partition)
+{
+	HTAB	   *hash = pgsk_hash[partition];
+	HASH_SEQ_STATUS hash_seq;
+	pgskEntry **entries;
+	pgskEntry  *entry;
+	int			nvictims;
+	int			i;
+
+	/*
+	 * Sort entries by usage and deallocate USAGE_DEALLOC_PERCENT of them.
+	 * While we're scanning the table, apply the decay factor to the usage
+	 * values.
+	 */
+	entries = palloc(hash_get_num_entries(hash) * sizeof(pgskEntry *));
+
+	i = 0;
+	hash_seq_init(&hash_seq, hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[i++] = entry;
+		pgsk_entry_set_usage(entry,
+							 pgsk_entry_get_usage(entry) * USAGE_DECREASE_FACTOR);
+	}
+
+	qsort(entries, i, sizeof(pgskEntry *), entry_cmp);
+
+	/* Record the median usage, given to the new entries */
+	if (i > 0)
+		pgsk->median_usage[partition] = pgsk_entry_get_usage(entries[i / 2]);
+
+	/*
+	 * A partition only holds a fraction of the entries, so make sure we don't
+	 * evict it entirely when it's small.
+	 */
+	nvictims = Max(10 / PGSK_NUM_PARTITIONS + 1,
+				   i * USAGE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		pgsk_entry_remove(partition, entries[i]);
+	}
+
+	pfree(entries);
+}
+
+/*
+ * Deallocate the first entry of the given partition that hasn't been used
+ * since the clock hand last passed it, giving a second chance to the others.
+ * This costs O(1) amortized per call, as each sweep clears the referenced
+ * flags.
+ * Caller must hold an exclusive lock on this partition's lock.
+ */
+static void
+pgsk_entry_evict_clock(int partition)
+{
+	pgskEntry **slots = pgsk_slots[partition];
+	int			nentries = hash_get_num_entries(pgsk_hash[partition]);
+	int			hand = pgsk->clock_hands[partition];
+	int			i;
+
+	if (nentries == 0)
+		return;
+
+	/* At worst, all entries are cleared during the first sweep */
+	for (i = 0; i <= nentries; i++)
+	{
+		pgskEntry  *entry;
+
+		if (hand >= nentries)
+			hand = 0;
+
+		entry = slots[hand];
+		if (!entry->referenced)
+			break;
+
+		entry->referenced = false;
+		hand++;
+	}
+
+	/*
+	 * The last entry is moved into the freed slot, so the hand stays in place
+	 * to consider it next time.
+	 */
+	pgsk_entry_remove(partition, slots[hand]);
+	pgsk->clock_hands[partition] = hand;
+}
+
+/*
+ * Deallocate the least used of EVICTION_SAMPLES randomly chosen entries of
+ * the given partition.  The decay factor is applied once to the usage of each
+ * of the other ones, even if it was sampled several times, so that entries
+ * that were only used a long time ago eventually get evicted.  The median
+ * usage of the samples estimates the one of the partition, given to new
+ * entries.
+ * Caller must hold an exclusive lock on this partition's lock.
+ */
+static void
+pgsk_entry_evict_sample(int partition)
+{
+	pgskEntry **slots = pgsk_slots[partition];
+	int			nentries = hash_get_num_entries(pgsk_hash[partition]);
+	pgskEntry  *samples[EVICTION_SAMPLES];
+	double		usages[EVICTION_SAMPLES];
+	pgskEntry  *victim = NULL;
+	double		victim_usage = 0;
+	int			i,
+				j;
+
+	if (nentries == 0)
+		return;
+
+	for (i = 0; i < EVICTION_SAMPLES; i++)
+	{
+#if PG_VERSION_NUM >= 150000
+		samples[i] = slots[pg_prng_uint32(&pg_global_prng_state) % nentries];
+#else
+		samples[i] = slots[random() % nentries];
+#endif
+		usages[i] = pgsk_entry_get_usage(samples[i]);
+
+		if (victim == NULL || usages[i] < victim_usage)
+		{
+			victim = samples[i];
+			victim_usage = usages[i];
+		}
+	}
+
+	/* the only place where the usage of the sampled entries decays */
+	for (i = 0; i < EVICTION_SAMPLES; i++)
+	{
+		if (samples[i] == victim)
+			continue;
+
+		for (j = 0; j < i; j++)
+		{
+			if (samples[j] == samples[i])
+				break;
+		}
+
+		if (j == i)
+			pgsk_entry_set_usage(samples[i], usages[i] * USAGE_DECREASE_FACTOR);
+	}
+
+	/* insertion sort of the sampled usages to find their median */
+	for (i = 1; i < EVICTION_SAMPLES; i++)
+	{
+		double		usage = usages[i];
+
+		for (j = i; j > 0 && usages[j - 1] > usage; j--)
+			usages[j] = usages[j - 1];
+		usages[j] = usage;
+	}
+	pgsk->median_usage[partition] = usages[EVICTION_SAMPLES / 2];
+
+	pgsk_entry_remove(partition, victim);
+}
+
+/*
+ * Remove all entries, one partition at a time.
+ */
+static void pgsk_entry_reset(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgskEntry  *entry;
+	int			part;
+
+	/* Also discard our own pending counters, and those of the others */
+	pgsk_local_discard();
+	pgsk_advance_epoch();
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		LWLockAcquire(pgsk->locks[part], LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			pgsk_entry_remove(part, entry);
+		}
+		pgsk->clock_hands[part] = 0;
+		pgsk->median_usage[part] = 0;
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+
+	pgsk_agg_reset(false);
+	pgsk_stat_reset(false);
+}
+
+/*
+ * Reset the entries matching the given filter, only locking the partitions
+ * that can contain them.  If histograms_only is true, only the histograms of
+ * the entries are zeroed, which doesn't need an exclusive lock.  Otherwise the
+ * entries are removed.  The aggregates and the extension's own counters are
+ * kept.
+ */
+static void
+pgsk_entry_reset_filtered(const pgskFilter *filter, bool histograms_only)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgskEntry  *entry;
+	LWLockMode	mode = histograms_only ? LW_SHARED : LW_EXCLUSIVE;
+	int			part;
+
+	if (histograms_only && !pgsk_track_histograms)
+		return;
+
+	/*
+	 * If the full identity of the statement is known, only the top-level and
+	 * nested entries can match, so look them up directly rather than scanning
+	 * all the partitions.
+	 */
+	if (filter->has_userid && filter->has_dbid && filter->has_queryid)
+	{
+		int			top;
+
+		for (top = 1; top >= 0; top--)
+		{
+			pgskHashKey key;
+			uint32		hashcode;
+
+			key.userid = filter->userid;
+			key.dbid = filter->dbid;
+			key.queryid = filter->queryid;
+			key.top = (bool) top;
+
+			hashcode = pgsk_hash_fn(&key, sizeof(pgskHashKey));
+			part = PGSK_PARTITION(hashcode);
+
+			LWLockAcquire(pgsk->locks[part], mode);
+
+			entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part],
+															  &key, hashcode,
+															  HASH_FIND, NULL);
+			if (entry && histograms_only)
+				pgsk_entry_hist_reset(entry);
+			else if (entry)
+				pgsk_entry_remove(part, entry);
+
+			LWLockRelease(pgsk->locks[part]);
+		}
+
+		return;
+	}
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		LWLockAcquire(pgsk->locks[part], mode);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (!pgsk_filter_match(filter, entry))
+				continue;
+
+			if (histograms_only)
+				pgsk_entry_hist_reset(entry);
+			else
+				pgsk_entry_remove(part, entry);
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+}
+
+/*
+ * Reset all the entries without visiting them, by advancing the global epoch.
+ * Each entry is then zeroed the next time it's accessed, see
+ * pgsk_entry_check_epoch(), but keeps its usage so that the eviction isn't
+ * affected.
+ */
+static void
+pgsk_entry_reset_lazy(void)
+{
+	/* Also discard our own pending counters, and those of the others */
+	pgsk_local_discard();
+	pgsk_advance_epoch();
+
+	pgsk_agg_reset(false);
+	pgsk_stat_reset(false);
+}
+
+/*
+ * Advance the global epoch.  The entries not visited since then are lazily
+ * zeroed, see pgsk_entry_check_epoch(), and the counters that backends are
+ * locally accumulating are discarded, see pgsk_local_flush().
+ */
+static void
+pgsk_advance_epoch(void)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+
+#ifdef PGSK_USE_ATOMICS
+	pgsk->epoch_since = now;
+	/* Pairs with the read barrier in pgsk_get_epoch() */
+	pg_write_barrier();
+	pg_atomic_fetch_add_u64(&pgsk->epoch, 1);
+#else
+	{
+		volatile pgskSharedState *s = (volatile pgskSharedState *) pgsk;
+
+		SpinLockAcquire(&s->mutex);
+		s->epoch_since = now;
+		s->epoch++;
+		SpinLockRelease(&s->mutex);
+	}
+#endif
+}
+
+/*
+ * Find the aggregate slot of the given oid, claiming a free or released one if
+ * create is true.  Returns NULL if there's no such slot.  If all the slots are
+ * used, this is counted in the extension's own counters.
+ */
+static pgskAggEntry *
+pgsk_agg_find(pgskAggKind akind, Oid oid, bool create)
+{
+	pgskAggEntry *aggs = pgsk_aggs + (akind * pgsk_max_aggregates);
+	uint32		start = hash_uint32((uint32) oid) % pgsk_max_aggregates;
+	pgskAggEntry *candidate = NULL;
+	bool		full = true;
+	int			n;
+
+	Assert(OidIsValid(oid));
+
+	/* Fast path, without locking */
+	for (n = 0; n < pgsk_max_aggregates; n++)
+	{
+		pgskAggEntry *agg = &aggs[(start + n) % pgsk_max_aggregates];
+		Oid			cur;
+		pgskAggSlotState state = pgsk_agg_read_slot(agg, &cur);
+
+		if (state == PGSK_AGG_SLOT_USED && cur == oid)
+			return agg;
+		if (state != PGSK_AGG_SLOT_USED)
+			full = false;
+		if (state == PGSK_AGG_SLOT_FREE)
+			break;
+	}
+
+	if (!create)
+		return NULL;
+
+	/* Don't take the lock for nothing if there's no slot left */
+	if (full)
+	{
+		pgsk_stat_add(PGSK_STAT_AGG_DROPPED, 1);
+		return NULL;
+	}
+
+	/*
+	 * Claim the first free or released slot, unless another backend claimed
+	 * one for this oid in the meantime.
+	 */
+	LWLockAcquire(pgsk->agg_lock, LW_EXCLUSIVE);
+
+	for (n = 0; n < pgsk_max_aggregates; n++)
+	{
+		pgskAggEntry *agg = &aggs[(start + n) % pgsk_max_aggregates];
+		Oid			cur;
+		pgskAggSlotState state = pgsk_agg_read_slot(agg, &cur);
+
+		if (state == PGSK_AGG_SLOT_USED && cur == oid)
+		{
+			LWLockRelease(pgsk->agg_lock);
+			return agg;
+		}
+		if (state != PGSK_AGG_SLOT_USED && candidate == NULL)
+			candidate = agg;
+		if (state == PGSK_AGG_SLOT_FREE)
+			break;
+	}
+
+	if (candidate)
+		pgsk_agg_claim(candidate, oid);
+
+	LWLockRelease(pgsk->agg_lock);
+
+	if (!candidate)
+		pgsk_stat_add(PGSK_STAT_AGG_DROPPED, 1);
+
+	return candidate;
+}
+
+/*
+ * Get the state of an aggregate slot, and its oid.
+ */
+static pgskAggSlotState
+pgsk_agg_read_slot(pgskAggEntry *agg, Oid *oid)
+{
+#ifdef PGSK_USE_ATOMICS
+	pgskAggSlotState state;
+
+	state = (pgskAggSlotState) pg_atomic_read_u32(&agg->state);
+	/* Pairs with the write barrier in pgsk_agg_claim() */
+	pg_read_barrier();
+	*oid = pg_atomic_read_u32(&agg->oid);
+
+	return state;
+#else
+	volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+	pgskAggSlotState state;
+
+	SpinLockAcquire(&a->mutex);
+	state = (pgskAggSlotState) a->state;
+	*oid = a->oid;
+	SpinLockRelease(&a->mutex);
+
+	return state;
+#endif
+}
+
+/*
+ * Claim a free or released aggregate slot for the given oid, starting from
+ * zero.  Caller must hold the agg_lock.  An update of the previous oid of a
+ * released slot made concurrently can be lost.
+ */
+static void
+pgsk_agg_claim(pgskAggEntry *agg, Oid oid)
+{
+#ifdef PGSK_USE_ATOMICS
+	int			kind;
+
+	pg_atomic_write_u32(&agg->oid, oid);
+	for (kind = 0; kind < PGSK_NUMKIND; kind++)
+		pgsk_shared_counters_zero(&agg->counters[kind], true, false);
+	/* Pairs with the read barrier in pgsk_agg_read_slot() */
+	pg_write_barrier();
+	pg_atomic_write_u32(&agg->state, PGSK_AGG_SLOT_USED);
+#else
+	volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+
+	SpinLockAcquire(&a->mutex);
+	a->oid = oid;
+	memset(agg->counters, 0, sizeof(agg->counters));
+	a->state = PGSK_AGG_SLOT_USED;
+	SpinLockRelease(&a->mutex);
+#endif
+}
+
+/*
+ * Release the aggregate slot of the given oid, if any, so that it can be
+ * reused and that an oid later reused doesn't inherit its totals.
+ */
+static void
+pgsk_agg_release(pgskAggKind akind, Oid oid)
+{
+	pgskAggEntry *aggs;
+	uint32		start;
+	int			n;
+
+	if (!pgsk_aggs)
+		return;
+
+	aggs = pgsk_aggs + (akind * pgsk_max_aggregates);
+	start = hash_uint32((uint32) oid) % pgsk_max_aggregates;
+
+	LWLockAcquire(pgsk->agg_lock, LW_EXCLUSIVE);
+
+	for (n = 0; n < pgsk_max_aggregates; n++)
+	{
+		pgskAggEntry *agg = &aggs[(start + n) % pgsk_max_aggregates];
+		Oid			cur;
+		pgskAggSlotState state = pgsk_agg_read_slot(agg, &cur);
+
+		if (state == PGSK_AGG_SLOT_FREE)
+			break;
+		if (state == PGSK_AGG_SLOT_USED && cur == oid)
+		{
+#ifdef PGSK_USE_ATOMICS
+			pg_atomic_write_u32(&agg->state, PGSK_AGG_SLOT_RELEASED);
+#else
+			volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+
+			SpinLockAcquire(&a->mutex);
+			a->state = PGSK_AGG_SLOT_RELEASED;
+			SpinLockRelease(&a->mutex);
+#endif
+			break;
+		}
+	}
+
+	LWLockRelease(pgsk->agg_lock);
+}
+
+/*
+ * Object access hook: remember the databases and roles dropped by the current
+ * transaction, so that their aggregate slots are released if it commits, see
+ * pgsk_xact_callback().
+ */
+static void
+pgsk_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+				   int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access != OAT_DROP || subId != 0 || !pgsk_aggs)
+		return;
+
+	if (classId == DatabaseRelationId)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+
+		pgsk_dropped_dbs = lappend_oid(pgsk_dropped_dbs, objectId);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else if (classId == AuthIdRelationId)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+
+		pgsk_dropped_roles = lappend_oid(pgsk_dropped_roles, objectId);
+		MemoryContextSwitchTo(oldcontext);
+	}
+}
+
+/*
+ * Add the given counters, one per kind, to the aggregates of the key's
+ * database and role.  Only top-level statements are aggregated, as the nested
+ * ones are already accounted for in their top-level statement.
+ */
+static void
+pgsk_agg_accum(const pgskHashKey *key,
+			   const pgskCounters counters[PGSK_NUMKIND])
+{
+	int			akind;
+
+	if (!pgsk_aggs || !key->top)
+		return;
+
+	for (akind = 0; akind < PGSK_NUM_AGGS; akind++)
+	{
+		Oid			oid = (akind == PGSK_AGG_DATABASE ? key->dbid : key->userid);
+		pgskAggEntry *agg;
+		int			kind;
+
+		/* Processes not connected to a database don't have a dbid */
+		if (!OidIsValid(oid))
+			continue;
+
+		agg = pgsk_agg_find(akind, oid, true);
+		if (!agg)
+			continue;
+
+#ifdef PGSK_USE_ATOMICS
+		for (kind = 0; kind < PGSK_NUMKIND; kind++)
+			pgsk_shared_counters_add(&agg->counters[kind], true,
+										 &counters[kind]);
+#else
+		{
+			volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+
+			SpinLockAcquire(&a->mutex);
+			for (kind = 0; kind < PGSK_NUMKIND; kind++)
+				pgsk_counters_add(&a->counters[kind], &counters[kind]);
+			SpinLockRelease(&a->mutex);
+		}
+#endif
+	}
+}
+
+/*
+ * Free all the aggregate slots, and set them to zero.  If init is true, the
+ * slots are also initialized, which must only be done at startup.  An update
+ * made concurrently can be lost.
+ */
+static void
+pgsk_agg_reset(bool init)
+{
+	int			i;
+
+	if (!init)
+		LWLockAcquire(pgsk->agg_lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < PGSK_NUM_AGGS * pgsk_max_aggregates; i++)
+	{
+		pgskAggEntry *agg = &pgsk_aggs[i];
+#ifdef PGSK_USE_ATOMICS
+		int			kind;
+
+		if (init)
+		{
+			pg_atomic_init_u32(&agg->state, PGSK_AGG_SLOT_FREE);
+			pg_atomic_init_u32(&agg->oid, InvalidOid);
+		}
+		else
+			pg_atomic_write_u32(&agg->state, PGSK_AGG_SLOT_FREE);
+		for (kind = 0; kind < PGSK_NUMKIND; kind++)
+			pgsk_shared_counters_zero(&agg->counters[kind], true, init);
+#else
+		volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+
+		if (init)
+			SpinLockInit(&a->mutex);
+		SpinLockAcquire(&a->mutex);
+		a->state = PGSK_AGG_SLOT_FREE;
+		a->oid = InvalidOid;
+		memset(agg->counters, 0, sizeof(agg->counters));
+		SpinLockRelease(&a->mutex);
+#endif
+	}
+
+	if (!init)
+		LWLockRelease(pgsk->agg_lock);
+
+	pgsk->agg_stats_since = GetCurrentTimestamp();
+}
+
+/*
+ * Start accumulating the resource usage of the given executor's runs.  Must be
+ * called once the executor state is created.
+ */
+static void
+pgsk_run_start(QueryDesc *queryDesc)
+{
+#if PG_VERSION_NUM >= 90500
+	MemoryContext cxt = queryDesc->estate->es_query_cxt;
+	pgskRunState *run;
+
+	run = (pgskRunState *) MemoryContextAllocZero(cxt, sizeof(pgskRunState));
+	run->queryDesc = queryDesc;
+	run->timing = pgsk_timing;
+	run->callback.func = pgsk_run_release;
+	run->callback.arg = run;
+	MemoryContextRegisterResetCallback(cxt, &run->callback);
+
+	run->next = pgsk_run_states;
+	pgsk_run_states = run;
+#endif
+}
+
+/*
+ * Find the run state of the given executor, if it's measured in run mode.
+ * There are only as many states as executors open at the same time.
+ */
+static pgskRunState *
+pgsk_run_find(QueryDesc *queryDesc)
+{
+	pgskRunState *run;
+
+	for (run = pgsk_run_states; run != NULL; run = run->next)
+	{
+		if (run->queryDesc == queryDesc)
+			return run;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add the resource usage since rusage_start to the given run state.
+ */
+static void
+pgsk_run_accum(pgskRunState *run, pgskUsage *rusage_start)
+{
+	pgskUsage	rusage_end;
+	pgskCounters counters;
+
+	pgsk_capture_usage(&rusage_end, run->timing);
+	pgsk_compute_counters(&counters, rusage_start, &rusage_end, NULL);
+	pgsk_counters_add(&run->counters, &counters);
+}
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * Memory context callback: the executor is gone, forget its run state.
+ */
+static void
+pgsk_run_release(void *arg)
+{
+	pgskRunState *run = (pgskRunState *) arg;
+	pgskRunState **prev;
+
+	for (prev = &pgsk_run_states; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == run)
+		{
+			*prev = run->next;
+			break;
+		}
+	}
+}
+#endif
+
+/*
+ * Hooks
+ */
+
+#if PG_VERSION_NUM >= 130000
+/*
+ * Planner hook: forward to regular planner, but measure planning time
+ * if needed.
+ */
+static PlannedStmt *
+pgsk_planner(Query *parse,
+			 const char *query_string,
+			 int cursorOptions,
+			 ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+
+	/* We can't process the query if no queryid has been computed. */
+	if (pgsk_enabled(nesting_level)
+		&& pgsk_track_planning
+		&& pgsk_entry_has_plan
+		&& parse->queryId != UINT64CONST(0)
+		&& pgsk_is_sampled(true))
+	{
+		pgskUsage  *rusage_start = &plan_rusage_start[nesting_level];
+		pgskUsage	rusage_end;
+		pgskCounters counters;
+
+		/* capture kernel usage stats in rusage_start */
+		pgsk_capture_usage(rusage_start, pgsk_timing);
+
+		nesting_level++;
+		PG_TRY();
+		{
+			if (prev_planner_hook)
+				result = prev_planner_hook(parse, query_string, cursorOptions,
+										   boundParams);
+			else
+				result = standard_planner(parse, query_string, cursorOptions,
+										  boundParams);
+			nesting_level--;
+		}
+		PG_CATCH();
+		{
+			nesting_level--;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		/* capture kernel usage stats in rusage_end */
+		pgsk_capture_usage(&rusage_end, rusage_start->timing);
+
+		pgsk_compute_counters(&counters, rusage_start, &rusage_end, NULL);
+
+		/* store current number of block reads and writes */
+		pgsk_entry_store(parse->queryId, PGSK_PLAN, counters, NULL, NULL);
+
+		/* statements run while planning are part of the planning counters */
+		pgsk_nested_reset(nesting_level);
+		pgsk_nested_add(nesting_level, PGSK_PLAN, &counters);
+
+		if (pgsk_counters_hook)
+		    pgsk_counters_hook(&counters,
+							   query_string,
+							   nesting_level,
+							   PGSK_PLAN);
+	}
+	else
+	{
+		/*
+		 * Even though we're not tracking planning for this statement, we
+		 * must still increment the nesting level, to ensure that functions
+		 * evaluated during planning are not seen as top-level calls.
+		 */
+		nesting_level++;
+		PG_TRY();
+		{
+			if (prev_planner_hook)
+				result = prev_planner_hook(parse, query_string, cursorOptions,
+										   boundParams);
+			else
+				result = standard_planner(parse, query_string, cursorOptions,
+										  boundParams);
+			nesting_level--;
+		}
+		PG_CATCH();
+		{
+			nesting_level--;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	return result;
+}
+#endif
+
+static void
+pgsk_ExecutorStart (QueryDesc *queryDesc, int eflags)
+{
+	bool		run_mode = false;
+
+	if (pgsk_enabled(nesting_level))
+	{
+		pgskUsage  *rusage_start = &exec_rusage_start[nesting_level];
+		bool		sampled;
+
+#if PG_VERSION_NUM >= 140000
+		if (IsParallelWorker())
+			pgsk_worker_executed = true;
+#endif
+
+#if PG_VERSION_NUM >= 90600
+		/*
+		 * Parallel workers follow the leader's decision, which only shares
+		 * the queryid of sampled statements.
+		 */
+		if (IsParallelWorker())
+			sampled = (pgsk_sample_rate >= 1.0 ||
+					   pgsk_leader_queryid() != UINT64CONST(0));
+		else
+#endif
+			sampled = pgsk_is_sampled(false);
+
+		/*
+		 * capture kernel usage stats in rusage_start, unless only the
+		 * executor runs are measured
+		 */
+		run_mode = sampled &&
+			pgsk_exec_accounting == PGSK_ACCOUNTING_RUN;
+		if (sampled && !run_mode)
+			pgsk_capture_usage(rusage_start, pgsk_timing);
+		else
+			rusage_start->sampled = false;
+
+		/*
+		 * Forget the nested statements of an earlier statement that failed.
+		 * Below the top level, they're still part of the caller's execution,
+		 * and other statements can be running, e.g. a cursor's query.
+		 */
+		if (nesting_level == 0)
+			pgsk_nested_reset(0);
+
+#if PG_VERSION_NUM >= 90600
+		/* Save the queryid so parallel worker can retrieve it */
+		if (!IsParallelWorker())
+		{
+			pgsk_set_queryid(sampled ? queryDesc->plannedstmt->queryId :
+							 UINT64CONST(0));
+			if (nesting_level == 0)
+				pgsk_activity_start(queryDesc->plannedstmt->queryId,
+									rusage_start);
+		}
+#endif
+	}
+
+	/* The planning decision, if any, is consumed */
+	if (nesting_level == 0)
+		pgsk_sample_planned = false;
+
+	/* give control back to PostgreSQL */
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (run_mode)
+		pgsk_run_start(queryDesc);
+}
+
+/*
+ * ExecutorRun hook: track nesting depth, and measure the run if only the
+ * executor runs are measured
+ */
+static void
+pgsk_ExecutorRun(QueryDesc *queryDesc,
+				 ScanDirection direction,
+#if PG_VERSION_NUM >= 90600
+				 uint64 count
+#else
+				 long count
+#endif
+#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
+				 ,bool execute_once
+#endif
+)
+{
+	pgskRunState *run = pgsk_run_find(queryDesc);
+	pgskUsage	rusage_start;
+
+	if (run)
+		pgsk_capture_usage(&rusage_start, run->timing);
+
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+			prev_ExecutorRun(queryDesc, direction, count);
+#endif
+		else
+#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+			standard_ExecutorRun(queryDesc, direction, count);
+#endif
+		nesting_level--;
+	}
+	PG_CATCH();
+	{
+		nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (run)
+		pgsk_run_accum(run, &rusage_start);
+}
+
+/*
+ * ExecutorFinish hook: track nesting depth, and measure the run if only the
+ * executor runs are measured
+ */
+static void
+pgsk_ExecutorFinish(QueryDesc *queryDesc)
+{
+	pgskRunState *run = pgsk_run_find(queryDesc);
+	pgskUsage	rusage_start;
+
+	if (run)
+		pgsk_capture_usage(&rusage_start, run->timing);
+
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		nesting_level--;
+	}
+	PG_CATCH();
+	{
+		nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (run)
+		pgsk_run_accum(run, &rusage_start);
+}
+
+static void
+pgsk_ExecutorEnd (QueryDesc *queryDesc)
+{
+	pgsk_queryid queryId = UINT64CONST(0);
+	pgskUsage	rusage_end;
+	pgskCounters counters;
+	pgskCounters nested;
+	bool		has_nested = false;
+	bool		measured = false;
+	const char *query_text = queryDesc->sourceText;
+	pgskRunState *run = pgsk_run_find(queryDesc);
+#if PG_VERSION_NUM >= 90600
+	pgskCounters workers;
+	bool		has_workers;
+#endif
+
+	if (run || (pgsk_enabled(nesting_level)
+				&& exec_rusage_start[nesting_level].sampled))
+	{
+		if (run)
+		{
+			/* only the executor runs were measured */
+			counters = run->counters;
+			counters.calls = 1;
+			counters.rusage_calls = (run->counters.rusage_calls > 0) ? 1 : 0;
+#ifdef PGSK_CPUTIME_CLOCK
+			if (run->timing == PGSK_TIMING_RUSAGE)
+#endif
+				pgsk_short_cputime(&counters, queryDesc);
+		}
+		else
+		{
+			pgskUsage  *rusage_start = &exec_rusage_start[nesting_level];
+
+			/* capture kernel usage stats in rusage_end */
+			pgsk_capture_usage(&rusage_end, rusage_start->timing);
+			pgsk_compute_counters(&counters, rusage_start, &rusage_end,
+								  queryDesc);
+		}
+
+#if PG_VERSION_NUM >= 90600
+		if (IsParallelWorker())
+			queryId = pgsk_leader_queryid();
+		else
+#endif
+		queryId = queryDesc->plannedstmt->queryId;
+
+		measured = true;
+
+		if (pgsk_counters_hook)
+		    pgsk_counters_hook(&counters,
+							   (const char *)queryDesc->sourceText,
+							   nesting_level,
+							   PGSK_EXEC);
+
+#if PG_VERSION_NUM >= 90600
+		/* Let the leader store our counters with its own */
+		if (IsParallelWorker())
+		{
+			pgsk_worker_report(queryId, &counters);
+			measured = false;
+		}
+#endif
+
+		if (measured)
+		{
+			has_nested = pgsk_nested_collect(nesting_level, &nested);
+			pgsk_nested_add(nesting_level, PGSK_EXEC, &counters);
+		}
+	}
+
+	/* give control back to PostgreSQL */
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+#if PG_VERSION_NUM >= 90600
+	if (nesting_level == 0)
+		pgsk_activity_end();
+#endif
+
+	if (!measured)
+		return;
+
+	/*
+	 * All the parallel workers have exited by now, so they all reported their
+	 * counters.
+	 */
+#if PG_VERSION_NUM >= 90600
+	has_workers = pgsk_workers_collect(queryId, &workers);
+	pgsk_entry_store(queryId, PGSK_EXEC, counters,
+					 has_workers ? &workers : NULL,
+					 has_nested ? &nested : NULL);
+	pgsk_log_check(queryId, &counters, has_workers ? &workers : NULL,
+				   query_text);
+#else
+	pgsk_entry_store(queryId, PGSK_EXEC, counters, NULL,
+					 has_nested ? &nested : NULL);
+	pgsk_log_check(queryId, &counters, NULL, query_text);
+#endif
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * ProcessUtility hook: measure utility commands, using the queryid computed
+ * by the core query jumbling.
+ */
+static void
+pgsk_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+					bool readOnlyTree,
+					ProcessUtilityContext context,
+					ParamListInfo params, QueryEnvironment *queryEnv,
+					DestReceiver *dest, QueryCompletion *qc)
+{
+	Node	   *parsetree = pstmt->utilityStmt;
+	pgsk_queryid queryId = pstmt->queryId;
+
+	/*
+	 * A statement planned but not executed, e.g. by PREPARE, mustn't impose
+	 * its decision to this one.  EXECUTE plans again in the hooks below.
+	 */
+	if (nesting_level == 0)
+		pgsk_sample_planned = false;
+
+	/*
+	 * Like pg_stat_statements, don't track EXECUTE itself, as the executor
+	 * hooks will track the underlying statement, nor PREPARE and DEALLOCATE
+	 * which are cheap.  Statements without a queryid can't be joined with
+	 * pg_stat_statements, so there's no point in tracking them.
+	 */
+	if (pgsk_track_utility && pgsk_enabled(nesting_level)
+		&& queryId != UINT64CONST(0)
+		&& !IsA(parsetree, ExecuteStmt)
+		&& !IsA(parsetree, PrepareStmt)
+		&& !IsA(parsetree, DeallocateStmt)
+		&& pgsk_is_sampled(false))
+	{
+		pgskUsage	rusage_start;
+		pgskUsage	rusage_end;
+		pgskCounters counters;
+		pgskCounters workers;
+		pgskCounters nested;
+		pgsk_queryid saved_queryid;
+		bool		has_workers;
+		bool		has_nested;
+
+		/* capture kernel usage stats in rusage_start */
+		pgsk_capture_usage(&rusage_start, pgsk_timing);
+		if (nesting_level == 0)
+			pgsk_nested_reset(0);
+
+		/* Save the queryid so parallel workers, e.g. for CREATE INDEX, can retrieve it */
+		saved_queryid = pgsk->parallel[MyProcNumber].queryid;
+		pgsk_set_queryid(queryId);
+		if (nesting_level == 0)
+			pgsk_activity_start(queryId, &rusage_start);
+
+		nesting_level++;
+		PG_TRY();
+		{
+			if (prev_ProcessUtility)
+				prev_ProcessUtility(pstmt, queryString, readOnlyTree,
+									context, params, queryEnv,
+									dest, qc);
+			else
+				standard_ProcessUtility(pstmt, queryString, readOnlyTree,
+										context, params, queryEnv,
+										dest, qc);
+			nesting_level--;
+		}
+		PG_CATCH();
+		{
+			nesting_level--;
+			pgsk->parallel[MyProcNumber].queryid = saved_queryid;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		/*
+		 * A nested statement overwrote the queryid, give it back to the
+		 * statement we're nested in, if any.
+		 */
+		pgsk->parallel[MyProcNumber].queryid = saved_queryid;
+
+		/* capture kernel usage stats in rusage_end */
+		pgsk_capture_usage(&rusage_end, rusage_start.timing);
+
+		pgsk_compute_counters(&counters, &rusage_start, &rusage_end, NULL);
+
+		/*
+		 * store the counters, with the ones of the parallel workers and of
+		 * the nested statements if any
+		 */
+		has_nested = pgsk_nested_collect(nesting_level, &nested);
+		pgsk_nested_add(nesting_level, PGSK_EXEC, &counters);
+		has_workers = pgsk_workers_collect(queryId, &workers);
+		pgsk_entry_store(queryId, PGSK_EXEC, counters,
+						 has_workers ? &workers : NULL,
+						 has_nested ? &nested : NULL);
+		pgsk_log_check(queryId, &counters, has_workers ? &workers : NULL,
+					   queryString);
+		if (nesting_level == 0)
+			pgsk_activity_end();
+
+		if (pgsk_counters_hook)
+		    pgsk_counters_hook(&counters,
+							   queryString,
+							   nesting_level,
+							   PGSK_EXEC);
+	}
+	else
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, readOnlyTree,
+								context, params, queryEnv,
+								dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree,
+									context, params, queryEnv,
+									dest, qc);
+	}
+}
+
+/*
+ * Parallel workers that don't run an executor, like the ones used for a
+ * parallel CREATE INDEX, are not seen by the executor hooks.  Attribute the
+ * whole resource usage of such workers to the leader's utility statement
+ * when they commit their transaction, which happens before the leader sees
+ * them as done.  Only the usage since the previous call is stored, so that a
+ * process committing several times isn't charged its whole lifetime again.
+ */
+static void
+pgsk_worker_store(void)
+{
+	static pgskUsage rusage_last;
+	static bool has_last = false;
+	pgsk_queryid queryId;
+	pgskUsage	rusage_start;
+	pgskUsage	rusage_end;
+	pgskCounters counters;
+
+	if (!pgsk || !IsParallelWorker() || pgsk_worker_executed)
+		return;
+
+	if (!pgsk_track_utility || !pgsk_enabled(nesting_level))
+		return;
+
+	queryId = pgsk_leader_queryid();
+	if (queryId == UINT64CONST(0))
+		return;
+
+	if (has_last)
+		rusage_start = rusage_last;
+	else
+	{
+		/* The process counters all started from zero */
+		memset(&rusage_start, 0, sizeof(pgskUsage));
+		rusage_start.sampled = true;
+		rusage_start.timing = pgsk_timing;
+#ifdef PGSK_HAVE_PROC_IO
+		rusage_start.has_io = pgsk_track_io;
+#endif
+	}
+
+	pgsk_capture_usage(&rusage_end, rusage_start.timing);
+	if (!has_last)
+		rusage_start.wallclock = rusage_end.wallclock;
+
+	pgsk_compute_counters(&counters, &rusage_start, &rusage_end, NULL);
+	if (!has_last)
+		counters.elapsed = (double) (GetCurrentTimestamp() -
+									 MyStartTimestamp) / USECS_PER_SEC;
+
+	rusage_last = rusage_end;
+	has_last = true;
+
+	if (pgsk_counters_hook)
+		pgsk_counters_hook(&counters,
+						   NULL,
+						   nesting_level,
+						   PGSK_EXEC);
+
+	pgsk_worker_report(queryId, &counters);
+}
+#endif
+
+/*
+ * Calculate hash value for a key
+ *
+ * The queryid is already a hash, so the whole key is folded into a single
+ * 64-bit value, keeping all the bits of the queryid, and mixed once with the
+ * murmur3 finalizer.  The userid and dbid are spread with a multiplication
+ * first so that they don't cancel each other, and since every input bit
+ * affects every output bit, the same statement executed at top level and
+ * nested level end up in unrelated buckets and partitions.
+ */
+static uint32
+pgsk_hash_fn(const void *key, Size keysize)
+{
+	const pgskHashKey *k = (const pgskHashKey *) key;
+	uint64		h;
+
+	h = (((uint64) k->userid << 32) | (uint64) k->dbid)
+		* UINT64CONST(0x9E3779B97F4A7C15);
+	h ^= (uint64) k->queryid ^ (uint64) k->top;
+
+	h ^= h >> 33;
+	h *= UINT64CONST(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return (uint32) (h ^ (h >> 32));
+}
+
+/*
+ * Compare two keys - zero means match
+ */
+static int
+pgsk_match_fn(const void *key1, const void *key2, Size keysize)
+{
+	const pgskHashKey *k1 = (const pgskHashKey *) key1;
+	const pgskHashKey *k2 = (const pgskHashKey *) key2;
+
+	if (k1->userid == k2->userid &&
+		k1->dbid == k2->dbid &&
+		k1->queryid == k2->queryid &&
+		k1->top == k2->top)
+		return 0;
+	else
+		return 1;
+}
+
+/*
+ * Reset statistics.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_reset(PG_FUNCTION_ARGS)
+{
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+
+	pgsk_entry_reset();
+	PG_RETURN_VOID();
+}
+
+/*
+ * Reset the statistics of the entries matching the given dbid, userid and
+ * queryid, a NULL argument meaning no restriction.  If the last argument is
+ * true, only reset their histograms.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_reset_2_4(PG_FUNCTION_ARGS)
+{
+	pgskFilter	filter;
+	bool		histograms_only = PG_ARGISNULL(3) ? false : PG_GETARG_BOOL(3);
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+
+	memset(&filter, 0, sizeof(pgskFilter));
+	if (!PG_ARGISNULL(0))
+	{
+		filter.has_dbid = true;
+		filter.dbid = PG_GETARG_OID(0);
+	}
+	if (!PG_ARGISNULL(1))
+	{
+		filter.has_userid = true;
+		filter.userid = PG_GETARG_OID(1);
+	}
+	if (!PG_ARGISNULL(2))
+	{
+		filter.has_queryid = true;
+		filter.queryid = (pgsk_queryid) PG_GETARG_INT64(2);
+	}
+
+	/* Without any restriction, this is a regular reset */
+	if (!histograms_only && !filter.has_dbid && !filter.has_userid &&
+		!filter.has_queryid)
+		pgsk_entry_reset();
+	else
+		pgsk_entry_reset_filtered(&filter, histograms_only);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Reset all the statistics, zeroing each entry the next time it's accessed
+ * rather than removing them all.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_reset_lazy(PG_FUNCTION_ARGS)
+{
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+
+	pgsk_entry_reset_lazy();
+	PG_RETURN_VOID();
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_0, NULL);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_2_1(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_1, NULL);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_2_2(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_2, NULL);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_2_3(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_3, NULL);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_2_4(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_4, NULL);
+
+	return (Datum) 0;
+}
+
+/*
+ * Same as pg_stat_kcache(), but only return the entries matching the given
+ * dbid, userid and queryid.  A NULL argument means no restriction.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_2_4_filter(PG_FUNCTION_ARGS)
+{
+	pgskFilter	filter;
+
+	memset(&filter, 0, sizeof(pgskFilter));
+	if (!PG_ARGISNULL(0))
+	{
+		filter.has_dbid = true;
+		filter.dbid = PG_GETARG_OID(0);
+	}
+	if (!PG_ARGISNULL(1))
+	{
+		filter.has_userid = true;
+		filter.userid = PG_GETARG_OID(1);
+	}
+	if (!PG_ARGISNULL(2))
+	{
+		filter.has_queryid = true;
+		filter.queryid = (pgsk_queryid) PG_GETARG_INT64(2);
+	}
+
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_4, &filter);
+
+	return (Datum) 0;
+}
+
+/*
+ * Same as pg_stat_kcache(), but only return the entries that may have changed
+ * since the given generation, with the generation to use for the next call.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_changes(PG_FUNCTION_ARGS)
+{
+	int64		since = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT64(0);
+	pgskFilter	filter;
+
+	memset(&filter, 0, sizeof(pgskFilter));
+	filter.changes = true;
+	filter.since = since < 0 ? 0 : (uint64) since;
+
+	pg_stat_kcache_internal(fcinfo, PGSK_V2_4, &filter);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return all the entries as serialized records, see PGSK_RECORD_MAGIC
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_export(PG_FUNCTION_ARGS)
+{
+	StringInfoData	buf;
+	bytea		   *result;
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+
+	/* Make sure our own pending counters are visible */
+	pgsk_local_flush();
+
+	initStringInfo(&buf);
+
+	/* room for the varlena header */
+	enlargeStringInfo(&buf, VARHDRSZ);
+	buf.len = VARHDRSZ;
+
+	pgsk_serialize(&buf, 0, true);
+
+	result = (bytea *) buf.data;
+	SET_VARSIZE(result, buf.len);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * Return whether the given entry satisfies all the filter's restrictions
+ */
+static bool
+pgsk_filter_match(const pgskFilter *filter, pgskEntry *entry)
+{
+	if (filter->has_userid && entry->key.userid != filter->userid)
+		return false;
+	if (filter->has_dbid && entry->key.dbid != filter->dbid)
+		return false;
+	if (filter->has_queryid && entry->key.queryid != filter->queryid)
+		return false;
+	if (filter->changes && pgsk_entry_get_generation(entry) < filter->since)
+		return false;
+
+	return true;
+}
+
+/*
+ * Time spent waiting rather than running on a CPU, whether on I/O, locks or
+ * the client.  The CPU times can be slightly overestimated with a low
+ * resolution timing, so the result is never negative.
+ */
+static double
+pgsk_off_cpu_time(const pgskCounters *counters)
+{
+	double		off_cpu = counters->elapsed - counters->utime - counters->stime;
+
+	return Max(off_cpu, 0.0);
+}
+
+/*
+ * Whether the getrusage() counters were measured by the calls accounted in the
+ * given counters.  They aren't with pg_stat_kcache.timing = clock, and are
+ * then reported as NULL rather than as zeros looking like real measurements.
+ */
+#define PGSK_HAS_RUSAGE(c)	((c)->calls == 0 || (c)->rusage_calls > 0)
+
+/*
+ * Add the per-kind columns of the given counters for the given API version,
+ * starting at values[i].  Returns the index of the next column.  If full is
+ * false, the counters that the compact layout doesn't store are NULL.
+ */
+static int
+pgsk_fill_counters(Datum *values, bool *nulls, int i,
+				   const pgskCounters tmp[PGSK_NUMKIND], int min_kind,
+				   bool full, pgskVersion api_version)
+{
+	int				kind;
+#ifdef HAVE_GETRUSAGE
+	int64			reads, writes;
+	bool			rusage;
+#endif
+
+	for (kind = min_kind; kind < PGSK_NUMKIND; kind++)
+	{
+#ifdef HAVE_GETRUSAGE
+		rusage = PGSK_HAS_RUSAGE(&tmp[kind]);
+		reads = tmp[kind].reads * RUSAGE_BLOCK_SIZE;
+		writes = tmp[kind].writes * RUSAGE_BLOCK_SIZE;
+		values[i] = Int64GetDatumFast(reads);
+		nulls[i++] = !rusage;
+		values[i] = Int64GetDatumFast(writes);
+		nulls[i++] = !rusage;
+#else
+		nulls[i++] = true; /* reads */
+		nulls[i++] = true; /* writes */
+#endif
+		values[i++] = Float8GetDatumFast(tmp[kind].utime);
+		values[i++] = Float8GetDatumFast(tmp[kind].stime);
+		if (api_version >= PGSK_V2_1)
+		{
+#ifdef HAVE_GETRUSAGE
+			values[i] = Int64GetDatumFast(tmp[kind].minflts);
+			nulls[i++] = !rusage;
+			values[i] = Int64GetDatumFast(tmp[kind].majflts);
+			nulls[i++] = !rusage;
+			values[i] = Int64GetDatumFast(tmp[kind].nswaps);
+			nulls[i++] = !rusage || !full;
+			values[i] = Int64GetDatumFast(tmp[kind].msgsnds);
+			nulls[i++] = !rusage || !full;
+			values[i] = Int64GetDatumFast(tmp[kind].msgrcvs);
+			nulls[i++] = !rusage || !full;
+			values[i] = Int64GetDatumFast(tmp[kind].nsignals);
+			nulls[i++] = !rusage || !full;
+			values[i] = Int64GetDatumFast(tmp[kind].nvcsws);
+			nulls[i++] = !rusage;
+			values[i] = Int64GetDatumFast(tmp[kind].nivcsws);
+			nulls[i++] = !rusage;
+#else
+			nulls[i++] = true; /* minflts */
+			nulls[i++] = true; /* majflts */
+			nulls[i++] = true; /* nswaps */
+			nulls[i++] = true; /* msgsnds */
+			nulls[i++] = true; /* msgrcvs */
+			nulls[i++] = true; /* nsignals */
+			nulls[i++] = true; /* nvcsws */
+			nulls[i++] = true; /* nivcsws */
+#endif
+		}
+		if (api_version >= PGSK_V2_4)
+		{
+			values[i++] = Int64GetDatumFast(tmp[kind].calls);
+#ifdef PGSK_HAVE_PROC_IO
+			values[i++] = Int64GetDatumFast(tmp[kind].rchar);
+			values[i++] = Int64GetDatumFast(tmp[kind].wchar);
+			values[i++] = Int64GetDatumFast(tmp[kind].syscr);
+			values[i++] = Int64GetDatumFast(tmp[kind].syscw);
+			values[i++] = Int64GetDatumFast(tmp[kind].read_bytes);
+			values[i++] = Int64GetDatumFast(tmp[kind].write_bytes);
+			values[i++] = Int64GetDatumFast(tmp[kind].cancelled_write_bytes);
+#else
+			nulls[i++] = true; /* rchar */
+			nulls[i++] = true; /* wchar */
+			nulls[i++] = true; /* syscr */
+			nulls[i++] = true; /* syscw */
+			nulls[i++] = true; /* read_bytes */
+			nulls[i++] = true; /* write_bytes */
+			nulls[i++] = true; /* cancelled_write_bytes */
+#endif
+#ifdef PGSK_HAVE_PERF_EVENT
+			values[i++] = Int64GetDatumFast(tmp[kind].cycles);
+			values[i++] = Int64GetDatumFast(tmp[kind].instructions);
+			values[i++] = Int64GetDatumFast(tmp[kind].llc_misses);
+			values[i++] = Int64GetDatumFast(tmp[kind].branch_misses);
+			values[i++] = Int64GetDatumFast(tmp[kind].dtlb_misses);
+#else
+			nulls[i++] = true; /* cycles */
+			nulls[i++] = true; /* instructions */
+			nulls[i++] = true; /* llc_misses */
+			nulls[i++] = true; /* branch_misses */
+			nulls[i++] = true; /* dtlb_misses */
+#endif
+			values[i++] = Float8GetDatumFast(tmp[kind].elapsed);
+			values[i++] = Float8GetDatum(pgsk_off_cpu_time(&tmp[kind]));
+#if PG_VERSION_NUM >= 180000
+			values[i++] = Int64GetDatumFast(tmp[kind].io_worker_reads * BLCKSZ);
+#else
+			nulls[i++] = true; /* io_worker_reads */
+#endif
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Fill the exclusive execution counters of an entry, i.e. without those of the
+ * nested statements it called, starting at values[i], and return the index
+ * of the next column.  Rounding of the CPU times can make them slightly
+ * negative, so they're clamped to 0.
+ */
+static int
+pgsk_fill_self(Datum *values, bool *nulls, int i,
+			   const pgskCounters counters[PGSK_NUMSETS])
+{
+	const pgskCounters *e = &counters[PGSK_EXEC];
+	const pgskCounters *n = &counters[PGSK_NESTED];
+
+	values[i++] = Int64GetDatumFast(n->calls);
+	values[i++] = Float8GetDatumFast(Max(e->utime - n->utime, 0.0));
+	values[i++] = Float8GetDatumFast(Max(e->stime - n->stime, 0.0));
+#ifdef HAVE_GETRUSAGE
+	values[i] = Int64GetDatum(Max(e->reads - n->reads, 0) * RUSAGE_BLOCK_SIZE);
+	nulls[i++] = !PGSK_HAS_RUSAGE(e);
+	values[i] = Int64GetDatum(Max(e->writes - n->writes, 0) * RUSAGE_BLOCK_SIZE);
+	nulls[i++] = !PGSK_HAS_RUSAGE(e);
+#else
+	nulls[i++] = true; /* reads */
+	nulls[i++] = true; /* writes */
+#endif
+	values[i++] = Float8GetDatumFast(Max(e->elapsed - n->elapsed, 0.0));
+
+	return i;
+}
+
+/*
+ * Add a row for the given entry to the tuplestore.  Caller must hold the
+ * entry's partition lock.
+ */
+static void
+pgsk_put_entry(pgskEntry *entry, pgskVersion api_version,
+			   const pgskFilter *filter, uint64 generation,
+			   Tuplestorestate *tupstore, TupleDesc tupdesc)
+{
+	Datum			values[PG_STAT_KCACHE_COLS];
+	bool			nulls[PG_STAT_KCACHE_COLS];
+	pgskCounters	tmp[PGSK_NUMSETS];
+	int				i = 0;
+	int				min_kind = 0;
+	TimestampTz		stats_since;
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = Int64GetDatum(entry->key.queryid);
+	if (api_version >= PGSK_V2_2)
+		values[i++] = BoolGetDatum(entry->key.top);
+	values[i++] = ObjectIdGetDatum(entry->key.userid);
+	values[i++] = ObjectIdGetDatum(entry->key.dbid);
+
+	/* planning time (kind == 0) is added in v2.2 */
+	if (api_version < PGSK_V2_2)
+		min_kind = 1;
+
+	/* copy counters to a local variable to keep locking time short */
+	pgsk_entry_snapshot(entry, tmp);
+	stats_since = entry->stats_since;
+
+	i = pgsk_fill_counters(values, nulls, i, tmp, min_kind, pgsk_entry_full,
+						   api_version);
+	if (api_version >= PGSK_V2_4)
+	{
+		pgskCounters *w = &tmp[PGSK_WORKERS];
+
+		values[i++] = Int64GetDatumFast(w->calls);
+		values[i++] = Float8GetDatumFast(w->utime);
+		values[i++] = Float8GetDatumFast(w->stime);
+#ifdef HAVE_GETRUSAGE
+		values[i] = Int64GetDatum(w->reads * RUSAGE_BLOCK_SIZE);
+		nulls[i++] = !PGSK_HAS_RUSAGE(w);
+		values[i] = Int64GetDatum(w->writes * RUSAGE_BLOCK_SIZE);
+		nulls[i++] = !PGSK_HAS_RUSAGE(w);
+#else
+		nulls[i++] = true; /* reads */
+		nulls[i++] = true; /* writes */
+#endif
+		i = pgsk_fill_self(values, nulls, i, tmp);
+	}
+	if (api_version >= PGSK_V2_3)
+		values[i++] = TimestampTzGetDatum(stats_since);
+
+	if (filter->changes)
+		values[i++] = Int64GetDatumFast(generation);
+
+	Assert(i - (filter->changes ? 1 : 0) ==
+		   (api_version == PGSK_V2_0 ? PG_STAT_KCACHE_COLS_V2_0 :
+			api_version == PGSK_V2_1 ? PG_STAT_KCACHE_COLS_V2_1 :
+			api_version == PGSK_V2_2 ? PG_STAT_KCACHE_COLS_V2_2 :
+			api_version == PGSK_V2_3 ? PG_STAT_KCACHE_COLS_V2_3 :
+			api_version == PGSK_V2_4 ? PG_STAT_KCACHE_COLS_V2_4 :
+			-1 /* fail if you forget to update this assert */ ));
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+static void
+pg_stat_kcache_internal(FunctionCallInfo fcinfo, pgskVersion api_version,
+						const pgskFilter *filter)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	HASH_SEQ_STATUS hash_seq;
+	pgskEntry		*entry;
+	pgskFilter		nofilter;
+	int				part;
+	uint64			generation = 0;
+
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Make sure our own pending counters are visible */
+	pgsk_local_flush();
+
+	if (filter == NULL)
+	{
+		memset(&nofilter, 0, sizeof(pgskFilter));
+		filter = &nofilter;
+	}
+
+	/* Must be done before scanning the entries, see pgsk_next_generation() */
+	if (filter->changes)
+		generation = pgsk_next_generation();
+
+	/*
+	 * If the full identity of the statement is known, only the top-level and
+	 * nested entries can match, so look them up directly rather than scanning
+	 * all the partitions.
+	 */
+	if (filter->has_userid && filter->has_dbid && filter->has_queryid)
+	{
+		int			top;
+
+		for (top = 1; top >= 0; top--)
+		{
+			pgskHashKey key;
+			uint32		hashcode;
+
+			key.userid = filter->userid;
+			key.dbid = filter->dbid;
+			key.queryid = filter->queryid;
+			key.top = (bool) top;
+
+			hashcode = pgsk_hash_fn(&key, sizeof(pgskHashKey));
+			part = PGSK_PARTITION(hashcode);
+
+			LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+			entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part],
+															  &key, hashcode,
+															  HASH_FIND, NULL);
+			if (entry && pgsk_filter_match(filter, entry))
+				pgsk_put_entry(entry, api_version, filter, generation,
+							   tupstore, tupdesc);
+
+			LWLockRelease(pgsk->locks[part]);
+		}
+
+		return;
+	}
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (!pgsk_filter_match(filter, entry))
+				continue;
+
+			pgsk_put_entry(entry, api_version, filter, generation,
+						   tupstore, tupdesc);
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_histogram(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_histogram_internal(fcinfo, false);
+
+	return (Datum) 0;
+}
+
+PGDLLEXPORT Datum
+pg_stat_kcache_percentiles(PG_FUNCTION_ARGS)
+{
+	pg_stat_kcache_histogram_internal(fcinfo, true);
+
+	return (Datum) 0;
+}
+
+#define PG_STAT_KCACHE_HISTOGRAM_COLS		9
+#define PG_STAT_KCACHE_PERCENTILES_COLS		9
+
+/*
+ * Common code for pg_stat_kcache_histogram() and pg_stat_kcache_percentiles().
+ * pg_stat_kcache_histogram() returns one row per non-empty bucket of each
+ * entry's histograms, and pg_stat_kcache_percentiles() one row per non-empty
+ * histogram, with the p50, p95 and p99 estimated from the buckets.  Nothing is
+ * returned if pg_stat_kcache.track_histograms is disabled.
+ */
+static void
+pg_stat_kcache_histogram_internal(FunctionCallInfo fcinfo, bool percentiles)
+{
+	static const char *const hist_names[PGSK_NUM_HISTS] = {
+		"exec_time",
+		"exec_reads"
+	};
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	HASH_SEQ_STATUS hash_seq;
+	pgskEntry		*entry;
+	int				part;
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!pgsk_track_histograms)
+		return;
+
+	/* Make sure our own pending counters are visible */
+	pgsk_local_flush();
+
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+	{
+		LWLockAcquire(pgsk->locks[part], LW_SHARED);
+
+		hash_seq_init(&hash_seq, pgsk_hash[part]);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			pgskHistCounts	hist;
+			int				hkind;
+
+			pgsk_entry_hist_snapshot(entry, &hist);
+
+			for (hkind = 0; hkind < PGSK_NUM_HISTS; hkind++)
+			{
+				const uint64 *buckets = hist.buckets[hkind];
+				Datum		values[PG_STAT_KCACHE_HISTOGRAM_COLS];
+				bool		nulls[PG_STAT_KCACHE_HISTOGRAM_COLS];
+				uint64		total = 0;
+				int			bucket;
+				int			i = 0;
+
+				for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+					total += buckets[bucket];
+
+				if (total == 0)
+					continue;
+
+				values[i++] = Int64GetDatum(entry->key.queryid);
+				values[i++] = BoolGetDatum(entry->key.top);
+				values[i++] = ObjectIdGetDatum(entry->key.userid);
+				values[i++] = ObjectIdGetDatum(entry->key.dbid);
+				values[i++] = CStringGetTextDatum(hist_names[hkind]);
+
+				if (percentiles)
+				{
+					memset(nulls, 0, sizeof(nulls));
+					values[i++] = Int64GetDatumFast(total);
+					values[i++] = Float8GetDatum(pgsk_hist_percentile(buckets, total, hkind, 0.50));
+					values[i++] = Float8GetDatum(pgsk_hist_percentile(buckets, total, hkind, 0.95));
+					values[i++] = Float8GetDatum(pgsk_hist_percentile(buckets, total, hkind, 0.99));
+
+					Assert(i == PG_STAT_KCACHE_PERCENTILES_COLS);
+					tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+					continue;
+				}
+
+				for (bucket = 0; bucket < PGSK_HIST_BUCKETS; bucket++)
+				{
+					int			j = i;
+
+					if (buckets[bucket] == 0)
+						continue;
+
+					memset(nulls, 0, sizeof(nulls));
+					values[j++] = Int32GetDatum(bucket);
+					values[j++] = Float8GetDatum(pgsk_hist_bound(hkind, bucket));
+					/* the last bucket has no upper bound */
+					if (bucket < PGSK_HIST_BUCKETS - 1)
+						values[j++] = Float8GetDatum(pgsk_hist_bound(hkind, bucket + 1));
+					else
+						nulls[j++] = true;
+					values[j++] = Int64GetDatumFast(buckets[bucket]);
+
+					Assert(j == PG_STAT_KCACHE_HISTOGRAM_COLS);
+					tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+				}
+			}
+		}
+
+		LWLockRelease(pgsk->locks[part]);
+	}
+}
+
+#if PG_VERSION_NUM >= 90600
+#define PG_STAT_KCACHE_HISTORY_COLS		19
+#endif
+
+/*
+ * Return the records of the history ring with a timestamp between the given
+ * bounds, a NULL bound meaning no restriction.  Nothing is returned if
+ * pg_stat_kcache.history_size is 0.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+#if PG_VERSION_NUM >= 90600
+	bool			has_from = !PG_ARGISNULL(0);
+	bool			has_to = !PG_ARGISNULL(1);
+	TimestampTz		from = has_from ? PG_GETARG_TIMESTAMPTZ(0) : 0;
+	TimestampTz		to = has_to ? PG_GETARG_TIMESTAMPTZ(1) : 0;
+	pgskHistoryRecord *records;
+	int				nrecords = 0;
+	uint64			start;
+	uint64			i;
+#endif
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+#if PG_VERSION_NUM >= 90600
+	if (!pgsk_history)
+		return (Datum) 0;
 
-	entry = (pgskEntry *) hash_search(pgsk_hash, &key, HASH_FIND, NULL);
+	/* Copy the matching records, to keep locking time short */
+	records = palloc(sizeof(pgskHistoryRecord) * pgsk_history_size);
 
-	/* Create new entry, if not present */
-	if (!entry)
+	LWLockAcquire(pgsk_history->lock, LW_SHARED);
+	start = pgsk_history->next > (uint64) pgsk_history_size ?
+		pgsk_history->next - pgsk_history_size : 0;
+	for (i = start; i < pgsk_history->next; i++)
 	{
-		/* Need exclusive lock to make a new hashtable entry - promote */
-		LWLockRelease(pgsk->lock);
-		LWLockAcquire(pgsk->lock, LW_EXCLUSIVE);
+		pgskHistoryRecord *rec = &pgsk_history->records[i % pgsk_history_size];
 
-		/* OK to create a new hashtable entry */
-		entry = pgsk_entry_alloc(&key);
-	}
+		if ((has_from && rec->ts < from) || (has_to && rec->ts > to))
+			continue;
 
-	/*
-	 * Grab the spinlock while updating the counters (see comment about
-	 * locking rules at the head of the file)
-	 */
-	e = (volatile pgskEntry *) entry;
+		records[nrecords++] = *rec;
+	}
+	LWLockRelease(pgsk_history->lock);
 
-	SpinLockAcquire(&e->mutex);
+	for (i = 0; i < nrecords; i++)
+	{
+		pgskHistoryRecord *rec = &records[i];
+		Datum		values[PG_STAT_KCACHE_HISTORY_COLS];
+		bool		nulls[PG_STAT_KCACHE_HISTORY_COLS];
+		int			j = 0;
 
-	e->counters[0].usage += USAGE_INCREASE;
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-	e->counters[kind].utime += counters.utime;
-	e->counters[kind].stime += counters.stime;
+		values[j++] = TimestampTzGetDatum(rec->ts);
+		values[j++] = Int64GetDatum(rec->key.queryid);
+		values[j++] = BoolGetDatum(rec->key.top);
+		values[j++] = ObjectIdGetDatum(rec->key.userid);
+		values[j++] = ObjectIdGetDatum(rec->key.dbid);
+		values[j++] = Int64GetDatumFast(rec->plan_calls);
+		values[j++] = Int64GetDatumFast(rec->exec_calls);
+		values[j++] = Float8GetDatumFast(rec->utime);
+		values[j++] = Float8GetDatumFast(rec->stime);
 #ifdef HAVE_GETRUSAGE
-	e->counters[kind].minflts += counters.minflts;
-	e->counters[kind].majflts += counters.majflts;
-	e->counters[kind].nswaps += counters.nswaps;
-	e->counters[kind].reads += counters.reads;
-	e->counters[kind].writes += counters.writes;
-	e->counters[kind].msgsnds += counters.msgsnds;
-	e->counters[kind].msgrcvs += counters.msgrcvs;
-	e->counters[kind].nsignals += counters.nsignals;
-	e->counters[kind].nvcsws += counters.nvcsws;
-	e->counters[kind].nivcsws += counters.nivcsws;
+		if (rec->rusage_calls > 0)
+		{
+			values[j++] = Int64GetDatum(rec->reads * RUSAGE_BLOCK_SIZE);
+			values[j++] = Int64GetDatum(rec->writes * RUSAGE_BLOCK_SIZE);
+			values[j++] = Int64GetDatumFast(rec->minflts);
+			values[j++] = Int64GetDatumFast(rec->majflts);
+			values[j++] = Int64GetDatumFast(rec->nvcsws);
+			values[j++] = Int64GetDatumFast(rec->nivcsws);
+		}
+		else
+		{
+			/* Only measured with pg_stat_kcache.timing = clock */
+			nulls[j++] = true; /* reads */
+			nulls[j++] = true; /* writes */
+			nulls[j++] = true; /* minflts */
+			nulls[j++] = true; /* majflts */
+			nulls[j++] = true; /* nvcsws */
+			nulls[j++] = true; /* nivcsws */
+		}
+#else
+		nulls[j++] = true; /* reads */
+		nulls[j++] = true; /* writes */
+		nulls[j++] = true; /* minflts */
+		nulls[j++] = true; /* majflts */
+		nulls[j++] = true; /* nvcsws */
+		nulls[j++] = true; /* nivcsws */
+#endif
+#ifdef PGSK_HAVE_PROC_IO
+		values[j++] = Int64GetDatumFast(rec->rchar);
+		values[j++] = Int64GetDatumFast(rec->wchar);
+		values[j++] = Int64GetDatumFast(rec->read_bytes);
+		values[j++] = Int64GetDatumFast(rec->write_bytes);
+#else
+		nulls[j++] = true; /* rchar */
+		nulls[j++] = true; /* wchar */
+		nulls[j++] = true; /* read_bytes */
+		nulls[j++] = true; /* write_bytes */
 #endif
 
-	SpinLockRelease(&e->mutex);
+		Assert(j == PG_STAT_KCACHE_HISTORY_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(records);
+#endif
 
-	LWLockRelease(pgsk->lock);
+	return (Datum) 0;
 }
 
+#if PG_VERSION_NUM >= 90600
+#define PG_STAT_KCACHE_ACTIVITY_COLS	13
+
+/* A running statement, see pg_stat_kcache_activity() */
+typedef struct pgskActivity
+{
+	pgsk_queryid	queryid;
+	int				pid;
+	Oid				userid;
+	Oid				dbid;
+	TimestampTz		start;
+	pgskCounters	usage;
+} pgskActivity;
+
+#ifdef __linux__
 /*
- * Allocate a new hashtable entry.
- * caller must hold an exclusive lock on pgsk->lock
+ * Read a whole procfs file of the given process into buf, returning false if
+ * the process doesn't exist anymore or the file can't be read.
  */
-static pgskEntry *pgsk_entry_alloc(pgskHashKey *key)
+static bool
+pgsk_read_proc_file(int pid, const char *name, char *buf, size_t size)
 {
-	pgskEntry  *entry;
-	bool		found;
-
-	/* Make space if needed */
-	while (hash_get_num_entries(pgsk_hash) >= pgsk_max)
-		pgsk_entry_dealloc();
-
-	/* Find or create an entry with desired hash code */
-	entry = (pgskEntry *) hash_search(pgsk_hash, key, HASH_ENTER, &found);
-
-	if (!found)
-	{
-		/* New entry, initialize it */
-
-		/* reset the statistics */
-		memset(&entry->counters, 0, sizeof(pgskCounters) * PGSK_NUMKIND);
-		/* set the appropriate initial usage count */
-		entry->counters[0].usage = USAGE_INIT;
-		/* re-initialize the mutex each time ... we assume no one using it */
-		SpinLockInit(&entry->mutex);
-		entry->stats_since = GetCurrentTimestamp();
-	}
+	char		path[MAXPGPATH];
+	ssize_t		len;
+	int			fd;
 
-	return entry;
-}
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
 
-/*
- * qsort comparator for sorting into increasing usage order
- */
-static int
-entry_cmp(const void *lhs, const void *rhs)
-{
-	double		l_usage = (*(pgskEntry *const *) lhs)->counters[0].usage;
-	double		r_usage = (*(pgskEntry *const *) rhs)->counters[0].usage;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
 
-	if (l_usage < r_usage)
-		return -1;
-	else if (l_usage > r_usage)
-		return +1;
-	else
-		return 0;
+	return true;
 }
 
 /*
- * Deallocate least used entries.
- * Caller must hold an exclusive lock on pgsk->lock.
+ * Get the value of a "name: value" line of a procfs file, or -1
  */
-static void
-pgsk_entry_dealloc(void)
+static int64
+pgsk_proc_value(const char *buf, const char *name)
 {
-	HASH_SEQ_STATUS hash_seq;
-	pgskEntry **entries;
-	pgskEntry  *entry;
-	int			nvictims;
-	int			i;
-
-	/*
-	 * Sort entries by usage and deallocate USAGE_DEALLOC_PERCENT of them.
-	 * While we're scanning the table, apply the decay factor to the usage
-	 * values.
-	 */
-	entries = palloc(hash_get_num_entries(pgsk_hash) * sizeof(pgskEntry *));
+	size_t		namelen = strlen(name);
+	const char *line;
 
-	i = 0;
-	hash_seq_init(&hash_seq, pgsk_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	for (line = buf; line != NULL && *line != '\0'; line = strchr(line, '\n'))
 	{
-		entries[i++] = entry;
-		entry->counters[0].usage *= USAGE_DECREASE_FACTOR;
-	}
-
-	qsort(entries, i, sizeof(pgskEntry *), entry_cmp);
-
-	nvictims = Max(10, i * USAGE_DEALLOC_PERCENT / 100);
-	nvictims = Min(nvictims, i);
+		if (*line == '\n')
+			line++;
 
-	for (i = 0; i < nvictims; i++)
-	{
-		hash_search(pgsk_hash, &entries[i]->key, HASH_REMOVE, NULL);
+		if (strncmp(line, name, namelen) == 0 && line[namelen] == ':')
+			return (int64) strtoll(line + namelen + 1, NULL, 10);
 	}
 
-	pfree(entries);
+	return -1;
 }
 
-static void pgsk_entry_reset(void)
+/*
+ * Get the current process counters of another backend, in the same units as
+ * getrusage(), from its procfs files.  The CPU times are only precise up to
+ * the kernel tick.
+ */
+static bool
+pgsk_read_proc_usage(int pid, pgskCounters *usage)
 {
-	HASH_SEQ_STATUS hash_seq;
-	pgskEntry  *entry;
+	char		buf[4096];
+	char	   *p;
+	unsigned long minflt,
+				majflt,
+				utime,
+				stime;
+	long		ticks = sysconf(_SC_CLK_TCK);
+
+	memset(usage, 0, sizeof(pgskCounters));
+
+	/* The process name is between parentheses, and can contain spaces */
+	if (!pgsk_read_proc_file(pid, "stat", buf, sizeof(buf)) ||
+		(p = strrchr(buf, ')')) == NULL ||
+		sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+			   &minflt, &majflt, &utime, &stime) != 4)
+		return false;
+
+	usage->utime = (double) utime / ticks;
+	usage->stime = (double) stime / ticks;
+	usage->minflts = (int64) minflt;
+	usage->majflts = (int64) majflt;
+
+	/* The I/O counters may not be readable, e.g. without task accounting */
+	if (pgsk_read_proc_file(pid, "io", buf, sizeof(buf)))
+	{
+		int64		read_bytes = pgsk_proc_value(buf, "read_bytes");
+		int64		write_bytes = pgsk_proc_value(buf, "write_bytes");
 
-	LWLockAcquire(pgsk->lock, LW_EXCLUSIVE);
+		usage->reads = read_bytes >= 0 ? read_bytes / 512 : -1;
+		usage->writes = write_bytes >= 0 ? write_bytes / 512 : -1;
+	}
+	else
+		usage->reads = usage->writes = -1;
 
-	hash_seq_init(&hash_seq, pgsk_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	if (pgsk_read_proc_file(pid, "status", buf, sizeof(buf)))
 	{
-		hash_search(pgsk_hash, &entry->key, HASH_REMOVE, NULL);
+		usage->nvcsws = pgsk_proc_value(buf, "voluntary_ctxt_switches");
+		usage->nivcsws = pgsk_proc_value(buf, "nonvoluntary_ctxt_switches");
 	}
+	else
+		usage->nvcsws = usage->nivcsws = -1;
 
-	LWLockRelease(pgsk->lock);
+	return true;
 }
+#endif
 
 /*
- * Hooks
+ * Add an int64 counter of pg_stat_kcache_activity(), NULL if unknown
  */
+#define PGSK_ACTIVITY_DELTA(field, mult) \
+	do { \
+		if (cur.field >= 0) \
+			values[j++] = Int64GetDatum((cur.field - act->usage.field) * (mult)); \
+		else \
+			nulls[j++] = true; \
+	} while (0)
+#endif
 
-#if PG_VERSION_NUM >= 130000
 /*
- * Planner hook: forward to regular planner, but measure planning time
- * if needed.
+ * Return the top-level statements currently running, with the resources they
+ * used so far, computed from the procfs files of their backend.  Nothing is
+ * returned unless pg_stat_kcache.track_activity is enabled in the backends.
  */
-static PlannedStmt *
-pgsk_planner(Query *parse,
-			 const char *query_string,
-			 int cursorOptions,
-			 ParamListInfo boundParams)
+PGDLLEXPORT Datum
+pg_stat_kcache_activity(PG_FUNCTION_ARGS)
 {
-	PlannedStmt *result;
-
-	/* We can't process the query if no queryid has been computed. */
-	if (pgsk_enabled(nesting_level)
-		&& pgsk_track_planning
-		&& parse->queryId != UINT64CONST(0))
-	{
-		struct rusage *rusage_start = &plan_rusage_start[nesting_level];
-		struct rusage rusage_end;
-		pgskCounters counters;
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+#if PG_VERSION_NUM >= 90600
+	pgskActivity   *acts;
+	int				nacts = 0;
+	int				i;
+#endif
 
-		/* capture kernel usage stats in rusage_start */
-		getrusage(RUSAGE_SELF, rusage_start);
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
 
-		nesting_level++;
-		PG_TRY();
-		{
-			if (prev_planner_hook)
-				result = prev_planner_hook(parse, query_string, cursorOptions,
-										   boundParams);
-			else
-				result = standard_planner(parse, query_string, cursorOptions,
-										  boundParams);
-			nesting_level--;
-		}
-		PG_CATCH();
-		{
-			nesting_level--;
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-		/* capture kernel usage stats in rusage_end */
-		getrusage(RUSAGE_SELF, &rusage_end);
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-		pgsk_compute_counters(&counters, rusage_start, &rusage_end, NULL);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-		/* store current number of block reads and writes */
-		pgsk_entry_store(parse->queryId, PGSK_PLAN, counters);
+	MemoryContextSwitchTo(oldcontext);
 
-		if (pgsk_counters_hook)
-		    pgsk_counters_hook(&counters,
-							   query_string,
-							   nesting_level,
-							   PGSK_PLAN);
-	}
-	else
+#if PG_VERSION_NUM >= 90600
+	/* Copy the running statements, procfs is only read once done */
+	acts = palloc(sizeof(pgskActivity) * pgsk_parallel_num_slots());
+	for (i = 0; i < pgsk_parallel_num_slots(); i++)
 	{
-		/*
-		 * Even though we're not tracking planning for this statement, we
-		 * must still increment the nesting level, to ensure that functions
-		 * evaluated during planning are not seen as top-level calls.
-		 */
-		nesting_level++;
-		PG_TRY();
-		{
-			if (prev_planner_hook)
-				result = prev_planner_hook(parse, query_string, cursorOptions,
-										   boundParams);
-			else
-				result = standard_planner(parse, query_string, cursorOptions,
-										  boundParams);
-			nesting_level--;
-		}
-		PG_CATCH();
-		{
-			nesting_level--;
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
+		volatile pgskParallelSlot *slot = &pgsk->parallel[i];
+		pgskActivity *act = &acts[nacts];
+
+		/* Unlocked test, the backends only publish top-level statements */
+		if (slot->activity_queryid == UINT64CONST(0))
+			continue;
+
+		SpinLockAcquire(&slot->mutex);
+		act->queryid = slot->activity_queryid;
+		act->pid = slot->activity_pid;
+		act->userid = slot->activity_userid;
+		act->dbid = slot->activity_dbid;
+		act->start = slot->activity_start;
+		act->usage = slot->activity_usage;
+		SpinLockRelease(&slot->mutex);
+
+		if (act->queryid != UINT64CONST(0))
+			nacts++;
 	}
 
-	return result;
-}
-#endif
-
-static void
-pgsk_ExecutorStart (QueryDesc *queryDesc, int eflags)
-{
-	if (pgsk_enabled(nesting_level))
+	for (i = 0; i < nacts; i++)
 	{
-		struct rusage *rusage_start = &exec_rusage_start[nesting_level];
-
-		/* capture kernel usage stats in rusage_start */
-		getrusage(RUSAGE_SELF, rusage_start);
-
-#if PG_VERSION_NUM >= 90600
-		/* Save the queryid so parallel worker can retrieve it */
-		if (!IsParallelWorker())
-		{
-			pgsk_set_queryid(queryDesc->plannedstmt->queryId);
-		}
+		pgskActivity *act = &acts[i];
+		Datum		values[PG_STAT_KCACHE_ACTIVITY_COLS];
+		bool		nulls[PG_STAT_KCACHE_ACTIVITY_COLS];
+		int			j = 0;
+#ifdef __linux__
+		pgskCounters cur;
+
+		/* Skip the backends that exited in the meantime */
+		if (!pgsk_read_proc_usage(act->pid, &cur))
+			continue;
 #endif
-	}
 
-	/* give control back to PostgreSQL */
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
-}
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-/*
- * ExecutorRun hook: all we need do is track nesting depth
- */
-static void
-pgsk_ExecutorRun(QueryDesc *queryDesc,
-				 ScanDirection direction,
-#if PG_VERSION_NUM >= 90600
-				 uint64 count
-#else
-				 long count
-#endif
-#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
-				 ,bool execute_once
-#endif
-)
-{
-	nesting_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorRun)
-#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
-			prev_ExecutorRun(queryDesc, direction, count, execute_once);
-#else
-			prev_ExecutorRun(queryDesc, direction, count);
-#endif
-		else
-#if PG_VERSION_NUM >= 100000 && PG_VERSION_NUM < 180000
-			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		values[j++] = Int32GetDatum(act->pid);
+		values[j++] = ObjectIdGetDatum(act->userid);
+		values[j++] = ObjectIdGetDatum(act->dbid);
+		values[j++] = Int64GetDatum(act->queryid);
+		values[j++] = TimestampTzGetDatum(act->start);
+#ifdef __linux__
+		values[j++] = Float8GetDatumFast(Max(cur.utime - act->usage.utime, 0.0));
+		values[j++] = Float8GetDatumFast(Max(cur.stime - act->usage.stime, 0.0));
+		PGSK_ACTIVITY_DELTA(minflts, 1);
+		PGSK_ACTIVITY_DELTA(majflts, 1);
+		PGSK_ACTIVITY_DELTA(reads, RUSAGE_BLOCK_SIZE);
+		PGSK_ACTIVITY_DELTA(writes, RUSAGE_BLOCK_SIZE);
+		PGSK_ACTIVITY_DELTA(nvcsws, 1);
+		PGSK_ACTIVITY_DELTA(nivcsws, 1);
 #else
-			standard_ExecutorRun(queryDesc, direction, count);
-#endif
-		nesting_level--;
-	}
-	PG_CATCH();
-	{
-		nesting_level--;
-		PG_RE_THROW();
+		nulls[j++] = true; /* user_time */
+		nulls[j++] = true; /* system_time */
+		nulls[j++] = true; /* minflts */
+		nulls[j++] = true; /* majflts */
+		nulls[j++] = true; /* reads */
+		nulls[j++] = true; /* writes */
+		nulls[j++] = true; /* nvcsws */
+		nulls[j++] = true; /* nivcsws */
+#endif
+
+		Assert(j == PG_STAT_KCACHE_ACTIVITY_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	PG_END_TRY();
+
+	pfree(acts);
+#endif
+
+	return (Datum) 0;
 }
 
+#if PG_VERSION_NUM >= 90600
+#define PG_STAT_KCACHE_EVENTS_COLS		19
+#endif
+
 /*
- * ExecutorFinish hook: all we need do is track nesting depth
+ * Remove and return the oldest events of the events ring, at most max_events
+ * if not NULL.  Nothing is returned if pg_stat_kcache.events_size is 0.
  */
-static void
-pgsk_ExecutorFinish(QueryDesc *queryDesc)
+PGDLLEXPORT Datum
+pg_stat_kcache_events(PG_FUNCTION_ARGS)
 {
-	nesting_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorFinish)
-			prev_ExecutorFinish(queryDesc);
-		else
-			standard_ExecutorFinish(queryDesc);
-		nesting_level--;
-	}
-	PG_CATCH();
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+#if PG_VERSION_NUM >= 90600
+	int64			max_events;
+	pgskEvent	   *events;
+	int				nevents = 0;
+	uint64			head;
+	uint64			pos;
+	int				i;
+#endif
+
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+#if PG_VERSION_NUM >= 90600
+	if (!pgsk_events)
+		return (Datum) 0;
+
+	max_events = PG_ARGISNULL(0) ? pgsk_events_size : PG_GETARG_INT32(0);
+	if (max_events < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_events must not be negative")));
+	max_events = Min(max_events, pgsk_events_size);
+
+	/* Copy the events, to keep locking time short */
+	events = palloc(sizeof(pgskEvent) * Max(max_events, 1));
+
+	LWLockAcquire(pgsk_events->lock, LW_EXCLUSIVE);
+	pos = pg_atomic_read_u64(&pgsk_events->tail);
+	head = pg_atomic_read_u64(&pgsk_events->head);
+	while (pos < head && nevents < max_events)
 	{
-		nesting_level--;
-		PG_RE_THROW();
+		pgskEvent  *event = &pgsk_events->events[pos % pgsk_events_size];
+
+		/* Stop at the first event still being written */
+		if (pg_atomic_read_u64(&event->seq) != pos + 1)
+			break;
+		pg_read_barrier();
+
+		events[nevents++] = *event;
+		pos++;
 	}
-	PG_END_TRY();
-}
 
-static void
-pgsk_ExecutorEnd (QueryDesc *queryDesc)
-{
-	pgsk_queryid queryId;
-	struct rusage rusage_end;
-	pgskCounters counters;
+	/* The slots can only be reused once they're copied */
+	pg_memory_barrier();
+	pg_atomic_write_u64(&pgsk_events->tail, pos);
+	LWLockRelease(pgsk_events->lock);
 
-	if (pgsk_enabled(nesting_level))
+	for (i = 0; i < nevents; i++)
 	{
-		struct rusage *rusage_start = &exec_rusage_start[nesting_level];
+		pgskEvent  *event = &events[i];
+		pgskCounters *c = &event->counters;
+		Datum		values[PG_STAT_KCACHE_EVENTS_COLS];
+		bool		nulls[PG_STAT_KCACHE_EVENTS_COLS];
+		int			j = 0;
 
-		/* capture kernel usage stats in rusage_end */
-		getrusage(RUSAGE_SELF, &rusage_end);
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-#if PG_VERSION_NUM >= 90600
-		if (IsParallelWorker())
-			queryId = pgsk->queryids[ParallelLeaderProcNumber];
+		values[j++] = TimestampTzGetDatum(event->ts);
+		values[j++] = Int32GetDatum(event->pid);
+		values[j++] = Int64GetDatum(event->key.queryid);
+		values[j++] = BoolGetDatum(event->key.top);
+		values[j++] = ObjectIdGetDatum(event->key.userid);
+		values[j++] = ObjectIdGetDatum(event->key.dbid);
+		values[j++] = Float8GetDatumFast(c->utime);
+		values[j++] = Float8GetDatumFast(c->stime);
+#ifdef HAVE_GETRUSAGE
+		if (PGSK_HAS_RUSAGE(c))
+		{
+			values[j++] = Int64GetDatum(c->reads * RUSAGE_BLOCK_SIZE);
+			values[j++] = Int64GetDatum(c->writes * RUSAGE_BLOCK_SIZE);
+			values[j++] = Int64GetDatumFast(c->minflts);
+			values[j++] = Int64GetDatumFast(c->majflts);
+			values[j++] = Int64GetDatumFast(c->nvcsws);
+			values[j++] = Int64GetDatumFast(c->nivcsws);
+		}
 		else
+		{
+			nulls[j++] = true; /* reads */
+			nulls[j++] = true; /* writes */
+			nulls[j++] = true; /* minflts */
+			nulls[j++] = true; /* majflts */
+			nulls[j++] = true; /* nvcsws */
+			nulls[j++] = true; /* nivcsws */
+		}
+#else
+		nulls[j++] = true; /* reads */
+		nulls[j++] = true; /* writes */
+		nulls[j++] = true; /* minflts */
+		nulls[j++] = true; /* majflts */
+		nulls[j++] = true; /* nvcsws */
+		nulls[j++] = true; /* nivcsws */
 #endif
-		queryId = queryDesc->plannedstmt->queryId;
-
-		pgsk_compute_counters(&counters, rusage_start, &rusage_end, queryDesc);
-
-		/* store current number of block reads and writes */
-		pgsk_entry_store(queryId, PGSK_EXEC, counters);
+#ifdef PGSK_HAVE_PROC_IO
+		values[j++] = Int64GetDatumFast(c->rchar);
+		values[j++] = Int64GetDatumFast(c->wchar);
+		values[j++] = Int64GetDatumFast(c->read_bytes);
+		values[j++] = Int64GetDatumFast(c->write_bytes);
+#else
+		nulls[j++] = true; /* rchar */
+		nulls[j++] = true; /* wchar */
+		nulls[j++] = true; /* read_bytes */
+		nulls[j++] = true; /* write_bytes */
+#endif
+		values[j++] = Float8GetDatumFast(c->elapsed);
 
-		if (pgsk_counters_hook)
-		    pgsk_counters_hook(&counters,
-							   (const char *)queryDesc->sourceText,
-							   nesting_level,
-							   PGSK_EXEC);
+		Assert(j == PG_STAT_KCACHE_EVENTS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 
-	/* give control back to PostgreSQL */
-	if (prev_ExecutorEnd)
-		prev_ExecutorEnd(queryDesc);
-	else
-		standard_ExecutorEnd(queryDesc);
+	pfree(events);
+#endif
+
+	return (Datum) 0;
 }
 
 /*
- * Calculate hash value for a key
+ * Columns of pg_stat_kcache() 2.4 besides the per-kind counters: the key, the
+ * parallel workers and exclusive counters, and stats_since.
  */
-static uint32
-pgsk_hash_fn(const void *key, Size keysize)
+#define PG_STAT_KCACHE_EXTRA_COLS_V2_4	(4 + 5 + 6 + 1)
+#define PG_STAT_KCACHE_KIND_COLS_V2_4 \
+	((PG_STAT_KCACHE_COLS_V2_4 - PG_STAT_KCACHE_EXTRA_COLS_V2_4) / PGSK_NUMKIND)
+
+/* oid, then the same per-kind counters and stats_since as pg_stat_kcache() */
+#define PG_STAT_KCACHE_AGG_COLS \
+	(1 + PGSK_NUMKIND * PG_STAT_KCACHE_KIND_COLS_V2_4 + 1)
+
+PGDLLEXPORT Datum
+pg_stat_kcache_database(PG_FUNCTION_ARGS)
 {
-	const pgskHashKey *k = (const pgskHashKey *) key;
+	pg_stat_kcache_agg_internal(fcinfo, PGSK_AGG_DATABASE);
 
-	return hash_uint32((uint32) k->userid) ^
-		hash_uint32((uint32) k->dbid) ^
-		hash_uint32((uint32) k->queryid) ^
-		hash_uint32((uint32) k->top);
+	return (Datum) 0;
 }
 
-/*
- * Compare two keys - zero means match
- */
-static int
-pgsk_match_fn(const void *key1, const void *key2, Size keysize)
+PGDLLEXPORT Datum
+pg_stat_kcache_user(PG_FUNCTION_ARGS)
 {
-	const pgskHashKey *k1 = (const pgskHashKey *) key1;
-	const pgskHashKey *k2 = (const pgskHashKey *) key2;
+	pg_stat_kcache_agg_internal(fcinfo, PGSK_AGG_USER);
 
-	if (k1->userid == k2->userid &&
-		k1->dbid == k2->dbid &&
-		k1->queryid == k2->queryid &&
-		k1->top == k2->top)
-		return 0;
-	else
-		return 1;
+	return (Datum) 0;
 }
 
 /*
- * Reset statistics.
+ * Return the aggregated counters of all the databases or roles.  This only
+ * reads pg_stat_kcache.max_aggregates slots, whatever the number of entries.
  */
-PGDLLEXPORT Datum
-pg_stat_kcache_reset(PG_FUNCTION_ARGS)
+static void
+pg_stat_kcache_agg_internal(FunctionCallInfo fcinfo, pgskAggKind akind)
 {
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	pgskAggEntry   *aggs;
+	TimestampTz		stats_since;
+	int				n;
+
+	StaticAssertStmt((PG_STAT_KCACHE_COLS_V2_4 -
+					  PG_STAT_KCACHE_EXTRA_COLS_V2_4) % PGSK_NUMKIND == 0,
+					 "PG_STAT_KCACHE_EXTRA_COLS_V2_4 is out of sync");
+
 	if (!pgsk)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+							"allowed in this context")));
 
-	pgsk_entry_reset();
-	PG_RETURN_VOID();
-}
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-PGDLLEXPORT Datum
-pg_stat_kcache(PG_FUNCTION_ARGS)
-{
-	pg_stat_kcache_internal(fcinfo, PGSK_V2_0);
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	return (Datum) 0;
-}
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-PGDLLEXPORT Datum
-pg_stat_kcache_2_1(PG_FUNCTION_ARGS)
-{
-	pg_stat_kcache_internal(fcinfo, PGSK_V2_1);
+	MemoryContextSwitchTo(oldcontext);
 
-	return (Datum) 0;
-}
+	aggs = pgsk_aggs + (akind * pgsk_max_aggregates);
+	stats_since = pgsk->agg_stats_since;
 
-PGDLLEXPORT Datum
-pg_stat_kcache_2_2(PG_FUNCTION_ARGS)
-{
-	pg_stat_kcache_internal(fcinfo, PGSK_V2_2);
+	for (n = 0; n < pgsk_max_aggregates; n++)
+	{
+		pgskAggEntry   *agg = &aggs[n];
+		Datum			values[PG_STAT_KCACHE_AGG_COLS];
+		bool			nulls[PG_STAT_KCACHE_AGG_COLS];
+		pgskCounters	tmp[PGSK_NUMKIND];
+		Oid				oid;
+		int				i = 0;
+#ifdef PGSK_USE_ATOMICS
+		int				kind;
 
-	return (Datum) 0;
+		if (pgsk_agg_read_slot(agg, &oid) != PGSK_AGG_SLOT_USED)
+			continue;
+
+		for (kind = 0; kind < PGSK_NUMKIND; kind++)
+			pgsk_shared_counters_read(&agg->counters[kind], true, &tmp[kind]);
+#else
+		volatile pgskAggEntry *a = (volatile pgskAggEntry *) agg;
+		int				state;
+
+		SpinLockAcquire(&a->mutex);
+		state = a->state;
+		oid = a->oid;
+		memcpy(tmp, agg->counters, sizeof(tmp));
+		SpinLockRelease(&a->mutex);
+
+		if (state != PGSK_AGG_SLOT_USED)
+			continue;
+#endif
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(oid);
+		i = pgsk_fill_counters(values, nulls, i, tmp, 0, true, PGSK_V2_4);
+		values[i++] = TimestampTzGetDatum(stats_since);
+
+		Assert(i == PG_STAT_KCACHE_AGG_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 }
 
-PGDLLEXPORT Datum
-pg_stat_kcache_2_3(PG_FUNCTION_ARGS)
+#define PG_STAT_KCACHE_BENCH_COLS		4
+
+/*
+ * Emit one row of pg_stat_kcache_bench().
+ */
+static void
+pgsk_bench_report(Tuplestorestate *tupstore, TupleDesc tupdesc,
+				  const char *step, int iterations, instr_time duration)
 {
-	pg_stat_kcache_internal(fcinfo, PGSK_V2_3);
+	Datum		values[PG_STAT_KCACHE_BENCH_COLS];
+	bool		nulls[PG_STAT_KCACHE_BENCH_COLS];
+	int			i = 0;
 
-	return (Datum) 0;
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = CStringGetTextDatum(step);
+	values[i++] = Int64GetDatumFast((int64) iterations);
+	values[i++] = Float8GetDatumFast(INSTR_TIME_GET_MILLISEC(duration));
+	values[i++] = Float8GetDatumFast(INSTR_TIME_GET_DOUBLE(duration) * 1e9 /
+									 iterations);
+
+	Assert(i == PG_STAT_KCACHE_BENCH_COLS);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 }
 
-static void
-pg_stat_kcache_internal(FunctionCallInfo fcinfo, pgskVersion api_version)
+/*
+ * Time the given number of iterations of each step of the hot path: the
+ * resource usage capture, the computation of the counters and their storage
+ * in the shared hashtable, using the current settings.  The counters are
+ * stored in a dedicated entry which is removed at the end.  As the function is
+ * called from a statement, the entry is a nested one, so the database and role
+ * aggregates, which only cover the top-level statements, aren't updated.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_bench(PG_FUNCTION_ARGS)
 {
+	int				iterations = PG_GETARG_INT32(0);
 	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	MemoryContext	per_query_ctx;
 	MemoryContext	oldcontext;
 	TupleDesc		tupdesc;
 	Tuplestorestate	*tupstore;
-	HASH_SEQ_STATUS hash_seq;
+	pgskUsage		rusage_start;
+	pgskUsage		rusage_end;
+	pgskCounters	counters;
+	pgskHashKey		key;
 	pgskEntry		*entry;
-
+	instr_time		start;
+	instr_time		duration;
+	uint32			hashcode;
+	int				part;
+	int				i;
 
 	if (!pgsk)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
+	if (iterations <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of iterations must be greater than zero")));
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
 		ereport(ERROR,
@@ -1245,91 +8179,118 @@ pg_stat_kcache_internal(FunctionCallInfo fcinfo, pgskVersion api_version)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	LWLockAcquire(pgsk->lock, LW_SHARED);
+	/* Resource usage capture, done twice per statement */
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++)
+		pgsk_capture_usage(&rusage_end, pgsk_timing);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	pgsk_bench_report(tupstore, tupdesc, "capture", iterations, duration);
+
+	/* Computation of the counters from two captures */
+	pgsk_capture_usage(&rusage_start, pgsk_timing);
+	pgsk_capture_usage(&rusage_end, pgsk_timing);
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++)
+		pgsk_compute_counters(&counters, &rusage_start, &rusage_end, NULL);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	pgsk_bench_report(tupstore, tupdesc, "compute", iterations, duration);
+
+	/* Storage of the counters, the first iteration creates the entry */
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++)
+		pgsk_entry_store(PGSK_BENCH_QUERYID, PGSK_EXEC, counters, NULL, NULL);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	pgsk_bench_report(tupstore, tupdesc, "store", iterations, duration);
+
+	/* Don't leave the benchmark's entry behind */
+	pgsk_local_flush();
 
-	hash_seq_init(&hash_seq, pgsk_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		Datum			values[PG_STAT_KCACHE_COLS];
-		bool			nulls[PG_STAT_KCACHE_COLS];
-		volatile pgskCounters   *tmp;
-		int				i = 0;
-		int				kind, min_kind = 0;
-#ifdef HAVE_GETRUSAGE
-		int64			reads, writes;
-#endif
-		TimestampTz		stats_since;
+	key.userid = GetUserId();
+	key.dbid = MyDatabaseId;
+	key.queryid = PGSK_BENCH_QUERYID;
+	key.top = (nesting_level == 0);
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+	hashcode = pgsk_hash_fn(&key, sizeof(pgskHashKey));
+	part = PGSK_PARTITION(hashcode);
 
-		values[i++] = Int64GetDatum(entry->key.queryid);
-		if (api_version >= PGSK_V2_2)
-			values[i++] = BoolGetDatum(entry->key.top);
-		values[i++] = ObjectIdGetDatum(entry->key.userid);
-		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+	LWLockAcquire(pgsk->locks[part], LW_EXCLUSIVE);
+	entry = (pgskEntry *) hash_search_with_hash_value(pgsk_hash[part], &key,
+													  hashcode, HASH_FIND,
+													  NULL);
+	if (entry)
+		pgsk_entry_remove(part, entry);
+	LWLockRelease(pgsk->locks[part]);
 
-		/* planning time (kind == 0) is added in v2.2 */
-		if (api_version < PGSK_V2_2)
-			min_kind = 1;
+	return (Datum) 0;
+}
 
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgskEntry *e = (volatile pgskEntry *) entry;
+#define PG_STAT_KCACHE_INFO_COLS		14
 
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			stats_since = e->stats_since;
-			SpinLockRelease(&e->mutex);
-		}
+/*
+ * Return the counters of the extension's own activity.  They're all
+ * maintained with atomic operations, and the number of entries is read
+ * without locking the partitions, so this never waits for the backends.
+ */
+PGDLLEXPORT Datum
+pg_stat_kcache_info(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[PG_STAT_KCACHE_INFO_COLS];
+	bool		nulls[PG_STAT_KCACHE_INFO_COLS];
+	int64		entries = 0;
+	int			part;
+	int			i = 0;
 
-		for (kind = min_kind; kind < PGSK_NUMKIND; kind++)
-		{
-#ifdef HAVE_GETRUSAGE
-			reads = tmp[kind].reads * RUSAGE_BLOCK_SIZE;
-			writes = tmp[kind].writes * RUSAGE_BLOCK_SIZE;
-			values[i++] = Int64GetDatumFast(reads);
-			values[i++] = Int64GetDatumFast(writes);
-#else
-			nulls[i++] = true; /* reads */
-			nulls[i++] = true; /* writes */
-#endif
-			values[i++] = Float8GetDatumFast(tmp[kind].utime);
-			values[i++] = Float8GetDatumFast(tmp[kind].stime);
-			if (api_version >= PGSK_V2_1)
-			{
-#ifdef HAVE_GETRUSAGE
-				values[i++] = Int64GetDatumFast(tmp[kind].minflts);
-				values[i++] = Int64GetDatumFast(tmp[kind].majflts);
-				values[i++] = Int64GetDatumFast(tmp[kind].nswaps);
-				values[i++] = Int64GetDatumFast(tmp[kind].msgsnds);
-				values[i++] = Int64GetDatumFast(tmp[kind].msgrcvs);
-				values[i++] = Int64GetDatumFast(tmp[kind].nsignals);
-				values[i++] = Int64GetDatumFast(tmp[kind].nvcsws);
-				values[i++] = Int64GetDatumFast(tmp[kind].nivcsws);
-#else
-				nulls[i++] = true; /* minflts */
-				nulls[i++] = true; /* majflts */
-				nulls[i++] = true; /* nswaps */
-				nulls[i++] = true; /* msgsnds */
-				nulls[i++] = true; /* msgrcvs */
-				nulls[i++] = true; /* nsignals */
-				nulls[i++] = true; /* nvcsws */
-				nulls[i++] = true; /* nivcsws */
-#endif
-			}
-		}
-		if (api_version >= PGSK_V2_3)
-			values[i++] = TimestampTzGetDatum(stats_since);
+	if (!pgsk)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_kcache must be loaded via shared_preload_libraries")));
 
-		Assert(i == (api_version == PGSK_V2_0 ? PG_STAT_KCACHE_COLS_V2_0 :
-					 api_version == PGSK_V2_1 ? PG_STAT_KCACHE_COLS_V2_1 :
-					 api_version == PGSK_V2_2 ? PG_STAT_KCACHE_COLS_V2_2 :
-					 api_version == PGSK_V2_3 ? PG_STAT_KCACHE_COLS_V2_3 :
-					 -1 /* fail if you forget to update this assert */ ));
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	for (part = 0; part < PGSK_NUM_PARTITIONS; part++)
+		entries += hash_get_num_entries(pgsk_hash[part]);
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_INSERTS));
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_DEALLOCS));
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_EVICTED));
+	values[i++] = Float8GetDatumFast(pgsk_stat_read(PGSK_STAT_DEALLOC_TIME) /
+									 1000.0);
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_PROMOTIONS));
+	values[i++] = Int64GetDatumFast(entries);
+	values[i++] = Int64GetDatumFast((int64) pgsk_max);
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_SAVES));
+	values[i++] = Float8GetDatumFast(pgsk_stat_read(PGSK_STAT_SAVE_TIME) /
+									 1000.0);
+	values[i++] = Float8GetDatumFast(pgsk_stat_read(PGSK_STAT_LOAD_TIME) /
+									 1000.0);
+	values[i++] = TimestampTzGetDatum((TimestampTz)
+									  pgsk_stat_read(PGSK_STAT_RESET));
+#if PG_VERSION_NUM >= 90600
+	if (pgsk_events)
+	{
+		values[i++] = Int64GetDatumFast((int64)
+										pg_atomic_read_u64(&pgsk_events->head));
+		values[i++] = Int64GetDatumFast((int64)
+										pg_atomic_read_u64(&pgsk_events->dropped));
+	}
+	else
+#endif
+	{
+		nulls[i++] = true;		/* events_written */
+		nulls[i++] = true;		/* events_dropped */
 	}
+	values[i++] = Int64GetDatumFast((int64) pgsk_stat_read(PGSK_STAT_AGG_DROPPED));
+
+	Assert(i == PG_STAT_KCACHE_INFO_COLS);
 
-	LWLockRelease(pgsk->lock);
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
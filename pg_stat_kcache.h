@@ -5,7 +5,8 @@
 #define PG_STAT_KCACHE_COLS_V2_1    15
 #define PG_STAT_KCACHE_COLS_V2_2    28
 #define PG_STAT_KCACHE_COLS_V2_3    29
-#define PG_STAT_KCACHE_COLS         29 /* maximum of above */
+#define PG_STAT_KCACHE_COLS_V2_4    72
+#define PG_STAT_KCACHE_COLS         73 /* maximum of above, + 1 for pg_stat_kcache_changes() */
 
 /* ru_inblock block size is 512 bytes with Linux
  * see http://lkml.indiana.edu/hypermail/linux/kernel/0703.2/0937.html
@@ -23,7 +24,15 @@
  *   - ru_msgsnd
  *   - ru_msgrcv
  *   - ru_nsignals
+ *
+ * New fields are always appended after the getrusage ones, so that the
+ * existing fields keep their offsets.  Extensions using pgsk_counters_hook
+ * should check at load time that pgsk_counters_size is at least the
+ * sizeof(pgskCounters) they were compiled with, and PGSK_COUNTERS_VERSION is
+ * bumped whenever fields are added.
 */
+#define PGSK_COUNTERS_VERSION	2
+
 typedef struct pgskCounters
 {
 	double			usage;		/* usage factor */
@@ -43,6 +52,30 @@ typedef struct pgskCounters
 	int64			nvcsws;		/* voluntary context witches */
 	int64			nivcsws;	/* unvoluntary context witches */
 #endif
+/* The following fields are only available with PGSK_COUNTERS_VERSION 2 and later */
+	int64			calls;		/* number of measured planning or executions */
+/* These fields are only maintained on Linux, from /proc/self/io */
+	int64			rchar;		/* bytes read, including from the page cache */
+	int64			wchar;		/* bytes written, including to the page cache */
+	int64			syscr;		/* read syscalls */
+	int64			syscw;		/* write syscalls */
+	int64			read_bytes;	/* bytes read from the storage layer */
+	int64			write_bytes;	/* bytes sent to the storage layer */
+	int64			cancelled_write_bytes;	/* written bytes later truncated */
+/* These fields are only maintained on Linux, from perf_event_open(2) */
+	int64			cycles;		/* CPU cycles */
+	int64			instructions;	/* retired instructions */
+	int64			llc_misses;	/* last level cache misses */
+	int64			branch_misses;	/* mispredicted branches */
+	int64			dtlb_misses;	/* data TLB read misses */
+/* This field is always used */
+	float8			elapsed;	/* wall clock time */
+/* This field is only maintained with PostgreSQL 18 and later */
+	int64			io_worker_reads;	/* shared buffers read, possibly by
+										   the I/O workers */
+/* This field is always used */
+	int64			rusage_calls;	/* calls that measured the getrusage()
+									   counters, see pg_stat_kcache.timing */
 } pgskCounters;
 
 typedef enum pgskStoreKind
@@ -66,4 +99,7 @@ typedef void (*pgsk_counters_hook_type) (
 		pgskStoreKind kind);
 extern PGDLLIMPORT pgsk_counters_hook_type pgsk_counters_hook;
 
+/* sizeof(pgskCounters) in the loaded pg_stat_kcache */
+extern PGDLLIMPORT const Size pgsk_counters_size;
+
 #endif
@@ -0,0 +1,28 @@
+-- eviction strategies, with a single entry per partition
+--
+-- Run by make installcheck-eviction once per pg_stat_kcache.eviction strategy,
+-- with pg_stat_kcache.eviction_threshold set to 16 in the server configuration.
+CREATE EXTENSION pg_stat_statements;
+CREATE EXTENSION pg_stat_kcache;
+
+SELECT current_setting('pg_stat_kcache.eviction_threshold') = '16'
+  AS threshold_ok;
+
+SET pg_stat_statements.track = 'all';
+SET pg_stat_kcache.track = 'all';
+CREATE FUNCTION pgsk_distinct_queries(n integer)
+  RETURNS void AS $$
+BEGIN
+  FOR i IN 1..n LOOP
+    EXECUTE 'SELECT ' || array_to_string(array(SELECT generate_series(1, i)), ', ');
+  END LOOP;
+END
+$$ LANGUAGE plpgsql;
+SELECT pg_stat_kcache_reset();
+
+SELECT pgsk_distinct_queries(40);
+
+SELECT evicted > 0 AS evicted_ok, entries <= 16 AS entries_ok
+FROM pg_stat_kcache_info;
+
+DROP FUNCTION pgsk_distinct_queries(integer);
@@ -1,6 +1,9 @@
 CREATE EXTENSION pg_stat_statements;
 CREATE EXTENSION pg_stat_kcache;
 
+-- some features need PostgreSQL 9.6 or above
+SELECT current_setting('server_version_num')::integer >= 90600 AS pg96 \gset
+
 -- first make sure that catcache is loaded to avoid physical reads
 SELECT count(*) >= 0 FROM pg_stat_kcache;
 SELECT pg_stat_kcache_reset();
@@ -10,6 +13,10 @@ SELECT 1 AS dummy;
 
 SELECT count(*) FROM pg_stat_kcache WHERE datname = current_database();
 
+SELECT exec_calls > 0 AS exec_calls_ok FROM pg_stat_kcache_database WHERE datname = current_database();
+
+SELECT entries > 0 AS entries_ok, inserts >= entries AS inserts_ok FROM pg_stat_kcache_info;
+
 SELECT count(*) FROM pg_stat_kcache_detail WHERE datname = current_database() AND (query = 'SELECT $1 AS dummy' OR query = 'SELECT ? AS dummy;');
 
 SELECT exec_reads, exec_reads_blks, exec_writes, exec_writes_blks
@@ -28,6 +35,241 @@ FROM pg_stat_kcache_detail
 WHERE datname = current_database()
 AND query LIKE 'SELECT count(*) FROM test%';
 
+-- targeted reset
+SELECT pg_stat_kcache_reset(NULL, d.oid, NULL)
+FROM pg_database d WHERE datname = current_database();
+
+SELECT count(*)
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+-- histogram-only reset keeps the entries and their counters
+SELECT count(*) FROM test;
+
+SELECT count(*) > 0 AS histograms_ok
+FROM pg_stat_kcache_histogram() h
+JOIN pg_database d ON d.oid = h.dbid
+WHERE d.datname = current_database()
+AND h.count > 0
+AND h.queryid IN (SELECT queryid FROM pg_stat_statements
+                  WHERE query LIKE 'SELECT count(*) FROM test%');
+
+SELECT pg_stat_kcache_reset(NULL, d.oid, NULL, true)
+FROM pg_database d WHERE datname = current_database();
+
+SELECT exec_calls, exec_user_time + exec_system_time > 0 AS cpu_time_ok
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+SELECT count(*)
+FROM pg_stat_kcache_histogram() h
+JOIN pg_database d ON d.oid = h.dbid
+WHERE d.datname = current_database()
+AND h.count > 0
+AND h.queryid IN (SELECT queryid FROM pg_stat_statements
+                  WHERE query LIKE 'SELECT count(*) FROM test%');
+
+-- lazy reset zeroes the entries but keeps them
+SELECT pg_stat_kcache_reset_lazy();
+
+SELECT exec_calls, exec_user_time + exec_system_time AS cpu_time
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+-- locally accumulated counters are flushed at commit, and discarded by a reset
+SET pg_stat_kcache.flush_interval = '1h';
+SELECT pg_stat_kcache_reset();
+
+SELECT count(*) FROM test;
+
+SELECT exec_calls
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+BEGIN;
+SELECT count(*) FROM test;
+SELECT pg_stat_kcache_reset();
+COMMIT;
+
+SELECT count(*)
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+RESET pg_stat_kcache.flush_interval;
+
+-- events ring, expects pg_stat_kcache.events_size to be set
+SELECT count(*) >= 0 AS drained FROM pg_stat_kcache_events();
+
+SELECT count(*) FROM test;
+SELECT count(*) FROM test;
+
+SELECT count(*) = 2 OR NOT :pg96 AS events_ok
+FROM pg_stat_kcache_events()
+WHERE pid = pg_backend_pid()
+AND queryid IN (SELECT queryid FROM pg_stat_statements
+                WHERE query LIKE 'SELECT count(*) FROM test%');
+
+-- each event is only returned once
+SELECT count(*)
+FROM pg_stat_kcache_events()
+WHERE pid = pg_backend_pid()
+AND queryid IN (SELECT queryid FROM pg_stat_statements
+                WHERE query LIKE 'SELECT count(*) FROM test%');
+
+-- at most max_events are returned, the ring has at least the previous query
+SELECT count(*) = 1 OR NOT :pg96 AS events_ok FROM pg_stat_kcache_events(1);
+
+-- history ring, expects pg_stat_kcache.history_size to be set and
+-- pg_stat_kcache.history_interval to be 1s
+SELECT pg_sleep(3);
+
+SELECT count(*) > 0 OR NOT :pg96 AS history_ok
+FROM pg_stat_kcache_history()
+WHERE exec_calls > 0
+AND queryid IN (SELECT queryid FROM pg_stat_statements
+                WHERE query LIKE 'SELECT count(*) FROM test%');
+
+SELECT count(*) FROM pg_stat_kcache_history(now() + interval '1 day');
+SELECT count(*) FROM pg_stat_kcache_history(NULL, now() - interval '1 day');
+
+-- per-role aggregates, the slot of a role is released when it's dropped
+CREATE ROLE regress_pgsk_role;
+SET ROLE regress_pgsk_role;
+SELECT 1 AS dummy;
+RESET ROLE;
+
+SELECT rolname, exec_calls > 0 AS exec_calls_ok
+FROM pg_stat_kcache_user
+WHERE rolname = 'regress_pgsk_role';
+
+SELECT oid AS regress_role_oid FROM pg_roles WHERE rolname = 'regress_pgsk_role' \gset
+DROP ROLE regress_pgsk_role;
+
+SELECT count(*) FROM pg_stat_kcache_user() WHERE userid = :regress_role_oid;
+
+SELECT aggregates_dropped FROM pg_stat_kcache_info;
+
+-- the getrusage() counters aren't measured with the clock timing method
+SET pg_stat_kcache.timing = clock;
+SELECT pg_stat_kcache_reset();
+
+SELECT count(*) FROM test;
+
+SELECT exec_calls, exec_user_time + exec_system_time > 0 AS cpu_time_ok,
+       exec_reads IS NULL AS reads_null, exec_minflts IS NULL AS minflts_null
+FROM pg_stat_kcache_detail
+WHERE datname = current_database()
+AND query LIKE 'SELECT count(*) FROM test%';
+
+SELECT h.metric, sum(h.count) AS count
+FROM pg_stat_kcache_histogram() h
+JOIN pg_database d ON d.oid = h.dbid
+WHERE d.datname = current_database()
+AND h.queryid IN (SELECT queryid FROM pg_stat_statements
+                  WHERE query LIKE 'SELECT count(*) FROM test%')
+GROUP BY h.metric
+ORDER BY h.metric;
+
+RESET pg_stat_kcache.timing;
+
+-- stats file format, also returned by pg_stat_kcache_export()
+WITH e AS (SELECT pg_stat_kcache_export() AS b),
+h AS (
+    SELECT b,
+           get_byte(b, 0) + get_byte(b, 1) * 256 + get_byte(b, 2) * 65536
+             + get_byte(b, 3)::bigint * 16777216 AS magic,
+           get_byte(b, 4) + get_byte(b, 5) * 256 AS version,
+           get_byte(b, 6) + get_byte(b, 7) * 256 AS flags,
+           get_byte(b, 8) + get_byte(b, 9) * 256 + get_byte(b, 10) * 65536
+             + get_byte(b, 11)::bigint * 16777216 AS record_size,
+           get_byte(b, 12) + get_byte(b, 13) * 256 + get_byte(b, 14) * 65536
+             + get_byte(b, 15)::bigint * 16777216 AS nrecords
+    FROM e)
+SELECT magic = x'4B534750'::bigint AS magic_ok, version, flags, record_size,
+       nrecords > 0 AS nrecords_ok,
+       length(b) = 24 + nrecords * record_size AS length_ok
+FROM h;
+
+-- activity of the running top-level statements
+SET pg_stat_kcache.track_activity = on;
+
+SELECT count(*) = 1 OR NOT :pg96 AS activity_ok,
+       bool_and(query_start IS NOT NULL AND (user_time >= 0 OR user_time IS NULL))
+         OR NOT :pg96 AS usage_ok
+FROM pg_stat_kcache_activity()
+WHERE pid = pg_backend_pid();
+
+RESET pg_stat_kcache.track_activity;
+
+SELECT count(*)
+FROM pg_stat_kcache_activity()
+WHERE pid = pg_backend_pid();
+
+-- entries changed since a given generation, this session's own queries
+-- being untracked except the one to report
+SET pg_stat_kcache.track = 'none';
+SELECT max(generation) AS generation FROM pg_stat_kcache_changes(0) \gset
+RESET pg_stat_kcache.track;
+
+SELECT min(i) FROM test;
+
+SET pg_stat_kcache.track = 'none';
+SELECT s.query LIKE 'SELECT min(i) FROM test%' AS query_ok, c.top, c.exec_calls,
+       c.generation > :generation AS generation_ok
+FROM pg_stat_kcache_changes(:generation) c
+JOIN pg_database d ON d.oid = c.dbid
+JOIN pg_stat_statements s ON s.queryid = c.queryid AND s.userid = c.userid
+  AND s.dbid = c.dbid
+WHERE d.datname = current_database();
+
+-- nothing changed since the latest generation
+SELECT max(generation) AS generation FROM pg_stat_kcache_changes(0) \gset
+
+SELECT count(*)
+FROM pg_stat_kcache_changes(:generation) c
+JOIN pg_database d ON d.oid = c.dbid
+WHERE d.datname = current_database();
+RESET pg_stat_kcache.track;
+
+-- filtered pg_stat_kcache(), a NULL argument meaning no restriction
+CREATE FUNCTION pgsk_filter_diff(p_dbid oid, p_userid oid, p_queryid bigint)
+  RETURNS bigint AS $$
+  WITH f AS (
+    SELECT queryid, top, userid, dbid
+    FROM pg_stat_kcache(p_dbid, p_userid, p_queryid)),
+  w AS (
+    SELECT queryid, top, userid, dbid
+    FROM pg_stat_kcache()
+    WHERE (p_dbid IS NULL OR dbid = p_dbid)
+    AND (p_userid IS NULL OR userid = p_userid)
+    AND (p_queryid IS NULL OR queryid = p_queryid))
+  SELECT count(*) FROM (
+    (SELECT * FROM f EXCEPT ALL SELECT * FROM w)
+    UNION ALL
+    (SELECT * FROM w EXCEPT ALL SELECT * FROM f)) diff;
+$$ LANGUAGE sql;
+
+SELECT d.oid AS dbid FROM pg_database d
+WHERE datname = current_database() \gset
+SELECT r.oid AS userid FROM pg_roles r WHERE rolname = current_user \gset
+SELECT queryid FROM pg_stat_statements
+WHERE query LIKE 'SELECT min(i) FROM test%' \gset
+
+SELECT pgsk_filter_diff(:dbid, NULL, NULL) AS by_dbid,
+       pgsk_filter_diff(NULL, :userid, NULL) AS by_userid,
+       pgsk_filter_diff(NULL, NULL, :queryid) AS by_queryid,
+       pgsk_filter_diff(:dbid, :userid, :queryid) AS by_all,
+       pgsk_filter_diff(NULL, NULL, NULL) AS unfiltered;
+
+SELECT top, exec_calls FROM pg_stat_kcache(:dbid, :userid, :queryid);
+
+DROP FUNCTION pgsk_filter_diff(oid, oid, bigint);
+
 -- dummy nested query
 SET pg_stat_statements.track = 'all';
 SET pg_stat_statements.track_planning = TRUE;
@@ -46,3 +288,14 @@ $$ LANGUAGE plpgsql;
 SELECT plpgsql_nested();
 
 SELECT COUNT(*) FROM pg_stat_kcache_detail WHERE top IS FALSE;
+
+-- the exclusive counters of the top-level statement exclude the nested ones
+SELECT nested_calls > 0 AS nested_ok,
+       exec_self_user_time <= exec_user_time AS user_time_ok,
+       exec_self_system_time <= exec_system_time AS system_time_ok,
+       exec_self_reads <= exec_reads OR exec_reads IS NULL AS reads_ok,
+       exec_self_writes <= exec_writes OR exec_writes IS NULL AS writes_ok,
+       exec_self_elapsed_time <= exec_elapsed_time AS elapsed_time_ok
+FROM pg_stat_kcache_detail
+WHERE top AND datname = current_database()
+AND query LIKE 'SELECT plpgsql_nested()%';